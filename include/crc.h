@@ -263,6 +263,21 @@ uint32_t crc32_ieee_update(uint32_t crc, const uint8_t *data, size_t len);
 uint32_t crc32_c(uint32_t crc, const uint8_t *data,
 		 size_t len, bool first_pkt, bool last_pkt);
 
+/**
+ * @brief Update a CRC32C (Castagnoli) checksum.
+ *
+ * Same checksum as @ref crc32_c, computed a byte at a time. The initial
+ * value is 0 and the result of a call is the seed of the next one, as with
+ * @ref crc32_ieee_update.
+ *
+ * @param crc CRC32C checksum that needs to be updated.
+ * @param data Pointer to data on which the CRC should be calculated.
+ * @param len Data length.
+ *
+ * @return CRC32C value.
+ */
+uint32_t crc32_c_update(uint32_t crc, const uint8_t *data, size_t len);
+
 /**
  * @brief Compute CCITT variant of CRC 8
  *
@@ -433,6 +448,27 @@ static inline uint32_t crc_by_type(enum crc_type type, const uint8_t *src, size_
 	return -1;
 }
 
+/**
+ * @brief CRC provider
+ *
+ * Checksums used by the storage modules to protect their metadata and data.
+ * Both functions can be chained: the value returned for a buffer is the seed
+ * used to continue with the next buffer. A provider selects the algorithm
+ * and may be backed by a hardware CRC unit.
+ */
+struct crc_provider {
+	/** 8 bit checksum, seeded with CRC8_CCITT_INITIAL_VALUE */
+	uint8_t (*crc8)(uint8_t seed, const void *buf, size_t len);
+	/** 32 bit checksum, seeded with 0 */
+	uint32_t (*crc32)(uint32_t seed, const uint8_t *data, size_t len);
+};
+
+/** @ref crc8_ccitt and @ref crc32_ieee_update, the default provider */
+extern const struct crc_provider crc_provider_ieee;
+
+/** @ref crc8_ccitt and @ref crc32_c_update */
+extern const struct crc_provider crc_provider_crc32c;
+
 /**
  * @}
  */
@@ -19,6 +19,7 @@
 // #include <zephyr/kernel.h>
 
 #include <fil.h>
+#include <crc.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -141,6 +142,12 @@ extern "C"
         /**< The value flash takes when it is erased. This is read from
          * flash parameters and initialized upon call to fcb_init.
          */
+
+        const struct crc_provider *f_crc;
+        /**< Checksum of the elements, NULL for crc_provider_ieee. Only its
+         * 8 bit checksum is used, all users of a partition must select the
+         * same one.
+         */
 #ifdef CONFIG_FCB_ALLOW_FIXED_ENDMARKER
         const uint8_t f_flags;
         /**< Flags for configuring the FCB. */
@@ -29,9 +29,15 @@ extern "C"
         int (*erase)(off_t offset, size_t len);
         int (*mutex_lock_forever)(void);
         int (*mutex_unlock)(void);
+        /* optional, copy len bytes inside the device from src to an erased
+         * area at dst. NULL when the device can not copy by itself.
+         */
+        int (*copy)(off_t src, off_t dst, size_t len);
     };
 
     int fil_init(struct fil *fil, struct flash_parameters *params);
+    /* copy of the interface passed to fil_init(), to restore it later */
+    int fil_get(struct fil *fil, struct flash_parameters *params);
     bool fil_is_ready();
 #ifdef __cplusplus
 }
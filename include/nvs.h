@@ -12,6 +12,7 @@
 #include <stdint.h>
 
 #include <fil.h>
+#include <crc.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -34,6 +35,155 @@ extern "C" {
  * @{
  */
 
+/**
+ * @brief Entry identifier type
+ *
+ * Identifiers are 16 bit wide by default. With CONFIG_NVS_ID_32BIT they are
+ * 32 bit wide, which allows applications to use structured ids (e.g. a
+ * namespace in the high half and a key index in the low half) instead of
+ * hashing keys into a small id space. The all-ones id is reserved for
+ * internal use in both modes.
+ */
+#ifdef CONFIG_NVS_ID_32BIT
+typedef uint32_t nvs_id_t;
+#define NVS_ID_MAX 0xFFFFFFFEU
+#else
+typedef uint16_t nvs_id_t;
+#define NVS_ID_MAX 0xFFFEU
+#endif
+
+/**
+ * @name Garbage collection policies (CONFIG_NVS_GC_POLICY)
+ * @{
+ */
+/** Collect the sector with the best (free space * age) / cost ratio */
+#define NVS_GC_COST_BENEFIT 0
+/** Collect the sector with the least live data */
+#define NVS_GC_GREEDY 1
+/** @} */
+
+/**
+ * @brief Per sector state of the garbage collection policy mode
+ *
+ * With CONFIG_NVS_GC_POLICY the sectors are no longer used in ring order:
+ * each sector gets a sequence number when it is opened and the order of the
+ * sectors is kept in RAM in a list built at mount.
+ */
+struct nvs_sector_info {
+	/** Sequence number of the sector, 0 if the sector is free */
+	uint32_t seq;
+	/** Bytes of data and allocation table entries still live */
+	uint32_t live;
+	/** Next older sector */
+	uint16_t prev;
+	/** Next newer sector, the sector after the write sector is free */
+	uint16_t next;
+};
+
+/**
+ * @brief Write-back slot, holds the pending value of a frequently written id
+ *
+ * The application provides the slots through nvs_fs.wb_slots with @p id,
+ * @p data and @p size set, the other members are managed by NVS.
+ */
+struct nvs_wb_slot {
+	/** Id kept in RAM */
+	nvs_id_t id;
+	/** Buffer for the pending value */
+	void *data;
+	/** Size of @p data, larger values are written through to flash */
+	size_t size;
+	/** Length of the pending value */
+	size_t len;
+	/** impl_uptime_ms() when the slot became dirty */
+	uint32_t dirty_since;
+	/** Sequence counter, odd while the slot is updated */
+	uint32_t seq;
+	/** The slot holds a value that is not on flash yet */
+	bool dirty;
+};
+
+/**
+ * @brief Record of an NVS image, see nvs_export() and nvs_import()
+ *
+ * An image is a sequence of records, each one followed by @p len bytes of
+ * value. Fields are in host byte order. When an id appears more than once
+ * the last record wins.
+ */
+struct nvs_image_rec {
+	/** Id of the entry */
+	uint32_t id;
+	/** Length of the value that follows, 0 deletes the entry */
+	uint32_t len;
+};
+
+/**
+ * @brief Destination of an image written by nvs_export()
+ */
+struct nvs_image_sink {
+	/** Append len bytes to the image, returns 0 or -ERRNO */
+	int (*write)(void *ctx, const void *data, size_t len);
+	/** Context passed to @p write */
+	void *ctx;
+	/** Buffer for one value, at least as large as the largest value */
+	uint8_t *buf;
+	/** Size of @p buf */
+	size_t buf_size;
+};
+
+/**
+ * @brief Origin of an image read by nvs_import()
+ */
+struct nvs_image_source {
+	/** Read up to len bytes of the image, returns the number of bytes read
+	 * (less than len only at the end of the image) or -ERRNO
+	 */
+	ssize_t (*read)(void *ctx, void *data, size_t len);
+	/** Context passed to @p read */
+	void *ctx;
+	/** Staging buffer for values, NULL to program them in NVS_BLOCK_SIZE
+	 * pieces. A larger buffer gives fewer, longer flash programs.
+	 */
+	uint8_t *buf;
+	/** Size of @p buf, at least the write block size */
+	size_t buf_size;
+};
+
+/**
+ * @brief Space and wear statistics of a file system
+ *
+ * The application provides the structure through nvs_fs.stats, NVS computes
+ * it at mount and keeps it up to date as entries are written and sectors are
+ * garbage collected. Use nvs_stats_get() to read a consistent copy.
+ */
+struct nvs_stats {
+	/** Bytes of data and allocation table entries of the live values */
+	uint32_t live_bytes;
+	/** Bytes of replaced and deleted values, delete entries, special
+	 * entries and unused space of closed sectors, recovered by gc. Only
+	 * filled by nvs_stats_get().
+	 */
+	uint32_t dead_bytes;
+	/** Number of delete entries in flash */
+	uint32_t tombstones;
+	/** Number of closed sectors, waiting to be garbage collected */
+	uint16_t closed_sectors;
+	/** Number of sectors garbage collected since mount */
+	uint32_t gc_count;
+	/** Bytes of data and allocation table entries copied by gc since mount */
+	uint64_t gc_bytes;
+	/** Write amplification in hundredths, see nvs_write_amp(). Only filled
+	 * by nvs_stats_get().
+	 */
+	uint32_t write_amp;
+	/** Erase counters provided by the application (sector_count entries),
+	 * NULL to not count erases. They are only incremented, an application
+	 * that keeps them across mounts gets the lifetime erase count of each
+	 * sector.
+	 */
+	uint32_t *erase_count;
+};
+
 /**
  * @brief Non-volatile Storage File system structure
  */
@@ -44,24 +194,131 @@ struct nvs_fs {
 	 * Addresses are stored as uint32_t:
 	 * - high 2 bytes correspond to the sector
 	 * - low 2 bytes are the offset in the sector
+	 * With CONFIG_NVS_WIDE_ADDR the offset takes the low
+	 * CONFIG_NVS_WIDE_ADDR_SECT_SHIFT bits instead.
 	 */
 	uint32_t ate_wra;
 	/** Data write address */
 	uint32_t data_wra;
 	/** File system is split into sectors, each sector must be multiple of erase-block-size */
-	uint16_t sector_size;
+	uint32_t sector_size;
 	/** Number of sectors in the file system */
 	uint16_t sector_count;
 	/** Flag indicating if the file system is initialized */
 	bool ready;
+	/** Mount without writing to flash, see nvs_mount() */
+	bool read_only;
 	int (*impl_init)();
 	int (*impl_mutex_lock_forever)();
 	int (*impl_mutex_unlock)();
+	/** Optional monotonic millisecond clock, used by @p wb_max_age_ms */
+	uint32_t (*impl_uptime_ms)();
+	/** Optional executor used at mount, NULL to mount on the calling thread.
+	 * It runs job(ctx, idx) once for every idx below count, possibly
+	 * concurrently, and returns once all of them have returned. The lookup
+	 * cache is then rebuilt with one job per sector, so the flash read
+	 * routine must be safe to call from several threads.
+	 */
+	int (*impl_parallel)(void (*job)(void *ctx, uint32_t idx), void *ctx,
+			     uint32_t count);
 	/** Flash memory parameters structure */
 	const struct flash_parameters *flash_parameters;
-#if CONFIG_NVS_LOOKUP_CACHE
-	uint32_t lookup_cache[CONFIG_NVS_LOOKUP_CACHE_SIZE];
-#endif
+	/** Checksums of entries and data, NULL for crc_provider_ieee. All
+	 * mounts of a partition must use the same provider.
+	 */
+	const struct crc_provider *crc;
+	/** Lookup cache storage provided by the caller, NULL to disable the cache.
+	 * Each entry holds the address of the most recent allocation table
+	 * entry of the ids that hash to it. Only used with CONFIG_NVS_LOOKUP_CACHE.
+	 */
+	uint32_t *lookup_cache;
+	/** Number of entries in @p lookup_cache, a power of 2 is recommended */
+	size_t lookup_cache_size;
+	/** Return from mount before the lookup cache is built, it is then built
+	 * one sector at a time by nvs_lookup_cache_step() and by reads of ids
+	 * it does not hold yet. Ignored in the gc policy mode.
+	 */
+	bool lookup_cache_lazy;
+	/** Next allocation table entry to add to the lookup cache, all ids not
+	 * found in the cache are looked up from there. 0xffffffff once the
+	 * cache is complete.
+	 */
+	uint32_t lookup_cache_next;
+	/** Erase sequence counter, odd while a sector erase is in progress.
+	 * Readers do not take the mutex, they use it to detect that the sector
+	 * they were reading from has been garbage collected and retry.
+	 */
+	uint32_t erase_seq;
+	/** Sector being erased while @p erase_seq is odd */
+	uint32_t erase_sector;
+	/** Compression work buffer provided by the caller, NULL to store values
+	 * uncompressed. Values that do not compress into it are stored as is.
+	 * Only used with CONFIG_NVS_COMPRESS.
+	 */
+	uint8_t *lz_buf;
+	/** Size of @p lz_buf */
+	size_t lz_buf_size;
+	/** Copy buffer provided by the caller for garbage collection, NULL to
+	 * move data in NVS_BLOCK_SIZE pieces. Not used when the flash interface
+	 * can copy by itself.
+	 */
+	uint8_t *gc_buf;
+	/** Size of @p gc_buf, at least the write block size */
+	size_t gc_buf_size;
+	/** Sector state provided by the caller (sector_count entries), NULL to
+	 * use the sectors in ring order. Only used with CONFIG_NVS_GC_POLICY,
+	 * the on-flash layout differs between both modes.
+	 */
+	struct nvs_sector_info *sector_info;
+	/** Garbage collection policy, NVS_GC_COST_BENEFIT or NVS_GC_GREEDY */
+	uint8_t gc_policy;
+	/** Sequence number of the write sector */
+	uint32_t sector_seq;
+	/** Sector collected by the running garbage collection */
+	uint16_t gc_victim;
+	/** Bytes stored by nvs_write() since mount, writes that fail, are
+	 * skipped as unchanged or are still held in a write-back slot are not
+	 * counted
+	 */
+	uint64_t host_bytes;
+	/** Bytes programmed in flash since mount, including allocation table
+	 * entries and garbage collection copies
+	 */
+	uint64_t flash_bytes;
+	/** Write-back slots provided by the caller, NULL to write all ids
+	 * through. Only used with CONFIG_NVS_WRITE_BACK.
+	 */
+	struct nvs_wb_slot *wb_slots;
+	/** Number of entries in @p wb_slots */
+	size_t wb_slot_count;
+	/** Flush the slots once this many bytes are pending, 0 for no limit */
+	size_t wb_max_dirty;
+	/** Flush the slots once a value has been pending for this many ms,
+	 * 0 for no limit. The age is checked by writes to slot ids and by
+	 * nvs_sync_poll(), a value that is not written again is only flushed
+	 * in time when nvs_sync_poll() is called periodically.
+	 */
+	uint32_t wb_max_age_ms;
+	/** Optional callback of nvs_scrub(), called with the id of a value
+	 * whose data CRC is wrong and -EIO, or with the id read from an
+	 * allocation table entry that is damaged and -EBADMSG. In the last
+	 * case the id itself may be wrong.
+	 */
+	void (*impl_scrub_report)(nvs_id_t id, int err);
+	/** Move the intact values out of a sector in which nvs_scrub() found
+	 * corruption, before they are damaged too. Ignored with @p read_only.
+	 */
+	bool scrub_relocate;
+	/** Next allocation table entry verified by nvs_scrub() */
+	uint32_t scrub_addr;
+	/** Position of the walk that checks whether the entry at @p scrub_addr
+	 * is still live, when a call ran out of budget during it
+	 */
+	uint32_t scrub_walk;
+	/** Statistics provided by the caller, NULL to not keep them. They are
+	 * computed at mount with a walk of the allocation table.
+	 */
+	struct nvs_stats *stats;
 };
 
 /**
@@ -78,6 +335,17 @@ struct nvs_fs {
 /**
  * @brief Mount an NVS file system onto the flash device specified in @p fs.
  *
+ * @note With nvs_fs.read_only set nothing is written or erased, neither at
+ * mount nor afterwards: a garbage collection that was interrupted is not
+ * completed, its sector is read together with the copies already made, and
+ * all calls that modify the file system return -EROFS. This allows to inspect
+ * an image that another system writes to, the file system is seen as it was
+ * at mount.
+ *
+ * @note A build with CONFIG_NVS_FIXED_WRITE_BLOCK_SIZE,
+ * CONFIG_NVS_FIXED_SECTOR_SIZE or CONFIG_NVS_FIXED_SECTOR_COUNT only mounts
+ * file systems with that geometry, others are refused with -EINVAL.
+ *
  * @param fs Pointer to file system
  * @retval 0 Success
  * @retval -ERRNO errno code if error
@@ -101,6 +369,9 @@ int nvs_clear(struct nvs_fs *fs);
  * @p 0 will return error.@n It is not possible to distinguish between deleted entry and entry
  * with data of length 0.
  *
+ * @note  Ids that have a write-back slot (CONFIG_NVS_WRITE_BACK) are only written to flash
+ * by nvs_sync() or when a flush threshold is reached, see nvs_fs.wb_slots.
+ *
  * @param fs Pointer to file system
  * @param id Id of the entry to be written
  * @param data Pointer to the data to be written
@@ -110,7 +381,7 @@ int nvs_clear(struct nvs_fs *fs);
  * to be written. When a rewrite of the same data already stored is attempted, nothing is written
  * to flash, thus 0 is returned. On error, returns negative value of errno.h defined error codes.
  */
-ssize_t nvs_write(struct nvs_fs *fs, uint16_t id, const void *data, size_t len);
+ssize_t nvs_write(struct nvs_fs *fs, nvs_id_t id, const void *data, size_t len);
 
 /**
  * @brief Delete an entry from the file system
@@ -120,11 +391,88 @@ ssize_t nvs_write(struct nvs_fs *fs, uint16_t id, const void *data, size_t len);
  * @retval 0 Success
  * @retval -ERRNO errno code if error
  */
-int nvs_delete(struct nvs_fs *fs, uint16_t id);
+int nvs_delete(struct nvs_fs *fs, nvs_id_t id);
+
+/**
+ * @brief Delete all entries with an id from @p first to @p last.
+ *
+ * The range is recorded as a single range delete, two allocation table
+ * entries written together, whatever the number of ids it covers: reads of
+ * the ids return -ENOENT and gc drops the entries it hides. Ids of the range
+ * can be written again afterwards. Pending write-back values of the range are
+ * dropped.
+ *
+ * @note Live space accounting (nvs_fs.sector_info) and nvs_fs.stats are
+ * recomputed after the range delete, which reads the allocation tables.
+ *
+ * @note This changes the on-flash format. Older firmware reads the two
+ * entries of a range delete as plain deletes of @p first and @p last, the
+ * ids between them read as present again.
+ *
+ * @param fs Pointer to file system
+ * @param first First id of the range
+ * @param last Last id of the range, up to NVS_ID_MAX
+ * @retval 0 Success
+ * @retval -EINVAL if @p first is larger than @p last
+ * @retval -ERRNO errno code if error
+ */
+int nvs_delete_range(struct nvs_fs *fs, nvs_id_t first, nvs_id_t last);
+
+/**
+ * @brief Write all pending write-back values to flash.
+ *
+ * Values of ids that have a write-back slot stay in RAM until a flush
+ * threshold is reached or this function is called. It must be called before
+ * power down (e.g. from a pre-shutdown hook), pending values are lost
+ * otherwise. nvs_mount() also drops values that are still pending. Without
+ * CONFIG_NVS_WRITE_BACK it does nothing.
+ *
+ * @param fs Pointer to file system
+ * @retval 0 Success
+ * @retval -ERRNO errno code if error
+ */
+int nvs_sync(struct nvs_fs *fs);
+
+/**
+ * @brief Write the pending write-back values if a flush threshold is reached.
+ *
+ * Checks nvs_fs.wb_max_age_ms and nvs_fs.wb_max_dirty without a write, meant
+ * to be called periodically (e.g. from a timer or an idle task) so that the
+ * age limit also holds for ids that are not written again. Without
+ * CONFIG_NVS_WRITE_BACK it does nothing.
+ *
+ * @param fs Pointer to file system
+ * @retval 1 The pending values were written
+ * @retval 0 No threshold was reached
+ * @retval -ERRNO errno code if error
+ */
+int nvs_sync_poll(struct nvs_fs *fs);
+
+/**
+ * @brief Add the next sector to a lookup cache that is still being built.
+ *
+ * With nvs_fs.lookup_cache_lazy set, nvs_mount() returns as soon as the write
+ * position is known, it reads the close entry of each sector but no other
+ * entries. A read of an id that is not in the cache yet indexes the sectors
+ * left until the id is found, taking the mutex for one sector at a time. This
+ * function adds one more sector to the cache and can be called from a
+ * background task until it returns 0. The cache is also completed before a
+ * checkpoint is written.
+ *
+ * @param fs Pointer to file system
+ * @retval 1 More sectors are left to index
+ * @retval 0 The lookup cache is complete, or not used
+ * @retval -ERRNO errno code if error
+ */
+int nvs_lookup_cache_step(struct nvs_fs *fs);
 
 /**
  * @brief Read an entry from the file system.
  *
+ * Reads do not take the file system mutex and can run concurrently with each
+ * other and with a writer. A read that overlaps the erase of the sector it
+ * was reading from is restarted transparently.
+ *
  * @param fs Pointer to file system
  * @param id Id of the entry to be read
  * @param data Pointer to data buffer
@@ -135,7 +483,7 @@ int nvs_delete(struct nvs_fs *fs, uint16_t id);
  * indicates not all bytes were read, and more data is available. On error, returns negative
  * value of errno.h defined error codes.
  */
-ssize_t nvs_read(struct nvs_fs *fs, uint16_t id, void *data, size_t len);
+ssize_t nvs_read(struct nvs_fs *fs, nvs_id_t id, void *data, size_t len);
 
 /**
  * @brief Read a history entry from the file system.
@@ -151,7 +499,7 @@ ssize_t nvs_read(struct nvs_fs *fs, uint16_t id, void *data, size_t len);
  * indicates not all bytes were read, and more data is available. On error, returns negative
  * value of errno.h defined error codes.
  */
-ssize_t nvs_read_hist(struct nvs_fs *fs, uint16_t id, void *data, size_t len, uint16_t cnt);
+ssize_t nvs_read_hist(struct nvs_fs *fs, nvs_id_t id, void *data, size_t len, uint16_t cnt);
 
 /**
  * @brief Calculate the available free space in the file system.
@@ -188,6 +536,115 @@ size_t nvs_sector_max_data_size(struct nvs_fs *fs);
  */
 int nvs_sector_use_next(struct nvs_fs *fs);
 
+/**
+ * @brief Write a checkpoint of the file system state.
+ *
+ * A checkpoint records the write position and a snapshot of the lookup cache.
+ * When the file system is mounted and a checkpoint is found in the last two
+ * sectors, the lookup cache is loaded from it and only the entries written
+ * after the checkpoint are scanned, instead of all entries in the file system.
+ *
+ * @note Requires CONFIG_NVS_CHECKPOINT. With CONFIG_NVS_CHECKPOINT_ON_SECTOR_CLOSE
+ * a checkpoint is also written each time a sector is closed, if it still fits.
+ *
+ * @param fs Pointer to the file system.
+ *
+ * @return 0 on success. On error, returns negative value of errno.h defined error codes.
+ */
+int nvs_checkpoint(struct nvs_fs *fs);
+
+/**
+ * @brief Export the live entries of the file system as an image.
+ *
+ * One record is written to @p sink for every id that has a value, in no
+ * particular order. Pending write-back values are written to flash first.
+ *
+ * @param fs Pointer to the file system.
+ * @param sink Destination of the image.
+ *
+ * @retval 0 Success
+ * @retval -ENOBUFS A value does not fit in the buffer of @p sink
+ * @retval -ERRNO errno code if error
+ */
+int nvs_export(struct nvs_fs *fs, const struct nvs_image_sink *sink);
+
+/**
+ * @brief Write an image into an empty file system.
+ *
+ * The file system must be mounted and hold no entries, e.g. right after
+ * nvs_clear() and nvs_mount(). The records are appended one after the other
+ * without looking for previous entries and without garbage collection:
+ * values are programmed in pieces of the size of the staging buffer of
+ * @p source and allocation table entries one write block at a time.
+ * Compression is not applied to imported values.
+ *
+ * @param fs Pointer to the file system.
+ * @param source Origin of the image.
+ *
+ * @retval 0 Success
+ * @retval -ENOTEMPTY The file system holds entries
+ * @retval -ENOSPC The image does not fit, the sector after the write sector
+ * has to stay empty
+ * @retval -EINVAL Invalid record
+ * @retval -EIO Truncated image
+ * @retval -ERRNO errno code if error
+ */
+int nvs_import(struct nvs_fs *fs, const struct nvs_image_source *source);
+
+/**
+ * @brief Verify a part of the file system.
+ *
+ * The allocation table is walked from the newest to the oldest entry, every
+ * call continuing where the previous one stopped. The crc8 of the entries and
+ * the data CRC of the live values (CONFIG_NVS_DATA_CRC, without it the data
+ * is only read) are checked until @p budget bytes have been read, so that a
+ * call at idle keeps the mutex for a bounded time. The entries read to find
+ * out whether a value is live count too, a call can stop in the middle of
+ * that walk and the next one continues it. Corrupted entries are passed to
+ * nvs_fs.impl_scrub_report.
+ *
+ * With nvs_fs.scrub_relocate the intact live values of a sector in which
+ * corruption is found are moved to the write sector, as far as they fit in it
+ * without garbage collection.
+ *
+ * @param fs Pointer to the file system.
+ * @param budget Number of bytes to read, at least one entry is verified.
+ *
+ * @retval 1 The pass is complete, the next call starts a new one
+ * @retval 0 There are entries left to verify
+ * @retval -ERRNO errno code if error
+ */
+int nvs_scrub(struct nvs_fs *fs, size_t budget);
+
+/**
+ * @brief Get the space and wear statistics of the file system.
+ *
+ * Copies nvs_fs.stats and fills in the values derived from it, no flash
+ * access is done.
+ *
+ * @param fs Pointer to the file system.
+ * @param stats Statistics of the file system.
+ *
+ * @retval 0 Success
+ * @retval -ENOTSUP The file system keeps no statistics
+ * @retval -ERRNO errno code if error
+ */
+int nvs_stats_get(struct nvs_fs *fs, struct nvs_stats *stats);
+
+/**
+ * @brief Get the write amplification of the file system.
+ *
+ * The write amplification is the number of bytes programmed in flash
+ * (nvs_fs.flash_bytes) divided by the number of bytes written by the
+ * application (nvs_fs.host_bytes), counted since the last mount.
+ *
+ * @param fs Pointer to the file system.
+ *
+ * @return Write amplification in hundredths (150 means 1.5), 0 if nothing
+ * has been written yet.
+ */
+uint32_t nvs_write_amp(const struct nvs_fs *fs);
+
 /**
  * @}
  */
@@ -0,0 +1,223 @@
+/*  NVS typed C++ interface
+ *
+ * Copyright (c) 2024 imwoo90
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef NVS_HPP_
+#define NVS_HPP_
+
+#include <nvs.h>
+
+#include <errno.h>
+#include <iterator>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+/**
+ * @brief NVS typed C++ interface
+ * @defgroup nvs_cpp NVS typed C++ interface
+ * @ingroup nvs
+ * @{
+ */
+
+namespace nvs {
+
+template <typename T> class span;
+
+namespace detail {
+template <typename T> struct is_span : std::false_type {};
+template <typename T> struct is_span<span<T>> : std::true_type {};
+
+/* element type of a contiguous container, as seen through std::data() */
+template <typename C>
+using container_element_t =
+	std::remove_pointer_t<decltype(std::data(std::declval<C &>()))>;
+
+/* C is a contiguous container whose elements can be viewed as T */
+template <typename C, typename T, typename = void>
+struct is_compatible_container : std::false_type {};
+template <typename C, typename T>
+struct is_compatible_container<
+	C, T,
+	std::void_t<decltype(std::data(std::declval<C &>())),
+		    decltype(std::size(std::declval<C &>()))>>
+	: std::bool_constant<!is_span<std::remove_cv_t<C>>::value &&
+			     !std::is_array<C>::value &&
+			     std::is_convertible<container_element_t<C> (*)[],
+						 T (*)[]>::value> {};
+} /* namespace detail */
+
+/**
+ * @brief Contiguous run of objects, a stand-in for std::span in C++17
+ *
+ * Built from a pointer and a count, an array or a contiguous container such
+ * as std::vector or std::array. A span of T converts to a span of const T.
+ */
+template <typename T> class span {
+public:
+	constexpr span() noexcept : data_(nullptr), size_(0U) {}
+	constexpr span(T *data, size_t size) noexcept : data_(data), size_(size) {}
+	template <size_t N> constexpr span(T (&array)[N]) noexcept : data_(array), size_(N) {}
+	template <typename C,
+		  typename = std::enable_if_t<detail::is_compatible_container<C, T>::value>>
+	constexpr span(C &container) noexcept
+		: data_(std::data(container)), size_(std::size(container))
+	{
+	}
+	template <typename U,
+		  typename = std::enable_if_t<std::is_convertible<U (*)[], T (*)[]>::value>>
+	constexpr span(const span<U> &other) noexcept : data_(other.data()), size_(other.size())
+	{
+	}
+
+	constexpr T *data() const noexcept { return data_; }
+	constexpr size_t size() const noexcept { return size_; }
+	constexpr size_t size_bytes() const noexcept { return size_ * sizeof(T); }
+	constexpr T *begin() const noexcept { return data_; }
+	constexpr T *end() const noexcept { return data_ + size_; }
+	constexpr T &operator[](size_t i) const { return data_[i]; }
+
+private:
+	T *data_;
+	size_t size_;
+};
+
+template <typename T, size_t N> span(T (&)[N]) -> span<T>;
+template <typename C> span(C &) -> span<detail::container_element_t<C>>;
+
+/**
+ * @brief Read an entry into an array of objects.
+ *
+ * The entry is read from flash straight into @p out, there is no staging
+ * buffer.
+ *
+ * @return Number of bytes of the entry, see nvs_read(). Values larger than
+ * out.size_bytes() mean that the entry did not fit.
+ */
+template <typename T> ssize_t read(nvs_fs &fs, nvs_id_t id, span<T> out)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "NVS entries must be trivially copyable");
+	static_assert(!std::is_const<T>::value, "Cannot read into const objects");
+	return nvs_read(&fs, id, out.data(), out.size_bytes());
+}
+
+/**
+ * @brief Write an array of objects as one entry, see nvs_write().
+ */
+template <typename T> ssize_t write(nvs_fs &fs, nvs_id_t id, span<T> in)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "NVS entries must be trivially copyable");
+	return nvs_write(&fs, id, in.data(), in.size_bytes());
+}
+
+/**
+ * @brief Read an entry that holds exactly one @p T into @p value.
+ *
+ * @retval 0 Success
+ * @retval -EBADMSG The entry does not have the size of @p T
+ * @retval -ERRNO errno code if error, see nvs_read()
+ *
+ * The content of @p value is undefined unless 0 is returned.
+ */
+template <typename T> int get(nvs_fs &fs, nvs_id_t id, T &value)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "NVS entries must be trivially copyable");
+	ssize_t rc = nvs_read(&fs, id, &value, sizeof(T));
+
+	if (rc < 0) {
+		return (int)rc;
+	}
+	return ((size_t)rc == sizeof(T)) ? 0 : -EBADMSG;
+}
+
+/**
+ * @brief Read an entry that holds exactly one @p T.
+ *
+ * @return The value, or nothing when get() fails.
+ */
+template <typename T> std::optional<T> get(nvs_fs &fs, nvs_id_t id)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "NVS entries must be trivially copyable");
+	static_assert(std::is_default_constructible<T>::value,
+		      "Use get(fs, id, value) for types without a default constructor");
+	std::optional<T> value(std::in_place);
+
+	if (get(fs, id, *value)) {
+		value.reset();
+	}
+	return value;
+}
+
+/**
+ * @brief Write one @p T as an entry, see nvs_write().
+ */
+template <typename T> ssize_t put(nvs_fs &fs, nvs_id_t id, const T &value)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "NVS entries must be trivially copyable");
+	return nvs_write(&fs, id, &value, sizeof(T));
+}
+
+/**
+ * @brief Mounted NVS file system.
+ *
+ * Mounts the file system on construction and writes pending write-back values
+ * with nvs_sync() when it goes out of scope. NVS has no unmount, the file
+ * system stays usable through the C interface afterwards.
+ */
+class handle {
+public:
+	explicit handle(nvs_fs &fs) : fs_(&fs), rc_(nvs_mount(&fs)) {}
+	handle(const handle &) = delete;
+	handle &operator=(const handle &) = delete;
+	handle(handle &&other) noexcept : fs_(other.fs_), rc_(other.rc_) { other.fs_ = nullptr; }
+	handle &operator=(handle &&) = delete;
+
+	~handle()
+	{
+		if (fs_ && !rc_) {
+			(void)nvs_sync(fs_);
+		}
+	}
+
+	/** Result of nvs_mount() */
+	int error() const noexcept { return rc_; }
+	explicit operator bool() const noexcept { return fs_ && !rc_; }
+	nvs_fs &fs() const noexcept { return *fs_; }
+
+	template <typename T> int get(nvs_id_t id, T &value) const
+	{
+		return nvs::get(*fs_, id, value);
+	}
+	template <typename T> std::optional<T> get(nvs_id_t id) const
+	{
+		return nvs::get<T>(*fs_, id);
+	}
+	template <typename T> ssize_t put(nvs_id_t id, const T &value) const
+	{
+		return nvs::put(*fs_, id, value);
+	}
+	template <typename T> ssize_t read(nvs_id_t id, span<T> out) const
+	{
+		return nvs::read(*fs_, id, out);
+	}
+	template <typename T> ssize_t write(nvs_id_t id, span<T> in) const
+	{
+		return nvs::write(*fs_, id, in);
+	}
+	int remove(nvs_id_t id) const { return nvs_delete(fs_, id); }
+	int sync() const { return nvs_sync(fs_); }
+
+private:
+	nvs_fs *fs_;
+	int rc_;
+};
+
+} /* namespace nvs */
+
+/**
+ * @}
+ */
+
+#endif /* NVS_HPP_ */
@@ -0,0 +1,84 @@
+/*  NVS image builder: mount-ready NVS partitions built on the host
+ *
+ * Copyright (c) 2024 imwoo90
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef NVS_IMAGE_H_
+#define NVS_IMAGE_H_
+
+#include <nvs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief NVS image builder
+ * @defgroup nvs_image NVS image builder
+ * @ingroup nvs
+ * @{
+ */
+
+/**
+ * @brief Flash geometry of the partition an image is built for
+ */
+struct nvs_image_geometry {
+	/** Size of a sector, a multiple of the erase block size */
+	uint32_t sector_size;
+	/** Number of sectors in the partition */
+	uint16_t sector_count;
+	/** Write block size of the flash */
+	size_t write_block_size;
+	/** Value of erased flash bytes */
+	uint8_t erase_value;
+};
+
+/**
+ * @brief Entry of an image
+ */
+struct nvs_image_entry {
+	/** Id of the entry */
+	nvs_id_t id;
+	/** Value of the entry */
+	const void *data;
+	/** Length of @p data */
+	size_t len;
+};
+
+/**
+ * @brief Build a mount-ready NVS partition in RAM.
+ *
+ * The entries are laid out as nvs_import() writes them into a freshly cleared
+ * file system: values packed one after the other with their data CRC,
+ * allocation table entries in consecutive slots. When an id appears more than
+ * once the last entry wins. The image uses the on-flash format of this build
+ * (CONFIG_NVS_* options), which must match the one of the target.
+ *
+ * The flash interface layer is bound to @p image while the image is built,
+ * the previous interface is restored afterwards. No file system may be in use
+ * meanwhile.
+ *
+ * @param geo Geometry of the target partition
+ * @param entries Entries of the image
+ * @param count Number of entries
+ * @param image Buffer receiving the image
+ * @param image_size Size of @p image, sector_size * sector_count
+ * @retval 0 Success
+ * @retval -ENOSPC The entries do not fit in the partition
+ * @retval -EINVAL Invalid geometry or entry
+ * @retval -ERRNO errno code if error
+ */
+int nvs_image_build(const struct nvs_image_geometry *geo,
+		    const struct nvs_image_entry *entries, size_t count,
+		    uint8_t *image, size_t image_size);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NVS_IMAGE_H_ */
@@ -0,0 +1,120 @@
+/*  NVS stream set: hot/cold write streams over several NVS file systems
+ *
+ * Copyright (c) 2024 imwoo90
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef NVS_STREAM_H_
+#define NVS_STREAM_H_
+
+#include <nvs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief NVS write streams
+ * @defgroup nvs_stream NVS write streams
+ * @ingroup nvs
+ * @{
+ */
+
+/**
+ * @brief Set of NVS write streams
+ *
+ * Every stream is a separate NVS file system with its own write position and
+ * sectors. Ids that are rewritten often are kept in a hotter stream, so the
+ * sectors garbage collected in that stream hold almost only stale entries and
+ * static data in the colder streams is not copied each time the hot stream
+ * wraps.
+ *
+ * Streams are ordered from cold (index 0) to hot. The stream of an id is
+ * given by @p impl_classify when set, otherwise it is learned from the number
+ * of writes to the id. An id only moves to hotter streams: when its stream
+ * changes the new value is written first and the copy in the colder stream is
+ * deleted afterwards, and reads look at the hottest stream first, so an
+ * interrupted move never exposes the old value.
+ */
+struct nvs_stream_set {
+	/** File systems of the streams, from cold to hot */
+	struct nvs_fs **streams;
+	/** Number of entries in @p streams */
+	uint8_t stream_count;
+	/** Optional id class hint, returns the stream index of an id */
+	uint8_t (*impl_classify)(nvs_id_t id);
+	/** Write counters used to learn the stream of ids when there is no
+	 * hint, provided by the caller. Ids share counters modulo @p heat_size.
+	 */
+	uint8_t *heat;
+	/** Number of entries in @p heat */
+	size_t heat_size;
+	/** Writes needed to move an id one stream hotter */
+	uint8_t heat_step;
+	/** Number of writes since the counters were last halved */
+	uint32_t heat_age;
+};
+
+/**
+ * @brief Mount all streams of a set.
+ *
+ * @param set Pointer to the stream set
+ * @retval 0 Success
+ * @retval -ERRNO errno code if error
+ */
+int nvs_stream_mount(struct nvs_stream_set *set);
+
+/**
+ * @brief Write an entry to the stream of its id.
+ *
+ * @param set Pointer to the stream set
+ * @param id Id of the entry to be written
+ * @param data Pointer to the data to be written
+ * @param len Number of bytes to be written, 0 deletes the entry
+ *
+ * @return Number of bytes written, see nvs_write().
+ */
+ssize_t nvs_stream_write(struct nvs_stream_set *set, nvs_id_t id, const void *data,
+			 size_t len);
+
+/**
+ * @brief Delete an entry from all streams.
+ *
+ * @param set Pointer to the stream set
+ * @param id Id of the entry to be deleted
+ * @retval 0 Success
+ * @retval -ERRNO errno code if error
+ */
+int nvs_stream_delete(struct nvs_stream_set *set, nvs_id_t id);
+
+/**
+ * @brief Read an entry, looking in the hottest stream first.
+ *
+ * @param set Pointer to the stream set
+ * @param id Id of the entry to be read
+ * @param data Pointer to data buffer
+ * @param len Number of bytes to be read
+ *
+ * @return Number of bytes read, see nvs_read().
+ */
+ssize_t nvs_stream_read(struct nvs_stream_set *set, nvs_id_t id, void *data, size_t len);
+
+/**
+ * @brief Get the write amplification of a stream set.
+ *
+ * @param set Pointer to the stream set
+ *
+ * @return Write amplification of all streams together in hundredths, see
+ * nvs_write_amp().
+ */
+uint32_t nvs_stream_write_amp(const struct nvs_stream_set *set);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NVS_STREAM_H_ */
@@ -0,0 +1,17 @@
+/*
+ * Copyright (c) 2024 imwoo90
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <crc.h>
+
+const struct crc_provider crc_provider_ieee = {
+	.crc8 = crc8_ccitt,
+	.crc32 = crc32_ieee_update,
+};
+
+const struct crc_provider crc_provider_crc32c = {
+	.crc8 = crc8_ccitt,
+	.crc32 = crc32_c_update,
+};
@@ -49,7 +49,7 @@ fcb_elem_crc8(struct fcb *_fcb, struct fcb_entry *loc, uint8_t *c8p)
 	loc->fe_data_len = len;
 
 	crc8 = CRC8_CCITT_INITIAL_VALUE;
-	crc8 = crc8_ccitt(crc8, tmp_str, cnt);
+	crc8 = fcb_crc(_fcb)->crc8(crc8, tmp_str, cnt);
 
 	off = loc->fe_data_off;
 	end = loc->fe_data_off + len;
@@ -66,7 +66,7 @@ fcb_elem_crc8(struct fcb *_fcb, struct fcb_entry *loc, uint8_t *c8p)
 		{
 			return -EIO;
 		}
-		crc8 = crc8_ccitt(crc8, tmp_str, blk_sz);
+		crc8 = fcb_crc(_fcb)->crc8(crc8, tmp_str, blk_sz);
 	}
 	*c8p = crc8;
 
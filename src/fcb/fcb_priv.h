@@ -46,6 +46,17 @@ extern "C"
 		return (fcbp->f_magic ^ ~MK32(ev));
 	}
 
+	/* @brief Gets the checksums of an FCB
+	 *
+	 * @param fcb pointer to initialized fcb structure
+	 *
+	 * @return the provider selected by fcb->f_crc, crc_provider_ieee if none
+	 */
+	static inline const struct crc_provider *fcb_crc(const struct fcb *fcbp)
+	{
+		return fcbp->f_crc ? fcbp->f_crc : &crc_provider_ieee;
+	}
+
 	struct fcb_disk_area
 	{
 		uint32_t fd_magic;
@@ -30,6 +30,17 @@ int fil_init(struct fil *pfil, struct flash_parameters *params)
     return 0;
 }
 
+int fil_get(struct fil *pfil, struct flash_parameters *params)
+{
+    if (!pfil || !params)
+        return -EINVAL;
+    if (!g_is_ready)
+        return -EPERM;
+    memcpy(pfil, &g_fil, sizeof(g_fil));
+    memcpy(params, &g_flash_parameters, sizeof(g_flash_parameters));
+    return 0;
+}
+
 int fil_read(off_t offset, void *data, size_t len)
 {
     if (g_fil.read == NULL)
@@ -73,4 +84,19 @@ int fil_erase(off_t offset, size_t len)
     if (g_fil.mutex_unlock)
         g_fil.mutex_unlock();
     return ret;
-}
\ No newline at end of file
+}
+
+int fil_copy(off_t src, off_t dst, size_t len)
+{
+    if (g_fil.copy == NULL)
+        return -ENOTSUP;
+
+    if (g_fil.mutex_lock_forever)
+        g_fil.mutex_lock_forever();
+
+    int ret = g_fil.copy(src, dst, len);
+
+    if (g_fil.mutex_unlock)
+        g_fil.mutex_unlock();
+    return ret;
+}
@@ -21,6 +21,7 @@ extern "C"
     int fil_read(off_t offset, void *data, size_t len);
     int fil_write(off_t offset, const void *data, size_t len);
     int fil_erase(off_t offset, size_t len);
+    int fil_copy(off_t src, off_t dst, size_t len);
 
 #ifdef __cplusplus
 }
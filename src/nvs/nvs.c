@@ -14,13 +14,36 @@
 #include "nvs_priv.h"
 #include "../zephyr_macros.h"
 
-static int nvs_prev_ate(struct nvs_fs *fs, uint32_t *addr, struct nvs_ate *ate);
+static int nvs_prev_ate(struct nvs_fs *fs, uint32_t *addr, struct nvs_ate *ate,
+			struct nvs_ate_win *win);
 static int nvs_ate_valid(struct nvs_fs *fs, const struct nvs_ate *entry);
+static int nvs_ate_range_first(struct nvs_fs *fs, uint32_t addr,
+			       const struct nvs_ate *entry, nvs_id_t *first);
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+static int nvs_lookup_cache_rebuild_parallel(struct nvs_fs *fs);
+#endif
+
+/* checksums of the fs, the IEEE ones unless the caller selected others */
+static inline const struct crc_provider *nvs_crc(const struct nvs_fs *fs)
+{
+	return fs->crc ? fs->crc : &crc_provider_ieee;
+}
 
 #ifdef CONFIG_NVS_LOOKUP_CACHE
 
-static inline size_t nvs_lookup_cache_pos(uint16_t id)
+static inline size_t nvs_lookup_cache_pos(struct nvs_fs *fs, nvs_id_t id)
 {
+#ifdef CONFIG_NVS_ID_32BIT
+	uint32_t hash;
+
+	/* 32-bit integer hash function found by https://github.com/skeeto/hash-prospector. */
+	hash = id;
+	hash ^= hash >> 16;
+	hash *= 0x7feb352dU;
+	hash ^= hash >> 15;
+	hash *= 0x846ca68bU;
+	hash ^= hash >> 16;
+#else
 	uint16_t hash;
 
 	/* 16-bit integer hash function found by https://github.com/skeeto/hash-prospector. */
@@ -30,69 +53,327 @@ static inline size_t nvs_lookup_cache_pos(uint16_t id)
 	hash ^= hash >> 7;
 	hash *= 0xdb2dU;
 	hash ^= hash >> 9;
+#endif
 
-	return hash % CONFIG_NVS_LOOKUP_CACHE_SIZE;
+	return hash % fs->lookup_cache_size;
 }
 
-static int nvs_lookup_cache_rebuild(struct nvs_fs *fs)
+/* number of cache positions of the ids first to last, a range that has as
+ * many ids as there are positions covers all of them
+ */
+static inline size_t nvs_lookup_cache_range_cnt(struct nvs_fs *fs, nvs_id_t first,
+						nvs_id_t last)
+{
+	return (size_t)MIN((uint64_t)last - first + 1U, (uint64_t)fs->lookup_cache_size);
+}
+
+/* i-th cache position of the ids first to last */
+static inline size_t nvs_lookup_cache_range_pos(struct nvs_fs *fs, nvs_id_t first,
+						nvs_id_t last, size_t i)
+{
+	if ((uint64_t)last - first + 1U >= fs->lookup_cache_size) {
+		return i;
+	}
+
+	return nvs_lookup_cache_pos(fs, first + (nvs_id_t)i);
+}
+
+/* point the cache positions of the ids first to last to the end of a range
+ * delete at addr. With fill only the empty positions are set, as done when
+ * indexing entries that are older than those already in the cache.
+ */
+static void nvs_lookup_cache_range(struct nvs_fs *fs, nvs_id_t first, nvs_id_t last,
+				   uint32_t addr, bool fill)
+{
+	uint32_t *cache_entry;
+	size_t cnt = nvs_lookup_cache_range_cnt(fs, first, last);
+
+	for (size_t i = 0; i < cnt; i++) {
+		cache_entry = &fs->lookup_cache[nvs_lookup_cache_range_pos(fs, first, last, i)];
+		if (!fill || (*cache_entry == NVS_LOOKUP_CACHE_NO_ADDR)) {
+			__atomic_store_n(cache_entry, addr, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+/* add a range delete end read at addr to the cache, the start of a range
+ * delete is never cached: the range only applies once its end is written
+ */
+static int nvs_lookup_cache_range_ate(struct nvs_fs *fs, uint32_t addr,
+				      const struct nvs_ate *entry, bool fill)
+{
+	nvs_id_t first;
+	int rc;
+
+	rc = nvs_ate_range_first(fs, addr, entry, &first);
+	if (rc > 0) {
+		nvs_lookup_cache_range(fs, first, entry->id, addr, fill);
+		rc = 0;
+	}
+
+	return rc;
+}
+
+/* index the allocation table entries of one sector, from lookup_cache_next
+ * to the end of the sector. Entries found are older than those already in
+ * the cache, they only fill empty cache positions. Returns 1 if there are
+ * sectors left, 0 once the cache is complete.
+ */
+static int nvs_lookup_cache_index(struct nvs_fs *fs)
 {
 	int rc;
 	uint32_t addr, ate_addr;
 	uint32_t *cache_entry;
 	struct nvs_ate ate;
+	struct nvs_ate_win win;
 
-	memset(fs->lookup_cache, 0xff, sizeof(fs->lookup_cache));
-	addr = fs->ate_wra;
+	addr = fs->lookup_cache_next;
+	if (addr == NVS_LOOKUP_CACHE_NO_ADDR) {
+		return 0;
+	}
 
-	while (true) {
+	nvs_ate_win_reset(&win);
+	do {
 		/* Make a copy of 'addr' as it will be advanced by nvs_pref_ate() */
 		ate_addr = addr;
-		rc = nvs_prev_ate(fs, &addr, &ate);
+		rc = nvs_prev_ate(fs, &addr, &ate, &win);
 
 		if (rc) {
 			return rc;
 		}
 
-		cache_entry = &fs->lookup_cache[nvs_lookup_cache_pos(ate.id)];
+		cache_entry = &fs->lookup_cache[nvs_lookup_cache_pos(fs, ate.id)];
 
-		if (ate.id != 0xFFFF && *cache_entry == NVS_LOOKUP_CACHE_NO_ADDR &&
-		    nvs_ate_valid(fs, &ate)) {
-			*cache_entry = ate_addr;
+		if ((ate.part == NVS_ATE_PART_RANGE_LO) || (ate.part == NVS_ATE_PART_RANGE_HI)) {
+			rc = nvs_lookup_cache_range_ate(fs, ate_addr, &ate, true);
+			if (rc) {
+				return rc;
+			}
+		} else if (ate.id != NVS_SPECIAL_ATE_ID &&
+			   *cache_entry == NVS_LOOKUP_CACHE_NO_ADDR && nvs_ate_valid(fs, &ate)) {
+			__atomic_store_n(cache_entry, ate_addr, __ATOMIC_RELEASE);
 		}
 
 		if (addr == fs->ate_wra) {
+			addr = NVS_LOOKUP_CACHE_NO_ADDR;
 			break;
 		}
+	} while ((addr >> ADDR_SECT_SHIFT) == (ate_addr >> ADDR_SECT_SHIFT));
+
+	__atomic_store_n(&fs->lookup_cache_next, addr, __ATOMIC_RELEASE);
+
+	return addr != NVS_LOOKUP_CACHE_NO_ADDR;
+}
+
+static int nvs_lookup_cache_complete(struct nvs_fs *fs)
+{
+	int rc;
+
+	do {
+		rc = nvs_lookup_cache_index(fs);
+	} while (rc > 0);
+
+	return rc;
+}
+
+/* a read of an id that is not in a cache still being built indexes the
+ * sectors left until the id is found, instead of walking them without
+ * keeping what it saw. Each sector is indexed once and the mutex is only held
+ * for one sector at a time, writers are not held up by a long lookup.
+ */
+static int nvs_lookup_cache_demand(struct nvs_fs *fs, nvs_id_t id)
+{
+	uint32_t *cache_entry;
+	int rc = 1;
+
+	if (!fs->lookup_cache) {
+		return 0;
 	}
 
-	return 0;
+	cache_entry = &fs->lookup_cache[nvs_lookup_cache_pos(fs, id)];
+
+	while ((rc > 0) && (__atomic_load_n(cache_entry, __ATOMIC_ACQUIRE) ==
+			    NVS_LOOKUP_CACHE_NO_ADDR) &&
+	       (__atomic_load_n(&fs->lookup_cache_next, __ATOMIC_ACQUIRE) !=
+		NVS_LOOKUP_CACHE_NO_ADDR)) {
+		if (fs->impl_mutex_lock_forever)
+			fs->impl_mutex_lock_forever();
+
+		/* a writer may have filled the position in the meantime */
+		rc = 1;
+		if (*cache_entry == NVS_LOOKUP_CACHE_NO_ADDR) {
+			rc = nvs_lookup_cache_index(fs);
+		}
+
+		if (fs->impl_mutex_unlock)
+			fs->impl_mutex_unlock();
+	}
+
+	return (rc < 0) ? rc : 0;
+}
+
+static int nvs_lookup_cache_rebuild(struct nvs_fs *fs)
+{
+	memset(fs->lookup_cache, 0xff, fs->lookup_cache_size * sizeof(uint32_t));
+	if (fs->impl_parallel && !fs->lookup_cache_lazy) {
+		return nvs_lookup_cache_rebuild_parallel(fs);
+	}
+
+	fs->lookup_cache_next = fs->ate_wra;
+
+	/* the gc policy mode needs the complete cache at mount */
+#ifdef CONFIG_NVS_GC_POLICY
+	if (fs->lookup_cache_lazy && !fs->sector_info) {
+#else
+	if (fs->lookup_cache_lazy) {
+#endif
+		return 0;
+	}
+
+	return nvs_lookup_cache_complete(fs);
+}
+
+#ifdef CONFIG_NVS_GC_POLICY
+/* true if a cache position points at an entry of sector */
+static bool nvs_lookup_cache_points(struct nvs_fs *fs, uint32_t sector)
+{
+	for (size_t pos = 0; pos < fs->lookup_cache_size; pos++) {
+		if ((fs->lookup_cache[pos] != NVS_LOOKUP_CACHE_NO_ADDR) &&
+		    ((fs->lookup_cache[pos] >> ADDR_SECT_SHIFT) == sector)) {
+			return true;
+		}
+	}
+
+	return false;
 }
+#endif
 
 static void nvs_lookup_cache_invalidate(struct nvs_fs *fs, uint32_t sector)
 {
 	uint32_t *cache_entry = fs->lookup_cache;
-	uint32_t *const cache_end = &fs->lookup_cache[CONFIG_NVS_LOOKUP_CACHE_SIZE];
+	uint32_t *const cache_end = &fs->lookup_cache[fs->lookup_cache_size];
+
+	/* the sector being erased is the oldest one, when the cache is built
+	 * up to it the entries it held have all been moved to the write sector
+	 */
+	if ((fs->lookup_cache_next >> ADDR_SECT_SHIFT) == sector) {
+		__atomic_store_n(&fs->lookup_cache_next, NVS_LOOKUP_CACHE_NO_ADDR,
+				 __ATOMIC_RELAXED);
+	}
 
 	for (; cache_entry < cache_end; ++cache_entry) {
 		if ((*cache_entry >> ADDR_SECT_SHIFT) == sector) {
-			*cache_entry = NVS_LOOKUP_CACHE_NO_ADDR;
+			__atomic_store_n(cache_entry, NVS_LOOKUP_CACHE_NO_ADDR,
+					 __ATOMIC_RELAXED);
 		}
 	}
 }
 
 #endif /* CONFIG_NVS_LOOKUP_CACHE */
 
+/* nvs_lookup_start returns the address from where to search for the most
+ * recent ate of id, NVS_LOOKUP_CACHE_NO_ADDR if the lookup cache tells there
+ * is none.
+ */
+static inline uint32_t nvs_lookup_start(struct nvs_fs *fs, nvs_id_t id)
+{
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+	uint32_t next, addr;
+
+	if (fs->lookup_cache) {
+		/* ids that are not in a cache that is still being built may be
+		 * in the sectors left to index. lookup_cache_next is read first:
+		 * the entries it has passed are then visible in the cache.
+		 */
+		next = __atomic_load_n(&fs->lookup_cache_next, __ATOMIC_ACQUIRE);
+		addr = __atomic_load_n(&fs->lookup_cache[nvs_lookup_cache_pos(fs, id)],
+				       __ATOMIC_ACQUIRE);
+		return (addr == NVS_LOOKUP_CACHE_NO_ADDR) ? next : addr;
+	}
+#endif
+	return __atomic_load_n(&fs->ate_wra, __ATOMIC_ACQUIRE);
+}
+
 /* basic routines */
+/* geometry of the file system, with CONFIG_NVS_FIXED_* these are constants so
+ * the address and alignment math below folds at compile time. nvs_mount
+ * checks that the runtime geometry matches.
+ */
+static inline size_t nvs_write_block_size(struct nvs_fs *fs)
+{
+#ifdef CONFIG_NVS_FIXED_WRITE_BLOCK_SIZE
+	(void)fs;
+	return CONFIG_NVS_FIXED_WRITE_BLOCK_SIZE;
+#else
+	return fs->flash_parameters->write_block_size;
+#endif
+}
+
+static inline uint32_t nvs_sector_size(struct nvs_fs *fs)
+{
+#ifdef CONFIG_NVS_FIXED_SECTOR_SIZE
+	(void)fs;
+	return CONFIG_NVS_FIXED_SECTOR_SIZE;
+#else
+	return fs->sector_size;
+#endif
+}
+
+static inline uint16_t nvs_sector_count(struct nvs_fs *fs)
+{
+#ifdef CONFIG_NVS_FIXED_SECTOR_COUNT
+	(void)fs;
+	return CONFIG_NVS_FIXED_SECTOR_COUNT;
+#else
+	return fs->sector_count;
+#endif
+}
+
 /* nvs_al_size returns size aligned to fs->write_block_size */
 static inline size_t nvs_al_size(struct nvs_fs *fs, size_t len)
 {
-	size_t write_block_size = fs->flash_parameters->write_block_size;
+	size_t write_block_size = nvs_write_block_size(fs);
 
 	if (write_block_size <= 1U) {
 		return len;
 	}
 	return (len + (write_block_size - 1U)) & ~(write_block_size - 1U);
 }
+
+/* nvs_ate_size returns the distance between two allocation table entries,
+ * with CONFIG_NVS_PACKED_ATE several entries share a write block
+ */
+static inline size_t nvs_ate_size(struct nvs_fs *fs)
+{
+#ifdef CONFIG_NVS_PACKED_ATE
+	(void)fs;
+	return sizeof(struct nvs_ate);
+#else
+	return nvs_al_size(fs, sizeof(struct nvs_ate));
+#endif
+}
+
+/* nvs_ate_blk_size returns the size of the write block holding entries */
+static inline size_t nvs_ate_blk_size(struct nvs_fs *fs)
+{
+	return nvs_al_size(fs, sizeof(struct nvs_ate));
+}
+
+/* offset of the first allocation table entry in a sector, the write block at
+ * the end of the sector only holds the close ate
+ */
+static inline uint32_t nvs_ate_first(struct nvs_fs *fs)
+{
+	return nvs_sector_size(fs) - nvs_ate_blk_size(fs) - nvs_ate_size(fs);
+}
+
+/* start of the write block that the next allocation table entry goes to,
+ * data has to stay below it
+ */
+static inline uint32_t nvs_ate_wra_blk(struct nvs_fs *fs)
+{
+	return fs->ate_wra + nvs_ate_size(fs) - nvs_ate_blk_size(fs);
+}
 /* end basic routines */
 
 /* flash routines */
@@ -111,11 +392,13 @@ static int nvs_flash_al_wrt(struct nvs_fs *fs, uint32_t addr, const void *data,
 		return 0;
 	}
 
+	fs->flash_bytes += nvs_al_size(fs, len);
+
 	offset = fs->offset;
-	offset += fs->sector_size * (addr >> ADDR_SECT_SHIFT);
+	offset += (off_t)nvs_sector_size(fs) * (addr >> ADDR_SECT_SHIFT);
 	offset += addr & ADDR_OFFS_MASK;
 
-	blen = len & ~(fs->flash_parameters->write_block_size - 1U);
+	blen = len & ~(nvs_write_block_size(fs) - 1U);
 	if (blen > 0) {
 		rc = fil_write(offset, data8, blen);
 		if (rc) {
@@ -129,10 +412,10 @@ static int nvs_flash_al_wrt(struct nvs_fs *fs, uint32_t addr, const void *data,
 	if (len) {
 		memcpy(buf, data8, len);
 		(void)memset(buf + len, fs->flash_parameters->erase_value,
-			fs->flash_parameters->write_block_size - len);
+			nvs_write_block_size(fs) - len);
 
 		rc = fil_write(offset, buf,
-				 fs->flash_parameters->write_block_size);
+				 nvs_write_block_size(fs));
 	}
 
 end:
@@ -147,31 +430,63 @@ static int nvs_flash_rd(struct nvs_fs *fs, uint32_t addr, void *data,
 	off_t offset;
 
 	offset = fs->offset;
-	offset += fs->sector_size * (addr >> ADDR_SECT_SHIFT);
+	offset += (off_t)nvs_sector_size(fs) * (addr >> ADDR_SECT_SHIFT);
 	offset += addr & ADDR_OFFS_MASK;
 
 	rc = fil_read(offset, data, len);
 	return rc;
 }
 
-/* allocation entry write */
-static int nvs_flash_ate_wrt(struct nvs_fs *fs, const struct nvs_ate *entry)
+/* program cnt allocation entries in the write block whose last entry is at
+ * addr, from the end of the block down. The rest of the block is left erased.
+ */
+static int nvs_flash_ate_blk_wrt(struct nvs_fs *fs, uint32_t addr,
+				 const struct nvs_ate *entry, size_t cnt)
+{
+	size_t ate_size = nvs_ate_size(fs), blk_size = nvs_ate_blk_size(fs);
+	uint8_t buf[NVS_BLOCK_SIZE];
+
+	(void)memset(buf, fs->flash_parameters->erase_value, blk_size);
+	for (size_t i = 0; i < cnt; i++) {
+		memcpy(&buf[blk_size - (i + 1U) * ate_size], &entry[i],
+		       sizeof(struct nvs_ate));
+	}
+
+	return nvs_flash_al_wrt(fs, addr + ate_size - blk_size, buf, blk_size);
+}
+
+/* allocation entry write, entries written together share a write block. The
+ * write address moves to the next block as the remaining entries of this one
+ * can not be programmed anymore.
+ */
+static int nvs_flash_ate_wrt_n(struct nvs_fs *fs, const struct nvs_ate *entry,
+			       size_t cnt)
 {
 	int rc;
+	uint32_t addr = fs->ate_wra;
 
-	rc = nvs_flash_al_wrt(fs, fs->ate_wra, entry,
-			       sizeof(struct nvs_ate));
+	rc = nvs_flash_ate_blk_wrt(fs, addr, entry, cnt);
 #ifdef CONFIG_NVS_LOOKUP_CACHE
-	/* 0xFFFF is a special-purpose identifier. Exclude it from the cache */
-	if (entry->id != 0xFFFF) {
-		fs->lookup_cache[nvs_lookup_cache_pos(entry->id)] = fs->ate_wra;
+	/* NVS_SPECIAL_ATE_ID is a special-purpose identifier. Exclude it from the cache */
+	for (size_t i = 0; fs->lookup_cache && (i < cnt); i++) {
+		if (entry[i].id != NVS_SPECIAL_ATE_ID) {
+			__atomic_store_n(&fs->lookup_cache[nvs_lookup_cache_pos(fs, entry[i].id)],
+					 addr - i * nvs_ate_size(fs), __ATOMIC_RELEASE);
+		}
 	}
 #endif
-	fs->ate_wra -= nvs_al_size(fs, sizeof(struct nvs_ate));
+	/* publish the new ate to lock-free readers */
+	__atomic_store_n(&fs->ate_wra, nvs_ate_wra_blk(fs) - nvs_ate_size(fs),
+			 __ATOMIC_RELEASE);
 
 	return rc;
 }
 
+static int nvs_flash_ate_wrt(struct nvs_fs *fs, const struct nvs_ate *entry)
+{
+	return nvs_flash_ate_wrt_n(fs, entry, 1U);
+}
+
 /* data write */
 static int nvs_flash_data_wrt(struct nvs_fs *fs, const void *data, size_t len, bool compute_crc)
 {
@@ -186,7 +501,7 @@ static int nvs_flash_data_wrt(struct nvs_fs *fs, const void *data, size_t len, b
 		/* Write as much aligned data as possible, so the CRC can be concatenated at
 		 * the end of the unaligned data later
 		 */
-		aligned_len = len & ~(fs->flash_parameters->write_block_size - 1U);
+		aligned_len = len & ~(nvs_write_block_size(fs) - 1U);
 		rc = nvs_flash_al_wrt(fs, fs->data_wra, data8, aligned_len);
 		fs->data_wra += aligned_len;
 		if (rc) {
@@ -203,7 +518,7 @@ static int nvs_flash_data_wrt(struct nvs_fs *fs, const void *data, size_t len, b
 		}
 
 		/* Append the CRC */
-		data_crc = crc32_ieee(data, data_len);
+		data_crc = nvs_crc(fs)->crc32(0U, data, data_len);
 		memcpy(pbuf, &data_crc, sizeof(data_crc));
 		len += sizeof(data_crc);
 
@@ -223,6 +538,32 @@ static int nvs_flash_ate_rd(struct nvs_fs *fs, uint32_t addr,
 	return nvs_flash_rd(fs, addr, entry, sizeof(struct nvs_ate));
 }
 
+/* ate read through a read-ahead window. Walks go from newer to older entries,
+ * that is up in a sector: on a miss the window is filled with the entries
+ * from addr up to the end of the sector. These entries are not changed until
+ * the sector is erased, a window is only kept for the duration of a walk.
+ */
+static int nvs_ate_win_rd(struct nvs_fs *fs, struct nvs_ate_win *win, uint32_t addr,
+			  struct nvs_ate *entry)
+{
+	int rc;
+
+	if ((addr < win->addr) ||
+	    ((addr - win->addr + sizeof(struct nvs_ate)) > win->len)) {
+		win->addr = addr;
+		win->len = MIN(sizeof(win->buf), nvs_sector_size(fs) - (addr & ADDR_OFFS_MASK));
+		rc = nvs_flash_rd(fs, addr, win->buf, win->len);
+		if (rc) {
+			win->len = 0U;
+			return rc;
+		}
+	}
+
+	memcpy(entry, &win->buf[addr - win->addr], sizeof(struct nvs_ate));
+
+	return 0;
+}
+
 /* end of basic flash routines */
 
 /* advanced flash routines */
@@ -240,7 +581,7 @@ static int nvs_flash_block_cmp(struct nvs_fs *fs, uint32_t addr, const void *dat
 	uint8_t buf[NVS_BLOCK_SIZE];
 
 	block_size =
-		NVS_BLOCK_SIZE & ~(fs->flash_parameters->write_block_size - 1U);
+		NVS_BLOCK_SIZE & ~(nvs_write_block_size(fs) - 1U);
 
 	while (len) {
 		bytes_to_cmp = MIN(block_size, len);
@@ -271,7 +612,7 @@ static int nvs_flash_cmp_const(struct nvs_fs *fs, uint32_t addr, uint8_t value,
 	uint8_t buf[NVS_BLOCK_SIZE];
 
 	block_size =
-		NVS_BLOCK_SIZE & ~(fs->flash_parameters->write_block_size - 1U);
+		NVS_BLOCK_SIZE & ~(nvs_write_block_size(fs) - 1U);
 
 	while (len) {
 		bytes_to_cmp = MIN(block_size, len);
@@ -292,6 +633,35 @@ static int nvs_flash_cmp_const(struct nvs_fs *fs, uint32_t addr, uint8_t value,
 	return 0;
 }
 
+/* device side copy of a block at addr to the current data write location,
+ * -ENOTSUP if the flash interface can not copy.
+ */
+static int nvs_flash_copy(struct nvs_fs *fs, uint32_t addr, size_t len)
+{
+	int rc;
+	off_t src, dst;
+
+	/* the tail of the block was padded when it was written, copy it too */
+	len = nvs_al_size(fs, len);
+
+	src = fs->offset;
+	src += (off_t)nvs_sector_size(fs) * (addr >> ADDR_SECT_SHIFT);
+	src += addr & ADDR_OFFS_MASK;
+	dst = fs->offset;
+	dst += (off_t)nvs_sector_size(fs) * (fs->data_wra >> ADDR_SECT_SHIFT);
+	dst += fs->data_wra & ADDR_OFFS_MASK;
+
+	rc = fil_copy(src, dst, len);
+	if (rc) {
+		return rc;
+	}
+
+	fs->flash_bytes += len;
+	fs->data_wra += len;
+
+	return 0;
+}
+
 /* flash block move: move a block at addr to the current data write location
  * and updates the data write location.
  */
@@ -299,10 +669,19 @@ static int nvs_flash_block_move(struct nvs_fs *fs, uint32_t addr, size_t len)
 {
 	int rc;
 	size_t bytes_to_copy, block_size;
-	uint8_t buf[NVS_BLOCK_SIZE];
+	uint8_t local_buf[NVS_BLOCK_SIZE], *buf = local_buf;
 
-	block_size =
-		NVS_BLOCK_SIZE & ~(fs->flash_parameters->write_block_size - 1U);
+	rc = nvs_flash_copy(fs, addr, len);
+	if (rc != -ENOTSUP) {
+		return rc;
+	}
+
+	block_size = NVS_BLOCK_SIZE;
+	if (fs->gc_buf) {
+		buf = fs->gc_buf;
+		block_size = fs->gc_buf_size;
+	}
+	block_size &= ~(nvs_write_block_size(fs) - 1U);
 
 	while (len) {
 		bytes_to_copy = MIN(block_size, len);
@@ -323,6 +702,59 @@ static int nvs_flash_block_move(struct nvs_fs *fs, uint32_t addr, size_t len)
 	return 0;
 }
 
+/* Sector order. In ring mode the sector before (older) and after (newer) a
+ * sector are its physical neighbours. In the gc policy mode the order is a
+ * circular list kept in fs->sector_info, the list is only changed while
+ * erase_seq is odd so that lock-free readers detect the change.
+ */
+static inline uint32_t nvs_sector_prev(struct nvs_fs *fs, uint32_t sector)
+{
+#ifdef CONFIG_NVS_GC_POLICY
+	if (fs->sector_info) {
+		return __atomic_load_n(&fs->sector_info[sector].prev, __ATOMIC_RELAXED);
+	}
+#endif
+	return sector ? sector - 1U : nvs_sector_count(fs) - 1U;
+}
+
+static inline uint32_t nvs_sector_next(struct nvs_fs *fs, uint32_t sector)
+{
+#ifdef CONFIG_NVS_GC_POLICY
+	if (fs->sector_info) {
+		return __atomic_load_n(&fs->sector_info[sector].next, __ATOMIC_RELAXED);
+	}
+#endif
+	return (sector + 1U == nvs_sector_count(fs)) ? 0U : sector + 1U;
+}
+
+#ifdef CONFIG_NVS_GC_POLICY
+/* an erased sector becomes free, move it right after the write sector where
+ * it is the next sector to be written
+ */
+static void nvs_sector_recycle(struct nvs_fs *fs, uint16_t sector)
+{
+	struct nvs_sector_info *info = fs->sector_info;
+	uint16_t wr = fs->ate_wra >> ADDR_SECT_SHIFT;
+	uint16_t prev = info[sector].prev, next = info[sector].next, after;
+
+	info[sector].seq = 0U;
+	info[sector].live = 0U;
+
+	if (sector == wr) {
+		return;
+	}
+
+	__atomic_store_n(&info[prev].next, next, __ATOMIC_RELAXED);
+	__atomic_store_n(&info[next].prev, prev, __ATOMIC_RELAXED);
+
+	after = info[wr].next;
+	__atomic_store_n(&info[sector].next, after, __ATOMIC_RELAXED);
+	__atomic_store_n(&info[sector].prev, wr, __ATOMIC_RELAXED);
+	__atomic_store_n(&info[after].prev, sector, __ATOMIC_RELAXED);
+	__atomic_store_n(&info[wr].next, sector, __ATOMIC_RELAXED);
+}
+#endif
+
 /* erase a sector and verify erase was OK.
  * return 0 if OK, errorcode on error.
  */
@@ -334,45 +766,72 @@ static int nvs_flash_erase_sector(struct nvs_fs *fs, uint32_t addr)
 	addr &= ADDR_SECT_MASK;
 
 	offset = fs->offset;
-	offset += fs->sector_size * (addr >> ADDR_SECT_SHIFT);
+	offset += (off_t)nvs_sector_size(fs) * (addr >> ADDR_SECT_SHIFT);
 
 	LOG_DBG("Erasing flash at %lx, len %d", (long int) offset,
-		fs->sector_size);
+		nvs_sector_size(fs));
+
+	/* seqlock write side: readers that overlap the erase see erase_seq
+	 * change and restart, readers that start during the erase skip the
+	 * sector.
+	 */
+	__atomic_store_n(&fs->erase_sector, addr >> ADDR_SECT_SHIFT, __ATOMIC_RELAXED);
+	__atomic_store_n(&fs->erase_seq, fs->erase_seq + 1U, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 
 #ifdef CONFIG_NVS_LOOKUP_CACHE
-	nvs_lookup_cache_invalidate(fs, addr >> ADDR_SECT_SHIFT);
+	if (fs->lookup_cache) {
+		nvs_lookup_cache_invalidate(fs, addr >> ADDR_SECT_SHIFT);
+	}
 #endif
-	rc = fil_erase(offset, fs->sector_size);
-
-	if (rc) {
-		return rc;
+#ifdef CONFIG_NVS_GC_POLICY
+	if (fs->sector_info && fs->sector_info[addr >> ADDR_SECT_SHIFT].seq) {
+		nvs_sector_recycle(fs, addr >> ADDR_SECT_SHIFT);
+	}
+#endif
+	if (fs->stats && fs->stats->erase_count) {
+		fs->stats->erase_count[addr >> ADDR_SECT_SHIFT]++;
 	}
+	/* the scrub pass had reached the oldest entries, gc moved them */
+	if ((fs->scrub_addr != NVS_LOOKUP_CACHE_NO_ADDR) &&
+	    ((fs->scrub_addr & ADDR_SECT_MASK) == addr)) {
+		fs->scrub_addr = NVS_SCRUB_PASS_END;
+		fs->scrub_walk = NVS_LOOKUP_CACHE_NO_ADDR;
+	}
+	/* a liveness walk through the sector starts over */
+	if ((fs->scrub_walk != NVS_LOOKUP_CACHE_NO_ADDR) &&
+	    ((fs->scrub_walk & ADDR_SECT_MASK) == addr)) {
+		fs->scrub_walk = NVS_LOOKUP_CACHE_NO_ADDR;
+	}
+	rc = fil_erase(offset, nvs_sector_size(fs));
 
-	if (nvs_flash_cmp_const(fs, addr, fs->flash_parameters->erase_value,
-			fs->sector_size)) {
+	if (!rc && nvs_flash_cmp_const(fs, addr, fs->flash_parameters->erase_value,
+			nvs_sector_size(fs))) {
 		rc = -ENXIO;
 	}
 
+	__atomic_store_n(&fs->erase_seq, fs->erase_seq + 1U, __ATOMIC_RELEASE);
+
 	return rc;
 }
 
 /* crc update on allocation entry */
-static void nvs_ate_crc8_update(struct nvs_ate *entry)
+static void nvs_ate_crc8_update(struct nvs_fs *fs, struct nvs_ate *entry)
 {
 	uint8_t crc8;
 
-	crc8 = crc8_ccitt(0xff, entry, offsetof(struct nvs_ate, crc8));
+	crc8 = nvs_crc(fs)->crc8(0xff, entry, offsetof(struct nvs_ate, crc8));
 	entry->crc8 = crc8;
 }
 
 /* crc check on allocation entry
  * returns 0 if OK, 1 on crc fail
  */
-static int nvs_ate_crc8_check(const struct nvs_ate *entry)
+static int nvs_ate_crc8_check(struct nvs_fs *fs, const struct nvs_ate *entry)
 {
 	uint8_t crc8;
 
-	crc8 = crc8_ccitt(0xff, entry, offsetof(struct nvs_ate, crc8));
+	crc8 = nvs_crc(fs)->crc8(0xff, entry, offsetof(struct nvs_ate, crc8));
 	if (crc8 == entry->crc8) {
 		return 0;
 	}
@@ -396,6 +855,44 @@ static int nvs_ate_cmp_const(const struct nvs_ate *entry, uint8_t value)
 	return 0;
 }
 
+/* nvs_ate_inline returns true if the value of the entry is held by the ate,
+ * its offset field is then part of the value
+ */
+static inline bool nvs_ate_inline(const struct nvs_ate *entry)
+{
+#ifdef CONFIG_NVS_INLINE_VALUE
+	return (entry->part == NVS_ATE_PART_INLINE) && (entry->id != NVS_SPECIAL_ATE_ID);
+#else
+	(void)entry;
+	return false;
+#endif
+}
+
+#ifdef CONFIG_NVS_INLINE_VALUE
+/* the value of an inline entry fills the offset field, then the reserved
+ * field
+ */
+static void nvs_ate_inline_set(struct nvs_ate *entry, const void *data, size_t len)
+{
+	size_t n = MIN(len, NVS_ATE_OFF_SIZE);
+
+	memcpy(&entry->offset, data, n);
+#if NVS_ATE_RESERVED_SIZE > 0
+	memcpy(entry->reserved, (const uint8_t *)data + n, len - n);
+#endif
+}
+
+static void nvs_ate_inline_get(const struct nvs_ate *entry, void *data, size_t len)
+{
+	size_t n = MIN(len, NVS_ATE_OFF_SIZE);
+
+	memcpy(data, &entry->offset, n);
+#if NVS_ATE_RESERVED_SIZE > 0
+	memcpy((uint8_t *)data + n, entry->reserved, len - n);
+#endif
+}
+#endif
+
 /* nvs_ate_valid validates an ate:
  *     return 1 if crc8, offset and length are valid,
  *            0 otherwise
@@ -405,11 +902,18 @@ static int nvs_ate_valid(struct nvs_fs *fs, const struct nvs_ate *entry)
 	size_t ate_size;
 	uint32_t position;
 
-	ate_size = nvs_al_size(fs, sizeof(struct nvs_ate));
+	ate_size = nvs_ate_blk_size(fs);
 	position = entry->offset + entry->len;
 
-	if ((nvs_ate_crc8_check(entry)) ||
-	    (position >= (fs->sector_size - ate_size))) {
+	if (nvs_ate_crc8_check(fs, entry)) {
+		return 0;
+	}
+
+	if (nvs_ate_inline(entry)) {
+		return entry->len <= NVS_ATE_INLINE_SIZE;
+	}
+
+	if (position >= (nvs_sector_size(fs) - ate_size)) {
 		return 0;
 	}
 
@@ -418,7 +922,7 @@ static int nvs_ate_valid(struct nvs_fs *fs, const struct nvs_ate *entry)
 
 /* nvs_close_ate_valid validates an sector close ate: a valid sector close ate:
  * - valid ate
- * - len = 0 and id = 0xFFFF
+ * - len = 0 and id = NVS_SPECIAL_ATE_ID
  * - offset points to location at ate multiple from sector size
  * return 1 if valid, 0 otherwise
  */
@@ -427,69 +931,348 @@ static int nvs_close_ate_valid(struct nvs_fs *fs, const struct nvs_ate *entry)
 	size_t ate_size;
 
 	if ((!nvs_ate_valid(fs, entry)) || (entry->len != 0U) ||
-	    (entry->id != 0xFFFF)) {
+	    (entry->id != NVS_SPECIAL_ATE_ID)) {
 		return 0;
 	}
 
-	ate_size = nvs_al_size(fs, sizeof(struct nvs_ate));
-	if ((fs->sector_size - entry->offset) % ate_size) {
+	ate_size = nvs_ate_size(fs);
+	if ((nvs_sector_size(fs) - entry->offset) % ate_size) {
 		return 0;
 	}
 
 	return 1;
 }
 
-/* store an entry in flash */
-static int nvs_flash_wrt_entry(struct nvs_fs *fs, uint16_t id, const void *data,
-				size_t len)
+/* nvs_ate_range_first reads the start of the range delete ended by the ate
+ * read at addr:
+ *     return 1 and set first if the ate is a valid range delete end that
+ *              follows a valid range delete start,
+ *            0 otherwise
+ */
+static int nvs_ate_range_first(struct nvs_fs *fs, uint32_t addr,
+			       const struct nvs_ate *entry, nvs_id_t *first)
 {
+	struct nvs_ate start;
 	int rc;
-	struct nvs_ate entry;
 
-	entry.id = id;
-	entry.offset = (uint16_t)(fs->data_wra & ADDR_OFFS_MASK);
-	entry.len = (uint16_t)len;
-	entry.part = 0xff;
+	if ((entry->part != NVS_ATE_PART_RANGE_HI) || (entry->len != 0U) ||
+	    !nvs_ate_valid(fs, entry)) {
+		return 0;
+	}
 
-	rc = nvs_flash_data_wrt(fs, data, len, true);
+	/* the start is written just before the end */
+	rc = nvs_flash_ate_rd(fs, addr + nvs_ate_size(fs), &start);
 	if (rc) {
 		return rc;
 	}
 
-#ifdef CONFIG_NVS_DATA_CRC
-	/* No CRC has been added if this is a deletion write request */
-	if (len > 0) {
-		entry.len += NVS_DATA_CRC_SIZE;
+	if ((start.part != NVS_ATE_PART_RANGE_LO) || (start.len != 0U) ||
+	    (start.id > entry->id) || !nvs_ate_valid(fs, &start)) {
+		return 0;
 	}
-#endif
-	nvs_ate_crc8_update(&entry);
 
-	rc = nvs_flash_ate_wrt(fs, &entry);
+	*first = start.id;
+	return 1;
+}
+
+/* nvs_ate_match tells if the ate read at addr is the most recent entry of id
+ * once reached walking back from ate_wra: a valid entry of id or the end of a
+ * range delete covering id, which is then turned into a delete entry of id.
+ *     return 1 on a match,
+ *            0 otherwise
+ */
+static int nvs_ate_match(struct nvs_fs *fs, uint32_t addr, struct nvs_ate *entry,
+			 nvs_id_t id)
+{
+	nvs_id_t first;
+	int rc;
+
+	if (entry->part == NVS_ATE_PART_RANGE_LO) {
+		return 0;
+	}
+
+	if (entry->part != NVS_ATE_PART_RANGE_HI) {
+		return (entry->id == id) && nvs_ate_valid(fs, entry);
+	}
+
+	if (id > entry->id) {
+		return 0;
+	}
+
+	rc = nvs_ate_range_first(fs, addr, entry, &first);
+	if ((rc <= 0) || (id < first)) {
+		return MIN(rc, 0);
+	}
+
+	entry->id = id;
+	return 1;
+}
+
+/* store an entry in flash */
+static int nvs_flash_wrt_entry(struct nvs_fs *fs, nvs_id_t id, const void *data,
+				size_t len, uint8_t part)
+{
+	int rc;
+	struct nvs_ate entry;
+
+	memset(&entry, 0xff, sizeof(entry));
+	entry.id = id;
+	entry.offset = (nvs_ate_off_t)(fs->data_wra & ADDR_OFFS_MASK);
+	entry.len = (nvs_ate_off_t)len;
+	entry.part = part;
+
+	rc = nvs_flash_data_wrt(fs, data, len, true);
+	if (rc) {
+		return rc;
+	}
+
+#ifdef CONFIG_NVS_DATA_CRC
+	/* No CRC has been added if this is a deletion write request */
+	if (len > 0) {
+		entry.len += NVS_DATA_CRC_SIZE;
+	}
+#endif
+	nvs_ate_crc8_update(fs, &entry);
+
+	rc = nvs_flash_ate_wrt(fs, &entry);
 
 	return rc;
 }
+
+#ifdef CONFIG_NVS_INLINE_VALUE
+/* store a small entry in its ate only */
+static int nvs_flash_wrt_inline(struct nvs_fs *fs, nvs_id_t id, const void *data,
+				size_t len)
+{
+	struct nvs_ate entry;
+
+	memset(&entry, 0xff, sizeof(entry));
+	entry.id = id;
+	entry.len = (nvs_ate_off_t)len;
+	entry.part = NVS_ATE_PART_INLINE;
+	nvs_ate_inline_set(&entry, data, len);
+	nvs_ate_crc8_update(fs, &entry);
+
+	return nvs_flash_ate_wrt(fs, &entry);
+}
+#endif
+
+/* store a range delete: its start and end entries are written next to each
+ * other in the same sector, the end last so that the range only applies once
+ * it is complete.
+ */
+static int nvs_flash_wrt_range(struct nvs_fs *fs, nvs_id_t first, nvs_id_t last)
+{
+	int rc;
+	struct nvs_ate range[2];
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+	/* address of the end entry */
+	uint32_t addr = fs->ate_wra - nvs_ate_size(fs);
+#endif
+
+	memset(range, 0xff, sizeof(range));
+	range[0].id = first;
+	range[0].part = NVS_ATE_PART_RANGE_LO;
+	range[1].id = last;
+	range[1].part = NVS_ATE_PART_RANGE_HI;
+	for (size_t i = 0; i < 2U; i++) {
+		range[i].offset = (nvs_ate_off_t)(fs->data_wra & ADDR_OFFS_MASK);
+		range[i].len = 0U;
+		nvs_ate_crc8_update(fs, &range[i]);
+	}
+
+	if (nvs_ate_blk_size(fs) >= 2U * nvs_ate_size(fs)) {
+		rc = nvs_flash_ate_wrt_n(fs, range, 2U);
+	} else {
+		rc = nvs_flash_ate_wrt(fs, &range[0]);
+		if (!rc) {
+			rc = nvs_flash_ate_wrt(fs, &range[1]);
+		}
+	}
+	if (rc) {
+		return rc;
+	}
+
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+	if (fs->lookup_cache) {
+		nvs_lookup_cache_range(fs, first, last, addr, false);
+	}
+#endif
+	return 0;
+}
 /* end of flash routines */
 
+/* state of the allocation table block k of the sector at sector_addr, seen
+ * from its top entry: 1 if it is a valid ate, 0 if it is erased or lies in the
+ * data area that ends at data_end, -EAGAIN if it holds anything else. data_end
+ * is raised to the end of the data of a valid ate.
+ */
+static int nvs_ate_blk_probe(struct nvs_fs *fs, uint32_t sector_addr, uint32_t k,
+			     uint32_t *data_end)
+{
+	int rc;
+	struct nvs_ate ate;
+	size_t blk_size = nvs_ate_blk_size(fs);
+	uint32_t addr = sector_addr + nvs_ate_first(fs) - k * blk_size;
+
+	if (addr + nvs_ate_size(fs) - blk_size < *data_end) {
+		return 0;
+	}
+
+	rc = nvs_flash_ate_rd(fs, addr, &ate);
+	if (rc) {
+		return rc;
+	}
+
+	if (!nvs_ate_cmp_const(&ate, fs->flash_parameters->erase_value)) {
+		return 0;
+	}
+
+	if (!nvs_ate_valid(fs, &ate)) {
+		return -EAGAIN;
+	}
+
+	if (!nvs_ate_inline(&ate)) {
+		*data_end = MAX(*data_end, sector_addr + ate.offset + ate.len);
+	}
+
+	return 1;
+}
+
+/* number of allocation table blocks in use in the sector at sector_addr.
+ * Blocks are programmed one after the other from the end of the sector, the
+ * blocks in use are followed by erased ones: the first erased block is found
+ * by doubling the distance from the end of the sector, then by bisection.
+ * Returns -EAGAIN when a block that is neither erased nor valid is met, the
+ * table then has to be scanned entry by entry. data_end is set to the end of
+ * the data of the valid ates that were probed.
+ */
+static int nvs_ate_blk_search(struct nvs_fs *fs, uint32_t sector_addr,
+			      uint32_t *data_end)
+{
+	int rc;
+	uint32_t lo = 0U, hi, mid, step = 1U;
+
+	*data_end = sector_addr;
+
+	hi = nvs_sector_size(fs) / nvs_ate_blk_size(fs) - 1U;
+
+	mid = 0U;
+	while (mid < hi) {
+		rc = nvs_ate_blk_probe(fs, sector_addr, mid, data_end);
+		if (rc < 0) {
+			return rc;
+		}
+		if (!rc) {
+			hi = mid;
+			break;
+		}
+		lo = mid + 1U;
+		mid += step;
+		step <<= 1;
+	}
+
+	/* block lo - 1 is in use, block hi is not */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2U;
+		rc = nvs_ate_blk_probe(fs, sector_addr, mid, data_end);
+		if (rc < 0) {
+			return rc;
+		}
+		if (rc) {
+			lo = mid + 1U;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return (int)lo;
+}
+
 /* If the closing ate is invalid, its offset cannot be trusted and
  * the last valid ate of the sector should instead try to be recovered by going
  * through all ate's.
  *
  * addr should point to the faulty closing ate and will be updated to the last
- * valid ate. If no valid ate is found it will be left untouched.
+ * valid ate. If no valid ate is found it will be left untouched. When data_end
+ * is not NULL it is set to the end of the data of the sector.
  */
-static int nvs_recover_last_ate(struct nvs_fs *fs, uint32_t *addr)
+static int nvs_recover_last_ate_end(struct nvs_fs *fs, uint32_t *addr,
+				    uint32_t *data_end)
 {
-	uint32_t data_end_addr, ate_end_addr;
+	uint32_t data_end_addr, ate_end_addr, sector_addr, start_addr, probe_end;
 	struct nvs_ate end_ate;
-	size_t ate_size;
-	int rc;
+	size_t ate_size, blk_size;
+	int rc, blk_cnt;
 
 	LOG_DBG("Recovering last ate from sector %d",
 		(*addr >> ADDR_SECT_SHIFT));
 
-	ate_size = nvs_al_size(fs, sizeof(struct nvs_ate));
+	ate_size = nvs_ate_size(fs);
+	blk_size = nvs_ate_blk_size(fs);
+	sector_addr = *addr & ADDR_SECT_MASK;
 
 	*addr -= ate_size;
+	start_addr = *addr;
+	data_end_addr = sector_addr;
+
+	blk_cnt = nvs_ate_blk_search(fs, sector_addr, &probe_end);
+	if (blk_cnt == -EAGAIN) {
+		goto scan;
+	}
+	if (blk_cnt < 0) {
+		return blk_cnt;
+	}
+	if (!blk_cnt) {
+		goto end;
+	}
+
+	/* the last valid ate is in the last block in use */
+	ate_end_addr = sector_addr + nvs_ate_first(fs) - (blk_cnt - 1) * blk_size;
+	for (size_t i = 0; i < blk_size / ate_size; i++) {
+		rc = nvs_flash_ate_rd(fs, ate_end_addr - i * ate_size, &end_ate);
+		if (rc) {
+			return rc;
+		}
+		if (nvs_ate_valid(fs, &end_ate)) {
+			*addr = ate_end_addr - i * ate_size;
+		}
+	}
+
+	/* the data of the sector ends with the newest ate that has data */
+	for (ate_end_addr = *addr; ate_end_addr <= sector_addr + nvs_ate_first(fs);
+	     ate_end_addr += ate_size) {
+		rc = nvs_flash_ate_rd(fs, ate_end_addr, &end_ate);
+		if (rc) {
+			return rc;
+		}
+		if (nvs_ate_valid(fs, &end_ate) && !nvs_ate_inline(&end_ate)) {
+			data_end_addr += end_ate.offset + end_ate.len;
+			break;
+		}
+	}
+
+	/* a probe that skipped the newest ates can land in their data, and a
+	 * value may hold bytes that pass as a valid ate. The boundary is only
+	 * kept when the newest data ends below the first block not in use, that
+	 * block is erased and no probed ate had newer data. Orphan data after
+	 * the last ate is allowed in the gap, startup steps over it.
+	 */
+	ate_end_addr = sector_addr + nvs_ate_first(fs) + ate_size - (blk_cnt + 1) * blk_size;
+	if ((data_end_addr < probe_end) || (data_end_addr > ate_end_addr)) {
+		goto scan;
+	}
+	rc = nvs_flash_cmp_const(fs, ate_end_addr, fs->flash_parameters->erase_value,
+				 blk_size);
+	if (rc < 0) {
+		return rc;
+	}
+	if (!rc) {
+		goto end;
+	}
+
+scan:
+	*addr = start_addr;
 	ate_end_addr = *addr;
 	data_end_addr = *addr & ADDR_SECT_MASK;
 	while (ate_end_addr > data_end_addr) {
@@ -499,43 +1282,63 @@ static int nvs_recover_last_ate(struct nvs_fs *fs, uint32_t *addr)
 		}
 		if (nvs_ate_valid(fs, &end_ate)) {
 			/* found a valid ate, update data_end_addr and *addr */
-			data_end_addr &= ADDR_SECT_MASK;
-			data_end_addr += end_ate.offset + end_ate.len;
+			if (!nvs_ate_inline(&end_ate)) {
+				data_end_addr &= ADDR_SECT_MASK;
+				data_end_addr += end_ate.offset + end_ate.len;
+			}
 			*addr = ate_end_addr;
 		}
 		ate_end_addr -= ate_size;
 	}
 
+end:
+	if (data_end) {
+		*data_end = data_end_addr;
+	}
+
 	return 0;
 }
 
+static int nvs_recover_last_ate(struct nvs_fs *fs, uint32_t *addr)
+{
+	return nvs_recover_last_ate_end(fs, addr, NULL);
+}
+
 /* walking through allocation entry list, from newest to oldest entries
- * read ate from addr, modify addr to the previous ate
+ * read ate from addr, modify addr to the previous ate. The walk ends by
+ * setting addr to end_addr when the oldest sector has been passed, it never
+ * enters skip_sector.
  */
-static int nvs_prev_ate(struct nvs_fs *fs, uint32_t *addr, struct nvs_ate *ate)
+static int nvs_prev_ate_upto(struct nvs_fs *fs, uint32_t *addr, struct nvs_ate *ate,
+			     uint32_t end_addr, uint32_t skip_sector,
+			     struct nvs_ate_win *win)
 {
 	int rc;
 	struct nvs_ate close_ate;
+	uint32_t sector;
 	size_t ate_size;
 
-	ate_size = nvs_al_size(fs, sizeof(struct nvs_ate));
+	ate_size = nvs_ate_size(fs);
 
-	rc = nvs_flash_ate_rd(fs, *addr, ate);
+	rc = nvs_ate_win_rd(fs, win, *addr, ate);
 	if (rc) {
 		return rc;
 	}
 
 	*addr += ate_size;
-	if (((*addr) & ADDR_OFFS_MASK) != (fs->sector_size - ate_size)) {
+	if (((*addr) & ADDR_OFFS_MASK) != (nvs_sector_size(fs) - ate_size)) {
 		return 0;
 	}
 
-	/* last ate in sector, do jump to previous sector */
-	if (((*addr) >> ADDR_SECT_SHIFT) == 0U) {
-		*addr += ((fs->sector_count - 1) << ADDR_SECT_SHIFT);
-	} else {
-		*addr -= (1 << ADDR_SECT_SHIFT);
+	/* last ate in sector, do jump to previous sector. A sector that is
+	 * being erased has no live data left, step over it.
+	 */
+	sector = nvs_sector_prev(fs, (*addr) >> ADDR_SECT_SHIFT);
+	if (sector == skip_sector) {
+		sector = nvs_sector_prev(fs, sector);
 	}
+	(*addr) &= ADDR_OFFS_MASK;
+	(*addr) += sector << ADDR_SECT_SHIFT;
 
 	rc = nvs_flash_ate_rd(fs, *addr, &close_ate);
 	if (rc) {
@@ -545,7 +1348,7 @@ static int nvs_prev_ate(struct nvs_fs *fs, uint32_t *addr, struct nvs_ate *ate)
 	rc = nvs_ate_cmp_const(&close_ate, fs->flash_parameters->erase_value);
 	/* at the end of filesystem */
 	if (!rc) {
-		*addr = fs->ate_wra;
+		*addr = end_addr;
 		return 0;
 	}
 
@@ -567,827 +1370,3993 @@ static int nvs_prev_ate(struct nvs_fs *fs, uint32_t *addr, struct nvs_ate *ate)
 	return nvs_recover_last_ate(fs, addr);
 }
 
-static void nvs_sector_advance(struct nvs_fs *fs, uint32_t *addr)
+static int nvs_prev_ate(struct nvs_fs *fs, uint32_t *addr, struct nvs_ate *ate,
+			struct nvs_ate_win *win)
 {
-	*addr += (1 << ADDR_SECT_SHIFT);
-	if ((*addr >> ADDR_SECT_SHIFT) == fs->sector_count) {
-		*addr -= (fs->sector_count << ADDR_SECT_SHIFT);
-	}
+	return nvs_prev_ate_upto(fs, addr, ate, fs->ate_wra, NVS_NO_SECTOR, win);
 }
 
-/* allocation entry close (this closes the current sector) by writing offset
- * of last ate to the sector end.
- */
-static int nvs_sector_close(struct nvs_fs *fs)
-{
-	struct nvs_ate close_ate;
-	size_t ate_size;
-
-	ate_size = nvs_al_size(fs, sizeof(struct nvs_ate));
-
-	close_ate.id = 0xFFFF;
-	close_ate.len = 0U;
-	close_ate.offset = (uint16_t)((fs->ate_wra + ate_size) & ADDR_OFFS_MASK);
-	close_ate.part = 0xff;
-
-	fs->ate_wra &= ADDR_SECT_MASK;
-	fs->ate_wra += (fs->sector_size - ate_size);
+#ifdef CONFIG_NVS_LOOKUP_CACHE
 
-	nvs_ate_crc8_update(&close_ate);
+/* Parallel lookup cache rebuild. Every sector is scanned by its own job and
+ * each entry is offered to the cache, where it replaces the entry in place if
+ * it is more recent. Doing the merge in the cache gives the same result as the
+ * walk from ate_wra whatever the order in which the jobs run.
+ */
+struct nvs_rebuild_ctx {
+	struct nvs_fs *fs;
+	uint32_t wr;
+	/* age of the first sector the walk from ate_wra would not enter */
+	uint32_t end_age;
+	int rc;
+};
 
-	(void)nvs_flash_ate_wrt(fs, &close_ate);
+/* age of a sector: the number of sectors between it and the write sector */
+static uint32_t nvs_sector_age(struct nvs_fs *fs, uint32_t wr, uint32_t sector)
+{
+#ifdef CONFIG_NVS_GC_POLICY
+	if (fs->sector_info) {
+		/* the sector list is ordered by sequence, free sectors have none
+		 * and are older than all others
+		 */
+		return fs->sector_seq - fs->sector_info[sector].seq;
+	}
+#endif
+	return (wr + nvs_sector_count(fs) - sector) % nvs_sector_count(fs);
+}
 
-	nvs_sector_advance(fs, &fs->ate_wra);
+/* true if the ate at addr was written after the one at cur */
+static bool nvs_lookup_cache_newer(struct nvs_rebuild_ctx *ctx, uint32_t addr,
+				   uint32_t cur)
+{
+	uint32_t age, cur_age;
 
-	fs->data_wra = fs->ate_wra & ADDR_SECT_MASK;
+	age = nvs_sector_age(ctx->fs, ctx->wr, addr >> ADDR_SECT_SHIFT);
+	cur_age = nvs_sector_age(ctx->fs, ctx->wr, cur >> ADDR_SECT_SHIFT);
 
-	return 0;
+	return (age < cur_age) || ((age == cur_age) && (addr < cur));
 }
 
-static int nvs_add_gc_done_ate(struct nvs_fs *fs)
+static void nvs_lookup_cache_offer(struct nvs_rebuild_ctx *ctx, size_t pos,
+				   uint32_t addr)
 {
-	struct nvs_ate gc_done_ate;
-
-	LOG_DBG("Adding gc done ate at %x", fs->ate_wra & ADDR_OFFS_MASK);
-	gc_done_ate.id = 0xffff;
-	gc_done_ate.len = 0U;
-	gc_done_ate.part = 0xff;
-	gc_done_ate.offset = (uint16_t)(fs->data_wra & ADDR_OFFS_MASK);
-	nvs_ate_crc8_update(&gc_done_ate);
+	struct nvs_fs *fs = ctx->fs;
+	uint32_t *cache_entry = &fs->lookup_cache[pos];
+	uint32_t cur = __atomic_load_n(cache_entry, __ATOMIC_RELAXED);
 
-	return nvs_flash_ate_wrt(fs, &gc_done_ate);
+	do {
+		if ((cur != NVS_LOOKUP_CACHE_NO_ADDR) &&
+		    !nvs_lookup_cache_newer(ctx, addr, cur)) {
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(cache_entry, &cur, addr, true,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
 
-/* garbage collection: the address ate_wra has been updated to the new sector
- * that has just been started. The data to gc is in the sector after this new
- * sector.
- */
-static int nvs_gc(struct nvs_fs *fs)
+static int nvs_lookup_cache_scan(struct nvs_rebuild_ctx *ctx, uint32_t sector)
 {
+	struct nvs_fs *fs = ctx->fs;
+	struct nvs_ate ate;
+	struct nvs_ate_win win;
+	size_t ate_size = nvs_ate_size(fs);
+	uint32_t addr, end, age;
+	nvs_id_t first;
 	int rc;
-	struct nvs_ate close_ate, gc_ate, wlk_ate;
-	uint32_t sec_addr, gc_addr, gc_prev_addr, wlk_addr, wlk_prev_addr,
-	      data_addr, stop_addr;
-	size_t ate_size;
-
-	ate_size = nvs_al_size(fs, sizeof(struct nvs_ate));
-
-	sec_addr = (fs->ate_wra & ADDR_SECT_MASK);
-	nvs_sector_advance(fs, &sec_addr);
-	gc_addr = sec_addr + fs->sector_size - ate_size;
 
-	/* if the sector is not closed don't do gc */
-	rc = nvs_flash_ate_rd(fs, gc_addr, &close_ate);
-	if (rc < 0) {
-		/* flash error */
-		return rc;
-	}
-
-	rc = nvs_ate_cmp_const(&close_ate, fs->flash_parameters->erase_value);
-	if (!rc) {
-		goto gc_done;
-	}
-
-	stop_addr = gc_addr - ate_size;
+	end = (sector << ADDR_SECT_SHIFT) + nvs_sector_size(fs) - ate_size;
 
-	if (nvs_close_ate_valid(fs, &close_ate)) {
-		gc_addr &= ADDR_SECT_MASK;
-		gc_addr += close_ate.offset;
+	if (sector == ctx->wr) {
+		addr = fs->ate_wra;
 	} else {
-		rc = nvs_recover_last_ate(fs, &gc_addr);
+		rc = nvs_flash_ate_rd(fs, end, &ate);
 		if (rc) {
 			return rc;
 		}
-	}
 
-	do {
-		gc_prev_addr = gc_addr;
-		rc = nvs_prev_ate(fs, &gc_addr, &gc_ate);
-		if (rc) {
-			return rc;
+		if (!nvs_ate_cmp_const(&ate, fs->flash_parameters->erase_value)) {
+			/* the walk from ate_wra ends here */
+			age = nvs_sector_age(fs, ctx->wr, sector);
+			end = __atomic_load_n(&ctx->end_age, __ATOMIC_RELAXED);
+			while ((age < end) &&
+			       !__atomic_compare_exchange_n(&ctx->end_age, &end, age, true,
+							    __ATOMIC_RELAXED,
+							    __ATOMIC_RELAXED)) {
+			}
+			return 0;
 		}
 
-		if (!nvs_ate_valid(fs, &gc_ate)) {
-			continue;
+		addr = end;
+		if (nvs_close_ate_valid(fs, &ate)) {
+			addr = (sector << ADDR_SECT_SHIFT) + ate.offset;
+		} else {
+			rc = nvs_recover_last_ate(fs, &addr);
+			if (rc) {
+				return rc;
+			}
 		}
+	}
 
-#ifdef CONFIG_NVS_LOOKUP_CACHE
-		wlk_addr = fs->lookup_cache[nvs_lookup_cache_pos(gc_ate.id)];
-
-		if (wlk_addr == NVS_LOOKUP_CACHE_NO_ADDR) {
-			wlk_addr = fs->ate_wra;
+	nvs_ate_win_reset(&win);
+	for (; addr < end; addr += ate_size) {
+		rc = nvs_ate_win_rd(fs, &win, addr, &ate);
+		if (rc) {
+			return rc;
 		}
-#else
-		wlk_addr = fs->ate_wra;
-#endif
-		do {
-			wlk_prev_addr = wlk_addr;
-			rc = nvs_prev_ate(fs, &wlk_addr, &wlk_ate);
-			if (rc) {
+
+		if ((ate.part == NVS_ATE_PART_RANGE_LO) || (ate.part == NVS_ATE_PART_RANGE_HI)) {
+			rc = nvs_ate_range_first(fs, addr, &ate, &first);
+			if (rc < 0) {
 				return rc;
 			}
-			/* if ate with same id is reached we might need to copy.
-			 * only consider valid wlk_ate's. Something wrong might
-			 * have been written that has the same ate but is
-			 * invalid, don't consider these as a match.
-			 */
-			if ((wlk_ate.id == gc_ate.id) &&
-			    (nvs_ate_valid(fs, &wlk_ate))) {
-				break;
+			for (size_t i = 0; rc && (i < nvs_lookup_cache_range_cnt(fs, first, ate.id));
+			     i++) {
+				nvs_lookup_cache_offer(ctx,
+						       nvs_lookup_cache_range_pos(fs, first, ate.id, i),
+						       addr);
+			}
+		} else if ((ate.id != NVS_SPECIAL_ATE_ID) && nvs_ate_valid(fs, &ate)) {
+			nvs_lookup_cache_offer(ctx, nvs_lookup_cache_pos(fs, ate.id), addr);
+		}
+	}
+
+	return 0;
+}
+
+static void nvs_lookup_cache_job(void *arg, uint32_t sector)
+{
+	struct nvs_rebuild_ctx *ctx = arg;
+	int rc;
+
+	rc = nvs_lookup_cache_scan(ctx, sector);
+	if (rc) {
+		__atomic_store_n(&ctx->rc, rc, __ATOMIC_RELAXED);
+	}
+}
+
+static int nvs_lookup_cache_rebuild_parallel(struct nvs_fs *fs)
+{
+	struct nvs_rebuild_ctx ctx = {
+		.fs = fs,
+		.wr = fs->ate_wra >> ADDR_SECT_SHIFT,
+		.end_age = UINT32_MAX,
+		.rc = 0,
+	};
+	uint32_t *cache_entry;
+	int rc;
+
+	rc = fs->impl_parallel(nvs_lookup_cache_job, &ctx, nvs_sector_count(fs));
+	if (!rc) {
+		rc = ctx.rc;
+	}
+	if (rc) {
+		return rc;
+	}
+
+	/* drop what was found beyond the end of the file system */
+	for (size_t i = 0; i < fs->lookup_cache_size; i++) {
+		cache_entry = &fs->lookup_cache[i];
+		if ((*cache_entry != NVS_LOOKUP_CACHE_NO_ADDR) &&
+		    (nvs_sector_age(fs, ctx.wr, *cache_entry >> ADDR_SECT_SHIFT) >=
+		     ctx.end_age)) {
+			*cache_entry = NVS_LOOKUP_CACHE_NO_ADDR;
+		}
+	}
+
+	return 0;
+}
+
+#endif /* CONFIG_NVS_LOOKUP_CACHE */
+
+static void nvs_sector_advance(struct nvs_fs *fs, uint32_t *addr)
+{
+	uint32_t sector = nvs_sector_next(fs, *addr >> ADDR_SECT_SHIFT);
+
+	*addr &= ADDR_OFFS_MASK;
+	*addr += sector << ADDR_SECT_SHIFT;
+}
+
+/* space taken by the sector header in each sector */
+static inline size_t nvs_sector_hdr_space(struct nvs_fs *fs)
+{
+#ifdef CONFIG_NVS_GC_POLICY
+	if (fs->sector_info) {
+		return nvs_ate_blk_size(fs) +
+		       nvs_al_size(fs, sizeof(struct nvs_sector_hdr) + NVS_DATA_CRC_SIZE);
+	}
+#endif
+	(void)fs;
+	return 0U;
+}
+
+/* find the most recent valid ate of id, returns 1 if found */
+static int nvs_newest_ate(struct nvs_fs *fs, nvs_id_t id, uint32_t *addr,
+			  struct nvs_ate *ate)
+{
+	uint32_t wlk_addr, prev_addr;
+	struct nvs_ate_win win;
+	int rc;
+
+	wlk_addr = nvs_lookup_start(fs, id);
+	if (wlk_addr == NVS_LOOKUP_CACHE_NO_ADDR) {
+		return 0;
+	}
+
+	nvs_ate_win_reset(&win);
+	do {
+		prev_addr = wlk_addr;
+		rc = nvs_prev_ate(fs, &wlk_addr, ate, &win);
+		if (rc) {
+			return rc;
+		}
+		rc = nvs_ate_match(fs, prev_addr, ate, id);
+		if (rc) {
+			if (rc > 0) {
+				*addr = prev_addr;
+			}
+			return rc;
+		}
+	} while (wlk_addr != fs->ate_wra);
+
+	return 0;
+}
+
+/* nvs_ate_is_newest returns 1 if the valid ate read at addr is the most
+ * recent entry of its id. The lookup cache holds the most recent entry of
+ * each position, when it points at addr there is nothing to walk.
+ */
+static int nvs_ate_is_newest(struct nvs_fs *fs, uint32_t addr, const struct nvs_ate *ate)
+{
+	struct nvs_ate newest_ate;
+	uint32_t newest_addr;
+	int rc;
+
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+	if (fs->lookup_cache &&
+	    (__atomic_load_n(&fs->lookup_cache[nvs_lookup_cache_pos(fs, ate->id)],
+			     __ATOMIC_ACQUIRE) == addr)) {
+		return 1;
+	}
+#endif
+
+	rc = nvs_newest_ate(fs, ate->id, &newest_addr, &newest_ate);
+	if (rc <= 0) {
+		return rc;
+	}
+
+	return newest_addr == addr;
+}
+
+/* flash space used by an entry of len bytes (data CRC included) */
+static inline uint32_t nvs_entry_space(struct nvs_fs *fs, size_t len)
+{
+	if (!len) {
+		return 0U;
+	}
+
+	return nvs_al_size(fs, len) + nvs_ate_blk_size(fs);
+}
+
+/* flash space used by the entry of ate */
+static inline uint32_t nvs_ate_space(struct nvs_fs *fs, const struct nvs_ate *entry)
+{
+	if (nvs_ate_inline(entry)) {
+		return nvs_ate_blk_size(fs);
+	}
+
+	return nvs_entry_space(fs, entry->len);
+}
+
+/* an entry has been written over prev (NULL if the id had no entry), space
+ * is the space of the new entry, 0 for a delete entry
+ */
+static void nvs_stats_entry(struct nvs_fs *fs, const struct nvs_ate *prev, uint32_t space)
+{
+	struct nvs_stats *stats = fs->stats;
+
+	if (prev) {
+		stats->live_bytes -= MIN(stats->live_bytes, nvs_ate_space(fs, prev));
+	}
+
+	if (space) {
+		stats->live_bytes += space;
+	} else {
+		stats->tombstones++;
+	}
+}
+
+/* compute the statistics of the file system, only done at mount. Writes,
+ * deletes, range deletes, imports and gc keep them up to date afterwards.
+ */
+static int nvs_stats_rebuild(struct nvs_fs *fs)
+{
+	struct nvs_stats *stats = fs->stats;
+	struct nvs_ate ate;
+	struct nvs_ate_win win;
+	uint32_t addr, prev_addr;
+	int rc;
+
+	stats->live_bytes = 0U;
+	stats->tombstones = 0U;
+	stats->closed_sectors = 0U;
+
+	for (uint16_t i = 0; i < nvs_sector_count(fs); i++) {
+		if (i == (fs->ate_wra >> ADDR_SECT_SHIFT)) {
+			continue;
+		}
+		addr = ((uint32_t)i << ADDR_SECT_SHIFT) + nvs_sector_size(fs) - nvs_ate_size(fs);
+		rc = nvs_flash_ate_rd(fs, addr, &ate);
+		if (rc) {
+			return rc;
+		}
+		if (nvs_ate_cmp_const(&ate, fs->flash_parameters->erase_value)) {
+			stats->closed_sectors++;
+		}
+	}
+
+	addr = fs->ate_wra;
+	nvs_ate_win_reset(&win);
+	do {
+		prev_addr = addr;
+		rc = nvs_prev_ate(fs, &addr, &ate, &win);
+		if (rc) {
+			return rc;
+		}
+		if (!nvs_ate_valid(fs, &ate) || (ate.id == NVS_SPECIAL_ATE_ID)) {
+			continue;
+		}
+		if (!ate.len) {
+			/* a range delete counts once, with its end */
+			if (ate.part != NVS_ATE_PART_RANGE_LO) {
+				stats->tombstones++;
+			}
+			continue;
+		}
+		rc = nvs_ate_is_newest(fs, prev_addr, &ate);
+		if (rc < 0) {
+			return rc;
+		}
+		if (rc) {
+			stats->live_bytes += nvs_ate_space(fs, &ate);
+		}
+	} while (addr != fs->ate_wra);
+
+	return 0;
+}
+
+#ifdef CONFIG_NVS_GC_POLICY
+
+static void nvs_sector_live_add(struct nvs_fs *fs, uint32_t addr, int32_t delta)
+{
+	uint32_t *live = &fs->sector_info[addr >> ADDR_SECT_SHIFT].live;
+
+	if ((delta < 0) && (*live < (uint32_t)-delta)) {
+		*live = 0U;
+	} else {
+		*live += delta;
+	}
+}
+
+/* read the header of sector, -ENOENT if it has none */
+static int nvs_sector_hdr_rd(struct nvs_fs *fs, uint32_t sector,
+			     struct nvs_sector_hdr *hdr)
+{
+	struct nvs_ate ate;
+	uint32_t addr;
+	int rc;
+#ifdef CONFIG_NVS_DATA_CRC
+	uint32_t data_crc;
+#endif
+
+	addr = (sector << ADDR_SECT_SHIFT) + nvs_ate_first(fs);
+	rc = nvs_flash_ate_rd(fs, addr, &ate);
+	if (rc) {
+		return rc;
+	}
+
+	if (!nvs_ate_valid(fs, &ate) || (ate.id != NVS_SPECIAL_ATE_ID) ||
+	    (ate.part != NVS_ATE_PART_SECTOR) ||
+	    (ate.len != sizeof(*hdr) + NVS_DATA_CRC_SIZE)) {
+		return -ENOENT;
+	}
+
+	addr &= ADDR_SECT_MASK;
+	addr += ate.offset;
+	rc = nvs_flash_rd(fs, addr, hdr, sizeof(*hdr));
+	if (rc) {
+		return rc;
+	}
+
+#ifdef CONFIG_NVS_DATA_CRC
+	rc = nvs_flash_rd(fs, addr + sizeof(*hdr), &data_crc, sizeof(data_crc));
+	if (rc) {
+		return rc;
+	}
+	if (data_crc != nvs_crc(fs)->crc32(0U, (const uint8_t *)hdr, sizeof(*hdr))) {
+		return -ENOENT;
+	}
+#endif
+
+	return (hdr->seq && (hdr->seq != 0xFFFFFFFFU)) ? 0 : -ENOENT;
+}
+
+/* write the header of the write sector, it must be its first entry */
+static int nvs_sector_hdr_wrt(struct nvs_fs *fs)
+{
+	struct nvs_sector_hdr hdr;
+
+	hdr.seq = fs->sector_seq;
+	hdr.victim = fs->gc_victim;
+	hdr.reserved = 0xFFFF;
+
+	return nvs_flash_wrt_entry(fs, NVS_SPECIAL_ATE_ID, &hdr, sizeof(hdr),
+				   NVS_ATE_PART_SECTOR);
+}
+
+/* select the sector to garbage collect after wr has been opened, none as
+ * long as there are free sectors left
+ */
+static uint16_t nvs_gc_victim(struct nvs_fs *fs, uint16_t wr)
+{
+	struct nvs_sector_info *info = fs->sector_info;
+	uint16_t victim = NVS_NO_VICTIM;
+	uint64_t score, best = 0U;
+	uint32_t cap = nvs_sector_size(fs), age, live;
+
+	for (uint16_t i = 0; i < nvs_sector_count(fs); i++) {
+		if ((i != wr) && !info[i].seq) {
+			return NVS_NO_VICTIM;
+		}
+	}
+
+	for (uint16_t i = 0; i < nvs_sector_count(fs); i++) {
+		if (i == wr) {
+			continue;
+		}
+
+		live = MIN(info[i].live, cap);
+		age = fs->sector_seq - info[i].seq;
+		if (fs->gc_policy == NVS_GC_GREEDY) {
+			/* least live data, the oldest sector on a tie */
+			score = ((uint64_t)(cap - live) << 32) | age;
+		} else {
+			/* free space gained times age over the copy cost */
+			score = ((uint64_t)(cap - live) * age << 16) / (cap + live);
+		}
+		if ((victim == NVS_NO_VICTIM) || (score > best)) {
+			victim = i;
+			best = score;
+		}
+	}
+
+	return victim;
+}
+
+/* account the live data of all sectors, done at mount */
+static int nvs_sector_live_rebuild(struct nvs_fs *fs)
+{
+	struct nvs_ate ate;
+	struct nvs_ate_win win;
+	uint32_t addr, prev_addr;
+	int rc;
+
+	for (uint16_t i = 0; i < nvs_sector_count(fs); i++) {
+		fs->sector_info[i].live = 0U;
+	}
+
+	addr = fs->ate_wra;
+	nvs_ate_win_reset(&win);
+	do {
+		prev_addr = addr;
+		rc = nvs_prev_ate(fs, &addr, &ate, &win);
+		if (rc) {
+			return rc;
+		}
+		if (!nvs_ate_valid(fs, &ate) || (ate.id == NVS_SPECIAL_ATE_ID) ||
+		    !ate.len) {
+			continue;
+		}
+		rc = nvs_ate_is_newest(fs, prev_addr, &ate);
+		if (rc < 0) {
+			return rc;
+		}
+		if (rc) {
+			nvs_sector_live_add(fs, prev_addr, nvs_ate_space(fs, &ate));
+		}
+	} while (addr != fs->ate_wra);
+
+	return 0;
+}
+
+#endif /* CONFIG_NVS_GC_POLICY */
+
+/* the write sector has just been moved to a new sector: in the gc policy
+ * mode number it and select the sector to collect
+ */
+static int nvs_sector_open(struct nvs_fs *fs)
+{
+#ifdef CONFIG_NVS_GC_POLICY
+	uint16_t wr = fs->ate_wra >> ADDR_SECT_SHIFT;
+
+	if (fs->sector_info) {
+		fs->sector_info[wr].seq = ++fs->sector_seq;
+		fs->sector_info[wr].live = 0U;
+		fs->gc_victim = nvs_gc_victim(fs, wr);
+		return nvs_sector_hdr_wrt(fs);
+	}
+#endif
+	(void)fs;
+	return 0;
+}
+
+/* allocation entry close (this closes the current sector) by writing offset
+ * of last ate to the sector end.
+ */
+static int nvs_sector_close(struct nvs_fs *fs)
+{
+	struct nvs_ate close_ate;
+	uint32_t close_addr, addr;
+	size_t ate_size;
+
+	ate_size = nvs_ate_size(fs);
+
+	memset(&close_ate, 0xff, sizeof(close_ate));
+	close_ate.id = NVS_SPECIAL_ATE_ID;
+	close_ate.len = 0U;
+	close_ate.offset = (nvs_ate_off_t)((fs->ate_wra + ate_size) & ADDR_OFFS_MASK);
+	close_ate.part = 0xff;
+
+	close_addr = (fs->ate_wra & ADDR_SECT_MASK) + nvs_sector_size(fs) - ate_size;
+
+	nvs_ate_crc8_update(fs, &close_ate);
+
+	(void)nvs_flash_ate_blk_wrt(fs, close_addr, &close_ate, 1U);
+	if (fs->stats) {
+		fs->stats->closed_sectors++;
+	}
+
+	/* move to the next sector in a single step, readers never see
+	 * ate_wra on the close ate
+	 */
+	addr = (close_addr & ADDR_SECT_MASK) + nvs_ate_first(fs);
+	nvs_sector_advance(fs, &addr);
+	__atomic_store_n(&fs->ate_wra, addr, __ATOMIC_RELEASE);
+
+	fs->data_wra = fs->ate_wra & ADDR_SECT_MASK;
+
+	return nvs_sector_open(fs);
+}
+
+static int nvs_add_gc_done_ate(struct nvs_fs *fs)
+{
+	struct nvs_ate gc_done_ate;
+
+	LOG_DBG("Adding gc done ate at %x", fs->ate_wra & ADDR_OFFS_MASK);
+	memset(&gc_done_ate, 0xff, sizeof(gc_done_ate));
+	gc_done_ate.id = NVS_SPECIAL_ATE_ID;
+	gc_done_ate.len = 0U;
+	gc_done_ate.part = 0xff;
+	gc_done_ate.offset = (nvs_ate_off_t)(fs->data_wra & ADDR_OFFS_MASK);
+	nvs_ate_crc8_update(fs, &gc_done_ate);
+
+	return nvs_flash_ate_wrt(fs, &gc_done_ate);
+}
+
+#ifdef CONFIG_NVS_GC_POLICY
+/* a delete ate that is not in the oldest sector hides older entries of the
+ * ids first to last, it has to be kept as long as one of them exists
+ */
+static int nvs_gc_keep_delete(struct nvs_fs *fs, uint32_t wlk_addr, uint32_t gc_sector,
+			      nvs_id_t first, nvs_id_t last)
+{
+	struct nvs_ate wlk_ate;
+	struct nvs_ate_win win;
+	uint32_t wlk_prev_addr;
+	int rc;
+
+	nvs_ate_win_reset(&win);
+	while (wlk_addr != fs->ate_wra) {
+		wlk_prev_addr = wlk_addr;
+		rc = nvs_prev_ate(fs, &wlk_addr, &wlk_ate, &win);
+		if (rc) {
+			return rc;
+		}
+		/* older entries in the gc'ed sector are erased with it */
+		if ((wlk_ate.id >= first) && (wlk_ate.id <= last) && wlk_ate.len &&
+		    nvs_ate_valid(fs, &wlk_ate) &&
+		    ((wlk_prev_addr >> ADDR_SECT_SHIFT) != gc_sector)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/* queue an entry moved by gc, the queue is programmed when it fills a write
+ * block
+ */
+static int nvs_gc_ate_queue(struct nvs_fs *fs, struct nvs_ate *queue, size_t *cnt,
+			    const struct nvs_ate *entry)
+{
+	size_t queued;
+
+	queue[(*cnt)++] = *entry;
+	if (*cnt < (nvs_ate_blk_size(fs) / nvs_ate_size(fs))) {
+		return 0;
+	}
+
+	queued = *cnt;
+	*cnt = 0U;
+	return nvs_flash_ate_wrt_n(fs, queue, queued);
+}
+
+#ifdef CONFIG_NVS_GC_POLICY
+/* find the lowest id from first to last that has an entry more recent than
+ * the range delete ended by the ate at addr, the range no longer applies to
+ * it. Returns 1 and sets id if there is one.
+ */
+static int nvs_gc_range_newer(struct nvs_fs *fs, uint32_t addr, nvs_id_t first,
+			      nvs_id_t last, nvs_id_t *id)
+{
+	struct nvs_ate wlk_ate;
+	struct nvs_ate_win win;
+	uint32_t wlk_addr, wlk_prev_addr;
+	int rc, found = 0;
+
+	wlk_addr = fs->ate_wra;
+	nvs_ate_win_reset(&win);
+	while (1) {
+		wlk_prev_addr = wlk_addr;
+		rc = nvs_prev_ate(fs, &wlk_addr, &wlk_ate, &win);
+		if (rc) {
+			return rc;
+		}
+		if ((wlk_prev_addr == addr) || (wlk_addr == fs->ate_wra)) {
+			break;
+		}
+		if ((wlk_ate.id >= first) && (wlk_ate.id <= last) &&
+		    (wlk_ate.id != NVS_SPECIAL_ATE_ID) &&
+		    (wlk_ate.part != NVS_ATE_PART_RANGE_LO) &&
+		    (wlk_ate.part != NVS_ATE_PART_RANGE_HI) &&
+		    nvs_ate_valid(fs, &wlk_ate) && (!found || (wlk_ate.id < *id))) {
+			*id = wlk_ate.id;
+			found = 1;
+		}
+	}
+
+	return found;
+}
+
+/* keep the range delete ended by the ate at addr where it still hides entries
+ * outside of the gc'ed sector, the entries queued before it are written
+ * first. The copy is more recent than the entries written after the range
+ * delete, it is split around the ids that have such entries. Returns 1 if
+ * a part of the range delete is dropped.
+ */
+static int nvs_gc_range(struct nvs_fs *fs, uint32_t addr, const struct nvs_ate *entry,
+			uint32_t gc_sector, struct nvs_ate *queue, size_t *cnt)
+{
+	nvs_id_t first, last, newer;
+	int rc, found, dropped = 0;
+
+	rc = nvs_ate_range_first(fs, addr, entry, &first);
+	if (rc <= 0) {
+		return rc;
+	}
+
+	while (1) {
+		/* the part of the range up to the next id written since */
+		found = nvs_gc_range_newer(fs, addr, first, entry->id, &newer);
+		if (found < 0) {
+			return found;
+		}
+
+		if (!found || (newer > first)) {
+			last = found ? (nvs_id_t)(newer - 1U) : entry->id;
+			rc = nvs_gc_keep_delete(fs, addr, gc_sector, first, last);
+			if (rc < 0) {
+				return rc;
+			}
+			dropped |= !rc;
+			if (rc) {
+				LOG_DBG("Keeping range delete of %d to %d", first, last);
+				if (*cnt) {
+					rc = nvs_flash_ate_wrt_n(fs, queue, *cnt);
+					if (rc) {
+						return rc;
+					}
+					*cnt = 0U;
+				}
+
+				if (fs->stats) {
+					fs->stats->tombstones++;
+				}
+
+				rc = nvs_flash_wrt_range(fs, first, last);
+				if (rc) {
+					return rc;
+				}
+			}
+		}
+
+		if (!found || (newer == entry->id)) {
+			break;
+		}
+		first = newer + 1U;
+	}
+
+	return dropped;
+}
+#endif
+
+/* garbage collection: the address ate_wra has been updated to the new sector
+ * that has just been started. The data to gc is in the sector after this new
+ * sector, or in the victim selected when the sector was opened for the gc
+ * policy mode.
+ */
+static int nvs_gc(struct nvs_fs *fs)
+{
+	int rc;
+	struct nvs_ate close_ate, gc_ate, wlk_ate;
+	struct nvs_ate gc_queue[NVS_BLOCK_SIZE / sizeof(struct nvs_ate)];
+	struct nvs_ate_win gc_win, wlk_win;
+	uint32_t sec_addr, gc_addr, gc_prev_addr, wlk_addr, wlk_prev_addr,
+	      data_addr, stop_addr;
+	size_t ate_size, gc_queued = 0U;
+
+	ate_size = nvs_ate_size(fs);
+
+	sec_addr = (fs->ate_wra & ADDR_SECT_MASK);
+	nvs_sector_advance(fs, &sec_addr);
+#ifdef CONFIG_NVS_GC_POLICY
+	if (fs->sector_info) {
+		if (fs->gc_victim == NVS_NO_VICTIM) {
+			/* free sectors left, nothing to collect */
+			return nvs_add_gc_done_ate(fs);
+		}
+		sec_addr = (uint32_t)fs->gc_victim << ADDR_SECT_SHIFT;
+	}
+#endif
+	gc_addr = sec_addr + nvs_sector_size(fs) - ate_size;
+
+	/* if the sector is not closed don't do gc */
+	rc = nvs_flash_ate_rd(fs, gc_addr, &close_ate);
+	if (rc < 0) {
+		/* flash error */
+		return rc;
+	}
+
+	rc = nvs_ate_cmp_const(&close_ate, fs->flash_parameters->erase_value);
+	if (!rc) {
+		goto gc_done;
+	}
+
+	stop_addr = sec_addr + nvs_ate_first(fs);
+
+	if (fs->stats) {
+		fs->stats->closed_sectors--;
+		fs->stats->gc_count++;
+	}
+
+	if (nvs_close_ate_valid(fs, &close_ate)) {
+		gc_addr &= ADDR_SECT_MASK;
+		gc_addr += close_ate.offset;
+	} else {
+		rc = nvs_recover_last_ate(fs, &gc_addr);
+		if (rc) {
+			return rc;
+		}
+	}
+
+	nvs_ate_win_reset(&gc_win);
+	do {
+		gc_prev_addr = gc_addr;
+		rc = nvs_prev_ate(fs, &gc_addr, &gc_ate, &gc_win);
+		if (rc) {
+			return rc;
+		}
+
+		if (!nvs_ate_valid(fs, &gc_ate)) {
+			continue;
+		}
+
+		/* special purpose ATEs (sector close, gc done, checkpoint) are
+		 * never moved.
+		 */
+		if (gc_ate.id == NVS_SPECIAL_ATE_ID) {
+			continue;
+		}
+
+		/* the start of a range delete is handled with its end */
+		if (gc_ate.part == NVS_ATE_PART_RANGE_LO) {
+			continue;
+		}
+
+		if (fs->stats && !gc_ate.len) {
+			/* erased with the sector unless it is kept */
+			fs->stats->tombstones--;
+		}
+
+		/* a range delete hides entries that are older, in the ring
+		 * mode they are all in the gc'ed sector and it is dropped
+		 */
+		if (gc_ate.part == NVS_ATE_PART_RANGE_HI) {
+#ifdef CONFIG_NVS_GC_POLICY
+			if (fs->sector_info) {
+				rc = nvs_gc_range(fs, gc_prev_addr, &gc_ate,
+						  sec_addr >> ADDR_SECT_SHIFT, gc_queue,
+						  &gc_queued);
+				if (rc < 0) {
+					return rc;
+				}
+			}
+#endif
+			continue;
+		}
+
+		wlk_addr = nvs_lookup_start(fs, gc_ate.id);
+
+		if (wlk_addr == NVS_LOOKUP_CACHE_NO_ADDR) {
+			wlk_addr = fs->ate_wra;
+		}
+
+		nvs_ate_win_reset(&wlk_win);
+		do {
+			wlk_prev_addr = wlk_addr;
+			rc = nvs_prev_ate(fs, &wlk_addr, &wlk_ate, &wlk_win);
+			if (rc) {
+				return rc;
+			}
+			/* if ate with same id is reached we might need to copy.
+			 * only consider valid wlk_ate's. Something wrong might
+			 * have been written that has the same ate but is
+			 * invalid, don't consider these as a match.
+			 */
+			rc = nvs_ate_match(fs, wlk_prev_addr, &wlk_ate, gc_ate.id);
+			if (rc < 0) {
+				return rc;
+			}
+			if (rc) {
+				break;
 			}
 		} while (wlk_addr != fs->ate_wra);
 
-		/* if walk has reached the same address as gc_addr copy is
-		 * needed unless it is a deleted item.
-		 */
-		if ((wlk_prev_addr == gc_prev_addr) && gc_ate.len) {
-			/* copy needed */
-			LOG_DBG("Moving %d, len %d", gc_ate.id, gc_ate.len);
+		/* if walk has reached the same address as gc_addr copy is
+		 * needed unless it is a deleted item.
+		 */
+		if (wlk_prev_addr != gc_prev_addr) {
+			continue;
+		}
+
+#ifdef CONFIG_NVS_GC_POLICY
+		if (fs->sector_info && !gc_ate.len) {
+			rc = nvs_gc_keep_delete(fs, wlk_addr, sec_addr >> ADDR_SECT_SHIFT,
+						gc_ate.id, gc_ate.id);
+			if (rc < 0) {
+				return rc;
+			}
+			if (rc) {
+				LOG_DBG("Keeping delete of %d", gc_ate.id);
+				if (fs->stats) {
+					fs->stats->tombstones++;
+				}
+				gc_ate.offset = (nvs_ate_off_t)(fs->data_wra & ADDR_OFFS_MASK);
+				nvs_ate_crc8_update(fs, &gc_ate);
+				rc = nvs_gc_ate_queue(fs, gc_queue, &gc_queued, &gc_ate);
+				if (rc) {
+					return rc;
+				}
+			}
+			continue;
+		}
+#endif
+
+		if (fs->stats) {
+			fs->stats->gc_bytes += nvs_ate_space(fs, &gc_ate);
+		}
+
+		if (nvs_ate_inline(&gc_ate)) {
+			/* the value moves with its ate */
+			LOG_DBG("Moving inline %d, len %d", gc_ate.id, gc_ate.len);
+			rc = nvs_gc_ate_queue(fs, gc_queue, &gc_queued, &gc_ate);
+			if (rc) {
+				return rc;
+			}
+#ifdef CONFIG_NVS_GC_POLICY
+			if (fs->sector_info) {
+				nvs_sector_live_add(fs, fs->ate_wra + ate_size,
+						    nvs_ate_blk_size(fs));
+			}
+#endif
+		} else if (gc_ate.len) {
+			/* copy needed */
+			LOG_DBG("Moving %d, len %d", gc_ate.id, gc_ate.len);
+
+			data_addr = (gc_prev_addr & ADDR_SECT_MASK);
+			data_addr += gc_ate.offset;
+
+			gc_ate.offset = (nvs_ate_off_t)(fs->data_wra & ADDR_OFFS_MASK);
+			nvs_ate_crc8_update(fs, &gc_ate);
+
+			rc = nvs_flash_block_move(fs, data_addr, gc_ate.len);
+			if (rc) {
+				return rc;
+			}
+
+			rc = nvs_gc_ate_queue(fs, gc_queue, &gc_queued, &gc_ate);
+			if (rc) {
+				return rc;
+			}
+#ifdef CONFIG_NVS_GC_POLICY
+			if (fs->sector_info) {
+				nvs_sector_live_add(fs, fs->ate_wra + ate_size,
+						    nvs_entry_space(fs, gc_ate.len));
+			}
+#endif
+		}
+	} while (gc_prev_addr != stop_addr);
+
+	if (gc_queued) {
+		rc = nvs_flash_ate_wrt_n(fs, gc_queue, gc_queued);
+		if (rc) {
+			return rc;
+		}
+	}
+
+gc_done:
+
+	/* Make it possible to detect that gc has finished by writing a
+	 * gc done ate to the sector. In the field we might have nvs systems
+	 * that do not have sufficient space to add this ate, so for these
+	 * situations avoid adding the gc done ate.
+	 */
+
+	if (nvs_ate_wra_blk(fs) >= (fs->data_wra + nvs_ate_blk_size(fs))) {
+		rc = nvs_add_gc_done_ate(fs);
+		if (rc) {
+			return rc;
+		}
+	}
+
+#if defined(CONFIG_NVS_GC_POLICY) && defined(CONFIG_NVS_LOOKUP_CACHE)
+	/* cache positions still pointing at the victim hold a dropped delete or
+	 * range delete. They are shared with ids that may have entries in
+	 * sectors that are not collected: the erase empties them and they are
+	 * indexed again from the write sector. Lookups of empty positions start
+	 * there in the meantime.
+	 */
+	bool refill = fs->sector_info && fs->lookup_cache &&
+		      nvs_lookup_cache_points(fs, sec_addr >> ADDR_SECT_SHIFT);
+
+	if (refill) {
+		__atomic_store_n(&fs->lookup_cache_next, fs->ate_wra, __ATOMIC_RELEASE);
+	}
+#endif
+
+	/* Erase the gc'ed sector */
+	rc = nvs_flash_erase_sector(fs, sec_addr);
+
+#if defined(CONFIG_NVS_GC_POLICY) && defined(CONFIG_NVS_LOOKUP_CACHE)
+	if (!rc && refill) {
+		rc = nvs_lookup_cache_complete(fs);
+	}
+#endif
+	return rc;
+}
+
+#ifdef CONFIG_NVS_CHECKPOINT
+
+/* Checkpoint record: the header is followed by a snapshot of the lookup
+ * cache. The header is padded to NVS_BLOCK_SIZE so that the snapshot starts
+ * on a write block boundary.
+ */
+struct nvs_checkpoint_hdr {
+	uint32_t crc32;		/* crc32 of the rest of the header and the snapshot */
+	uint32_t ate_wra;	/* address of the checkpoint ATE */
+	uint32_t data_wra;	/* data write address after the checkpoint data */
+	uint32_t cache_size;	/* number of lookup cache entries in the snapshot */
+	uint8_t reserved[NVS_BLOCK_SIZE - 4 * sizeof(uint32_t)];
+};
+
+static inline size_t nvs_checkpoint_len(struct nvs_fs *fs)
+{
+	return sizeof(struct nvs_checkpoint_hdr) + fs->lookup_cache_size * sizeof(uint32_t);
+}
+
+static uint32_t nvs_checkpoint_crc(struct nvs_fs *fs,
+				   const struct nvs_checkpoint_hdr *hdr)
+{
+	uint32_t crc;
+
+	crc = nvs_crc(fs)->crc32(0U, (const uint8_t *)hdr + sizeof(hdr->crc32),
+				 sizeof(*hdr) - sizeof(hdr->crc32));
+	return nvs_crc(fs)->crc32(crc, (const uint8_t *)fs->lookup_cache,
+				  fs->lookup_cache_size * sizeof(uint32_t));
+}
+
+/* Returns true if a checkpoint fits in the current sector while still leaving
+ * room for a delete ate.
+ */
+static bool nvs_checkpoint_fits(struct nvs_fs *fs)
+{
+	return nvs_ate_wra_blk(fs) >= fs->data_wra + nvs_al_size(fs, nvs_checkpoint_len(fs)) +
+					     nvs_ate_blk_size(fs);
+}
+
+/* write a checkpoint record at the current write position */
+static int nvs_checkpoint_wrt(struct nvs_fs *fs)
+{
+	struct nvs_checkpoint_hdr hdr;
+	struct nvs_ate entry;
+	int rc;
+
+	/* the snapshot must hold the complete cache */
+	rc = nvs_lookup_cache_complete(fs);
+	if (rc) {
+		return rc;
+	}
+
+	LOG_DBG("Adding checkpoint at %x", fs->ate_wra);
+
+	memset(&hdr, 0xff, sizeof(hdr));
+	hdr.ate_wra = fs->ate_wra;
+	hdr.data_wra = fs->data_wra + nvs_al_size(fs, nvs_checkpoint_len(fs));
+	hdr.cache_size = fs->lookup_cache_size;
+	hdr.crc32 = nvs_checkpoint_crc(fs, &hdr);
+
+	memset(&entry, 0xff, sizeof(entry));
+	entry.id = NVS_SPECIAL_ATE_ID;
+	entry.offset = (nvs_ate_off_t)(fs->data_wra & ADDR_OFFS_MASK);
+	entry.len = (nvs_ate_off_t)nvs_checkpoint_len(fs);
+	entry.part = NVS_ATE_PART_CHECKPOINT;
+	nvs_ate_crc8_update(fs, &entry);
+
+	rc = nvs_flash_data_wrt(fs, &hdr, sizeof(hdr), false);
+	if (rc) {
+		return rc;
+	}
+
+	rc = nvs_flash_data_wrt(fs, fs->lookup_cache, fs->lookup_cache_size * sizeof(uint32_t),
+				false);
+	if (rc) {
+		return rc;
+	}
+
+	return nvs_flash_ate_wrt(fs, &entry);
+}
+
+/* find the most recent checkpoint in the write sector or the sector before */
+static int nvs_checkpoint_find(struct nvs_fs *fs, uint32_t *cp_addr,
+			       struct nvs_ate *cp_ate)
+{
+	int rc;
+	uint32_t addr, ate_addr, wr_sector;
+	struct nvs_ate_win win;
+
+	wr_sector = fs->ate_wra >> ADDR_SECT_SHIFT;
+	addr = fs->ate_wra;
+	nvs_ate_win_reset(&win);
+
+	while (true) {
+		ate_addr = addr;
+		rc = nvs_prev_ate(fs, &addr, cp_ate, &win);
+		if (rc) {
+			return rc;
+		}
+
+		if (((wr_sector + nvs_sector_count(fs) - (ate_addr >> ADDR_SECT_SHIFT)) %
+		     nvs_sector_count(fs)) > 1) {
+			break;
+		}
+
+		if ((cp_ate->id == NVS_SPECIAL_ATE_ID) &&
+		    (cp_ate->part == NVS_ATE_PART_CHECKPOINT) &&
+		    nvs_ate_valid(fs, cp_ate)) {
+			*cp_addr = ate_addr;
+			return 0;
+		}
+
+		if (addr == fs->ate_wra) {
+			break;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/* update the lookup cache with the ates written after the checkpoint at
+ * cp_addr, walking them from oldest to newest.
+ */
+static int nvs_checkpoint_replay(struct nvs_fs *fs, uint32_t cp_addr)
+{
+	int rc;
+	uint32_t addr, first_addr, last_addr;
+	struct nvs_ate ate;
+	size_t ate_size;
+
+	ate_size = nvs_ate_size(fs);
+	first_addr = cp_addr;
+
+	while (true) {
+		if ((first_addr & ADDR_SECT_MASK) == (fs->ate_wra & ADDR_SECT_MASK)) {
+			last_addr = fs->ate_wra + ate_size;
+		} else {
+			/* closed sector, the close ate tells where its last ate is */
+			last_addr = (first_addr & ADDR_SECT_MASK) + nvs_sector_size(fs) - ate_size;
+			rc = nvs_flash_ate_rd(fs, last_addr, &ate);
+			if (rc) {
+				return rc;
+			}
+
+			if (nvs_close_ate_valid(fs, &ate)) {
+				last_addr &= ADDR_SECT_MASK;
+				last_addr += ate.offset;
+			} else {
+				rc = nvs_recover_last_ate(fs, &last_addr);
+				if (rc) {
+					return rc;
+				}
+			}
+		}
+
+		for (addr = first_addr - ate_size; (addr >= last_addr) && (addr < first_addr);
+		     addr -= ate_size) {
+			rc = nvs_flash_ate_rd(fs, addr, &ate);
+			if (rc) {
+				return rc;
+			}
+
+			if ((ate.part == NVS_ATE_PART_RANGE_LO) ||
+			    (ate.part == NVS_ATE_PART_RANGE_HI)) {
+				rc = nvs_lookup_cache_range_ate(fs, addr, &ate, false);
+				if (rc) {
+					return rc;
+				}
+			} else if ((ate.id != NVS_SPECIAL_ATE_ID) && nvs_ate_valid(fs, &ate)) {
+				fs->lookup_cache[nvs_lookup_cache_pos(fs, ate.id)] = addr;
+			}
+		}
+
+		if ((first_addr & ADDR_SECT_MASK) == (fs->ate_wra & ADDR_SECT_MASK)) {
+			break;
+		}
+
+		/* continue after the close ate of the next sector */
+		first_addr &= ADDR_SECT_MASK;
+		nvs_sector_advance(fs, &first_addr);
+		first_addr += nvs_sector_size(fs) - ate_size;
+	}
+
+	return 0;
+}
+
+/* Load the lookup cache from the most recent checkpoint and replay the ates
+ * written after it. Returns 0 on success, an error if no usable checkpoint
+ * was found, in which case the lookup cache needs to be rebuilt.
+ */
+static int nvs_checkpoint_load(struct nvs_fs *fs)
+{
+	int rc;
+	uint32_t cp_addr, data_addr, cp_sector, wr_sector, sector;
+	uint32_t *cache_entry;
+	uint32_t *const cache_end = &fs->lookup_cache[fs->lookup_cache_size];
+	struct nvs_checkpoint_hdr hdr;
+	struct nvs_ate cp_ate;
+	uint16_t erased;
+
+	rc = nvs_checkpoint_find(fs, &cp_addr, &cp_ate);
+	if (rc) {
+		return rc;
+	}
+
+	if (cp_ate.len != nvs_checkpoint_len(fs)) {
+		return -EINVAL;
+	}
+
+	data_addr = (cp_addr & ADDR_SECT_MASK) + cp_ate.offset;
+	rc = nvs_flash_rd(fs, data_addr, &hdr, sizeof(hdr));
+	if (rc) {
+		return rc;
+	}
+
+	if ((hdr.ate_wra != cp_addr) || (hdr.cache_size != fs->lookup_cache_size)) {
+		return -EINVAL;
+	}
+
+	rc = nvs_flash_rd(fs, data_addr + sizeof(hdr), fs->lookup_cache,
+			  fs->lookup_cache_size * sizeof(uint32_t));
+	if (rc) {
+		return rc;
+	}
+
+	if (hdr.crc32 != nvs_checkpoint_crc(fs, &hdr)) {
+		LOG_WRN("Invalid checkpoint CRC");
+		return -EIO;
+	}
+
+	/* The sectors that have been garbage collected since the checkpoint was
+	 * written no longer hold the data the snapshot refers to, their live
+	 * entries have been moved into the sectors that are replayed.
+	 */
+	cp_sector = cp_addr >> ADDR_SECT_SHIFT;
+	wr_sector = fs->ate_wra >> ADDR_SECT_SHIFT;
+	erased = (wr_sector + nvs_sector_count(fs) - cp_sector) % nvs_sector_count(fs);
+	if (erased) {
+		for (cache_entry = fs->lookup_cache; cache_entry < cache_end; ++cache_entry) {
+			if (*cache_entry == NVS_LOOKUP_CACHE_NO_ADDR) {
+				continue;
+			}
+
+			sector = *cache_entry >> ADDR_SECT_SHIFT;
+			sector = (sector + nvs_sector_count(fs) - cp_sector) % nvs_sector_count(fs);
+			if ((sector >= 1) && (sector <= erased + 1U)) {
+				*cache_entry = NVS_LOOKUP_CACHE_NO_ADDR;
+			}
+		}
+	}
+
+	LOG_INF("Checkpoint found at %x", cp_addr);
+	return nvs_checkpoint_replay(fs, cp_addr);
+}
+
+#endif /* CONFIG_NVS_CHECKPOINT */
+
+/* find the write addresses in the sector whose close ate is at addr */
+static int nvs_startup_wra(struct nvs_fs *fs, uint32_t addr)
+{
+	int rc;
+	struct nvs_ate last_ate;
+	uint32_t data_end;
+	size_t ate_size = nvs_ate_size(fs);
+	uint8_t erase_value = fs->flash_parameters->erase_value;
+#ifdef CONFIG_NVS_PACKED_ATE
+	size_t blk_size = nvs_ate_blk_size(fs);
+	uint32_t blk_addr;
+#endif
+
+	/* addr contains address of closing ate in the most recent sector,
+	 * search for the last valid ate using the recover_last_ate routine
+	 */
+
+	rc = nvs_recover_last_ate_end(fs, &addr, &data_end);
+	if (rc) {
+		return rc;
+	}
+
+	/* addr contains address of the last valid ate in the most recent sector
+	 * search for the first ate containing all cells erased, in the process
+	 * also update fs->data_wra. The last valid ate may hold its value
+	 * inline, data_end is the end of the data of older entries.
+	 */
+	fs->ate_wra = addr;
+	fs->data_wra = addr & ADDR_SECT_MASK;
+	fs->data_wra += nvs_al_size(fs, data_end & ADDR_OFFS_MASK);
+
+	while (fs->ate_wra >= fs->data_wra) {
+		rc = nvs_flash_ate_rd(fs, fs->ate_wra, &last_ate);
+		if (rc) {
+			return rc;
+		}
+
+		rc = nvs_ate_cmp_const(&last_ate, erase_value);
+
+#ifdef CONFIG_NVS_PACKED_ATE
+		/* blocks programmed with fewer entries than they hold end with
+		 * empty locations, the table only ends where the next block is
+		 * empty as well
+		 */
+		if (!rc) {
+			blk_addr = fs->ate_wra & ~(uint32_t)(blk_size - 1U);
+			if (blk_addr >= fs->data_wra + blk_size) {
+				blk_addr -= blk_size;
+			}
+			rc = nvs_flash_cmp_const(fs, blk_addr, erase_value,
+						 fs->ate_wra + ate_size - blk_addr);
+			if (rc < 0) {
+				return rc;
+			}
+		}
+#endif
+
+		if (!rc) {
+			/* found ff empty location */
+			break;
+		}
+
+		if (nvs_ate_valid(fs, &last_ate) && !nvs_ate_inline(&last_ate)) {
+			/* complete write of ate was performed */
+			fs->data_wra = addr & ADDR_SECT_MASK;
+			/* Align the data write address to the current
+			 * write block size so that it is possible to write to
+			 * the sector even if the block size has changed after
+			 * a software upgrade (unless the physical ATE size
+			 * will change)."
+			 */
+			fs->data_wra += nvs_al_size(fs, last_ate.offset + last_ate.len);
+
+			/* ate on the last position within the sector is
+			 * reserved for deletion an entry
+			 */
+			if (fs->ate_wra == fs->data_wra && last_ate.len) {
+				/* not a delete ate */
+				return -ESPIPE;
+			}
+		}
+
+		fs->ate_wra -= ate_size;
+	}
+
+#ifdef CONFIG_NVS_PACKED_ATE
+	/* the entries of a write block are programmed together, a block that
+	 * was partially programmed can not be used anymore: continue with the
+	 * next block
+	 */
+	blk_addr = fs->ate_wra & ~(uint32_t)(blk_size - 1U);
+	rc = nvs_flash_cmp_const(fs, blk_addr, erase_value, blk_size);
+	if (rc < 0) {
+		return rc;
+	}
+	if (rc || (fs->ate_wra != blk_addr + blk_size - ate_size)) {
+		LOG_DBG("Skipping used ate block at %x", blk_addr);
+		fs->ate_wra = blk_addr - ate_size;
+	}
+#endif
+
+	return 0;
+}
+
+static int nvs_startup_data_wra(struct nvs_fs *fs)
+{
+	int rc;
+	size_t empty_len, wbs = nvs_write_block_size(fs);
+	uint32_t lo = 0U, hi, mid, addr;
+	uint8_t erase_value = fs->flash_parameters->erase_value;
+
+	/* possible data write after last ate write. Data is programmed in
+	 * order, the first erased write block is found by bisection.
+	 */
+	hi = 0U;
+	if (fs->ate_wra > fs->data_wra) {
+		hi = (fs->ate_wra - fs->data_wra + wbs - 1U) / wbs;
+	}
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2U;
+		addr = fs->data_wra + mid * wbs;
+		rc = nvs_flash_cmp_const(fs, addr, erase_value,
+					 MIN(wbs, fs->ate_wra - addr));
+		if (rc < 0) {
+			return rc;
+		}
+		if (rc) {
+			lo = mid + 1U;
+		} else {
+			hi = mid;
+		}
+	}
+	fs->data_wra += lo * wbs;
+
+	/* data that looks erased may have been found instead, make sure that
+	 * everything up to the allocation table is erased, update data_wra
+	 */
+	while (fs->ate_wra > fs->data_wra) {
+		empty_len = fs->ate_wra - fs->data_wra;
+
+		rc = nvs_flash_cmp_const(fs, fs->data_wra, erase_value,
+				empty_len);
+		if (rc < 0) {
+			return rc;
+		}
+		if (!rc) {
+			break;
+		}
+
+		fs->data_wra += nvs_write_block_size(fs);
+	}
+
+	return 0;
+}
+
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+/**
+ * Before the lookup cache is built gc needs to use it. So, temporarily, we
+ * set the lookup cache to the end of the fs. The cache will be rebuilt
+ * afterwards.
+ **/
+static void nvs_lookup_cache_fill(struct nvs_fs *fs)
+{
+	for (size_t pos = 0; fs->lookup_cache && (pos < fs->lookup_cache_size); pos++) {
+		fs->lookup_cache[pos] = fs->ate_wra;
+	}
+}
+#endif
+
+#ifdef CONFIG_NVS_GC_POLICY
+
+/* sort key of a sector, free sectors (seq 0) go last */
+static inline uint32_t nvs_sector_key(struct nvs_fs *fs, uint16_t sector)
+{
+	return fs->sector_info[sector].seq - 1U;
+}
+
+/* Link the sectors from old to new followed by the free ones. The next links
+ * are sorted in place by a bottom-up merge sort, which is stable so free
+ * sectors keep their position order. Returns the oldest sector.
+ */
+static uint16_t nvs_sector_sort(struct nvs_fs *fs)
+{
+	struct nvs_sector_info *info = fs->sector_info;
+	uint16_t head, tail, p, q, e, i;
+	uint32_t width, psize, qsize, merges;
+
+	for (i = 0; i < nvs_sector_count(fs); i++) {
+		info[i].next = (i + 1U < nvs_sector_count(fs)) ? (i + 1U) : NVS_NO_VICTIM;
+	}
+	head = 0U;
+
+	for (width = 1U;; width <<= 1) {
+		p = head;
+		head = tail = NVS_NO_VICTIM;
+		merges = 0U;
+
+		while (p != NVS_NO_VICTIM) {
+			merges++;
+			q = p;
+			for (psize = 0U; (psize < width) && (q != NVS_NO_VICTIM); psize++) {
+				q = info[q].next;
+			}
+			qsize = width;
+
+			while (psize || (qsize && (q != NVS_NO_VICTIM))) {
+				if (!psize || (qsize && (q != NVS_NO_VICTIM) &&
+					       (nvs_sector_key(fs, q) < nvs_sector_key(fs, p)))) {
+					e = q;
+					q = info[q].next;
+					qsize--;
+				} else {
+					e = p;
+					p = info[p].next;
+					psize--;
+				}
+				if (tail == NVS_NO_VICTIM) {
+					head = e;
+				} else {
+					info[tail].next = e;
+				}
+				tail = e;
+			}
+			p = q;
+		}
+		info[tail].next = NVS_NO_VICTIM;
+
+		if (merges <= 1U) {
+			break;
+		}
+	}
+
+	/* close the ring and set the back links */
+	for (p = head; info[p].next != NVS_NO_VICTIM; p = info[p].next) {
+		info[info[p].next].prev = p;
+	}
+	info[p].next = head;
+	info[head].prev = p;
+
+	return head;
+}
+
+/* Startup for the gc policy mode: the sector order is given by the sequence
+ * numbers in the sector headers instead of the position of the sectors.
+ */
+static int nvs_startup_gc_policy(struct nvs_fs *fs)
+{
+	struct nvs_sector_info *info = fs->sector_info;
+	struct nvs_sector_hdr hdr;
+	struct nvs_ate ate;
+	uint32_t addr;
+	uint16_t i, first, wr, victim;
+	size_t ate_size;
+	uint8_t erase_value = fs->flash_parameters->erase_value;
+	bool gc_done_marker = false;
+	int rc;
+
+	ate_size = nvs_ate_size(fs);
+	fs->sector_seq = 0U;
+
+	for (i = 0; i < nvs_sector_count(fs); i++) {
+		info[i].seq = 0U;
+		info[i].live = 0U;
+
+		rc = nvs_sector_hdr_rd(fs, i, &hdr);
+		if (!rc) {
+			info[i].seq = hdr.seq;
+			fs->sector_seq = MAX(fs->sector_seq, hdr.seq);
+			continue;
+		}
+		if (rc != -ENOENT) {
+			return rc;
+		}
+
+		addr = (uint32_t)i << ADDR_SECT_SHIFT;
+		rc = nvs_flash_cmp_const(fs, addr, erase_value, nvs_sector_size(fs));
+		if (rc <= 0) {
+			if (rc < 0) {
+				return rc;
+			}
+			continue;
+		}
+
+		/* a valid close or first ate without a header belongs to a nvs
+		 * that was not written in this mode, do not touch it
+		 */
+		rc = nvs_flash_ate_rd(fs, addr + nvs_sector_size(fs) - ate_size, &ate);
+		if (rc) {
+			return rc;
+		}
+		if (nvs_close_ate_valid(fs, &ate)) {
+			return -EDEADLK;
+		}
+		rc = nvs_flash_ate_rd(fs, addr + nvs_ate_first(fs), &ate);
+		if (rc) {
+			return rc;
+		}
+		if (nvs_ate_valid(fs, &ate)) {
+			return -EDEADLK;
+		}
+
+		/* interrupted header write, the sector is used as a free one */
+		if (fs->read_only) {
+			continue;
+		}
+		LOG_INF("Erasing sector %d without header", i);
+		rc = nvs_flash_erase_sector(fs, addr);
+		if (rc) {
+			return rc;
+		}
+	}
+
+	first = nvs_sector_sort(fs);
+
+	if (!fs->sector_seq) {
+		/* new file system */
+		fs->ate_wra = (uint32_t)first << ADDR_SECT_SHIFT;
+		fs->ate_wra += nvs_ate_first(fs);
+		fs->data_wra = fs->ate_wra & ADDR_SECT_MASK;
+		if (fs->read_only) {
+			return 0;
+		}
+		rc = nvs_sector_open(fs);
+		if (rc) {
+			return rc;
+		}
+		return nvs_add_gc_done_ate(fs);
+	}
+
+	for (wr = 0; info[wr].seq != fs->sector_seq; wr++) {
+	}
+	rc = nvs_sector_hdr_rd(fs, wr, &hdr);
+	if (rc) {
+		return rc;
+	}
+	victim = hdr.victim;
+
+	addr = ((uint32_t)wr << ADDR_SECT_SHIFT) + nvs_sector_size(fs) - ate_size;
+	rc = nvs_flash_cmp_const(fs, addr, erase_value, sizeof(struct nvs_ate));
+	if (rc < 0) {
+		return rc;
+	}
+	if (rc) {
+		/* the write sector was closed but the next one was not opened */
+		LOG_INF("Opening sector after closed sector %d", wr);
+		fs->ate_wra = (addr & ADDR_SECT_MASK) + nvs_ate_first(fs);
+		nvs_sector_advance(fs, &fs->ate_wra);
+		fs->data_wra = fs->ate_wra & ADDR_SECT_MASK;
+		if (fs->read_only) {
+			return 0;
+		}
+		rc = nvs_sector_open(fs);
+		if (rc) {
+			return rc;
+		}
+		nvs_lookup_cache_fill(fs);
+		return nvs_gc(fs);
+	}
+
+	rc = nvs_startup_wra(fs, addr);
+	if (rc) {
+		return rc;
+	}
+
+	rc = nvs_startup_data_wra(fs);
+	if (rc) {
+		return rc;
+	}
+
+	fs->gc_victim = victim;
+	if ((victim >= nvs_sector_count(fs)) || (victim == wr) || !info[victim].seq ||
+	    fs->read_only) {
+		/* a victim that gc did not finish to collect is read with the
+		 * other sectors, it is older than the write sector
+		 */
+		return 0;
+	}
+
+	/* the victim of the write sector still holds data, look for the marker
+	 * (gc_done_ate) that indicates that gc was finished.
+	 */
+	for (addr = fs->ate_wra + ate_size;
+	     (addr & ADDR_OFFS_MASK) < (nvs_sector_size(fs) - ate_size); addr += ate_size) {
+		rc = nvs_flash_ate_rd(fs, addr, &ate);
+		if (rc) {
+			return rc;
+		}
+		if (nvs_ate_valid(fs, &ate) && (ate.id == NVS_SPECIAL_ATE_ID) &&
+		    (ate.len == 0U)) {
+			gc_done_marker = true;
+			break;
+		}
+	}
+
+	if (gc_done_marker) {
+		LOG_INF("GC Done marker found");
+		return nvs_flash_erase_sector(fs, (uint32_t)victim << ADDR_SECT_SHIFT);
+	}
+
+	LOG_INF("No GC Done marker found: restarting gc");
+	rc = nvs_flash_erase_sector(fs, fs->ate_wra);
+	if (rc) {
+		return rc;
+	}
+	fs->ate_wra &= ADDR_SECT_MASK;
+	fs->ate_wra += nvs_ate_first(fs);
+	fs->data_wra = (fs->ate_wra & ADDR_SECT_MASK);
+	info[wr].seq = fs->sector_seq;
+	rc = nvs_sector_hdr_wrt(fs);
+	if (rc) {
+		return rc;
+	}
+	nvs_lookup_cache_fill(fs);
+	return nvs_gc(fs);
+}
+
+#endif /* CONFIG_NVS_GC_POLICY */
+
+static int nvs_startup(struct nvs_fs *fs)
+{
+	int rc;
+	size_t ate_size;
+	/* Initialize addr to 0 for the case fs->sector_count == 0. This
+	 * should never happen as this is verified in nvs_mount() but both
+	 * Coverity and GCC believe the contrary.
+	 */
+	uint32_t addr = 0U, next_addr;
+	uint16_t i, closed_sectors = 0;
+	int closed, next_closed;
+	uint8_t erase_value = fs->flash_parameters->erase_value;
+#ifdef CONFIG_NVS_CHECKPOINT
+	bool gc_pending = false;
+#endif
+
+	if(fs->impl_mutex_lock_forever)
+		fs->impl_mutex_lock_forever();
+
+	ate_size = nvs_ate_size(fs);
+
+#ifdef CONFIG_NVS_GC_POLICY
+	if (fs->sector_info) {
+		rc = nvs_startup_gc_policy(fs);
+		goto end;
+	}
+#endif
+
+	/* step through the sectors to find a open sector following
+	 * a closed sector, this is where NVS can write. The close ate of each
+	 * sector is only read once, the state of the next sector is kept for
+	 * the next step.
+	 */
+	addr = (uint32_t)(nvs_sector_size(fs) - ate_size);
+	next_closed = nvs_flash_cmp_const(fs, addr, erase_value,
+					  sizeof(struct nvs_ate));
+	for (i = 0; i < nvs_sector_count(fs); i++) {
+		addr = ((uint32_t)i << ADDR_SECT_SHIFT) +
+		       (uint32_t)(nvs_sector_size(fs) - ate_size);
+		closed = next_closed;
+		next_addr = addr;
+		nvs_sector_advance(fs, &next_addr);
+		next_closed = nvs_flash_cmp_const(fs, next_addr, erase_value,
+						  sizeof(struct nvs_ate));
+		if (closed) {
+			/* closed sector */
+			closed_sectors++;
+			if (!next_closed) {
+				/* open sector */
+				addr = next_addr;
+				break;
+			}
+		}
+	}
+	/* all sectors are closed, this is not a nvs fs */
+	if (closed_sectors == nvs_sector_count(fs)) {
+		rc = -EDEADLK;
+		goto end;
+	}
+
+	if (i == nvs_sector_count(fs)) {
+		/* none of the sectors where closed, in most cases we can set
+		 * the address to the first sector, except when there are only
+		 * two sectors. Then we can only set it to the first sector if
+		 * the last sector contains no ate's. So we check this first
+		 */
+		rc = nvs_flash_cmp_const(fs, (addr & ADDR_SECT_MASK) + nvs_ate_first(fs),
+					 erase_value, sizeof(struct nvs_ate));
+		if (!rc) {
+			/* empty ate */
+			nvs_sector_advance(fs, &addr);
+		}
+	}
+
+	rc = nvs_startup_wra(fs, addr);
+	if (rc) {
+		goto end;
+	}
+
+	/* if the sector after the write sector is not empty gc was interrupted
+	 * we might need to restart gc if it has not yet finished. Otherwise
+	 * just erase the sector.
+	 * When gc needs to be restarted, first erase the sector otherwise the
+	 * data might not fit into the sector.
+	 */
+	addr = fs->ate_wra & ADDR_SECT_MASK;
+	nvs_sector_advance(fs, &addr);
+	rc = nvs_flash_cmp_const(fs, addr, erase_value, nvs_sector_size(fs));
+	if (rc < 0) {
+		goto end;
+	}
+	if (rc && fs->read_only) {
+		/* the gc'ed sector still holds all its entries, the copies gc
+		 * made in the write sector are more recent and the walks find
+		 * them first
+		 */
+		LOG_INF("Reading around interrupted gc");
+#ifdef CONFIG_NVS_CHECKPOINT
+		gc_pending = true;
+#endif
+		rc = 0;
+	}
+	if (rc) {
+		/* the sector after fs->ate_wrt is not empty, look for a marker
+		 * (gc_done_ate) that indicates that gc was finished.
+		 */
+		bool gc_done_marker = false;
+		struct nvs_ate gc_done_ate;
+
+		addr = fs->ate_wra + ate_size;
+		while ((addr & ADDR_OFFS_MASK) < (nvs_sector_size(fs) - ate_size)) {
+			rc = nvs_flash_ate_rd(fs, addr, &gc_done_ate);
+			if (rc) {
+				goto end;
+			}
+			if (nvs_ate_valid(fs, &gc_done_ate) &&
+			    (gc_done_ate.id == NVS_SPECIAL_ATE_ID) &&
+			    (gc_done_ate.len == 0U)) {
+				gc_done_marker = true;
+				break;
+			}
+			addr += ate_size;
+		}
+
+		if (gc_done_marker) {
+			/* erase the next sector */
+			LOG_INF("GC Done marker found");
+			addr = fs->ate_wra & ADDR_SECT_MASK;
+			nvs_sector_advance(fs, &addr);
+			rc = nvs_flash_erase_sector(fs, addr);
+			goto end;
+		}
+		LOG_INF("No GC Done marker found: restarting gc");
+		rc = nvs_flash_erase_sector(fs, fs->ate_wra);
+		if (rc) {
+			goto end;
+		}
+		fs->ate_wra &= ADDR_SECT_MASK;
+		fs->ate_wra += nvs_ate_first(fs);
+		fs->data_wra = (fs->ate_wra & ADDR_SECT_MASK);
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+		nvs_lookup_cache_fill(fs);
+#endif
+		rc = nvs_gc(fs);
+		goto end;
+	}
+
+	rc = nvs_startup_data_wra(fs);
+	if (rc) {
+		goto end;
+	}
+
+	/* If the ate_wra is pointing to the first ate write location in a
+	 * sector and data_wra is not 0, erase the sector as it contains no
+	 * valid data (this also avoids closing a sector without any data).
+	 */
+	if (!fs->read_only && ((fs->ate_wra & ADDR_OFFS_MASK) == nvs_ate_first(fs)) &&
+	    (fs->data_wra != (fs->ate_wra & ADDR_SECT_MASK))) {
+		rc = nvs_flash_erase_sector(fs, fs->ate_wra);
+		if (rc) {
+			goto end;
+		}
+		fs->data_wra = fs->ate_wra & ADDR_SECT_MASK;
+	}
+
+end:
+
+#ifdef CONFIG_NVS_CHECKPOINT
+	/* loading a checkpoint assumes that the sector gc was collecting is
+	 * erased, it is not after a read-only mount
+	 */
+	if (!rc && fs->lookup_cache && (gc_pending || nvs_checkpoint_load(fs))) {
+		rc = nvs_lookup_cache_rebuild(fs);
+	}
+#elif defined(CONFIG_NVS_LOOKUP_CACHE)
+	if (!rc && fs->lookup_cache) {
+		rc = nvs_lookup_cache_rebuild(fs);
+	}
+#endif
+#ifdef CONFIG_NVS_GC_POLICY
+	if (!rc && fs->sector_info) {
+		rc = nvs_sector_live_rebuild(fs);
+	}
+#endif
+	if (!rc && fs->stats) {
+		rc = nvs_stats_rebuild(fs);
+	}
+	/* If the sector is empty add a gc done ate to avoid having insufficient
+	 * space when doing gc.
+	 */
+	if ((!rc) && !fs->read_only &&
+	    ((fs->ate_wra & ADDR_OFFS_MASK) == nvs_ate_first(fs))) {
+
+		rc = nvs_add_gc_done_ate(fs);
+	}
+
+	if (fs->impl_mutex_unlock)
+		fs->impl_mutex_unlock();
+	return rc;
+}
+
+int nvs_clear(struct nvs_fs *fs)
+{
+	int rc;
+	uint32_t addr;
+
+	if (!fs->ready) {
+		LOG_ERR("NVS not initialized");
+		return -EACCES;
+	}
+
+	if (fs->read_only) {
+		return -EROFS;
+	}
+
+	for (uint16_t i = 0; i < nvs_sector_count(fs); i++) {
+		addr = (uint32_t)i << ADDR_SECT_SHIFT;
+		rc = nvs_flash_erase_sector(fs, addr);
+		if (rc) {
+			return rc;
+		}
+	}
+
+	/* nvs needs to be reinitialized after clearing */
+	fs->ready = false;
+
+	return 0;
+}
+
+int nvs_mount(struct nvs_fs *fs)
+{
+	int rc;
+	size_t write_block_size;
+
+	if (fs->impl_init)
+		fs->impl_init();
+
+	if(!fil_is_ready()) {
+		LOG_ERR("Flash Interface Layer is not ready");
+		return -EPERM;
+	}
+
+	fs->flash_parameters = fil_get_flash_parameters();
+	if (fs->flash_parameters == NULL) {
+		LOG_ERR("Could not obtain flash parameters");
+		return -EINVAL;
+	}
+
+	write_block_size = fs->flash_parameters->write_block_size;
+
+	/* a build with a fixed geometry only works with that geometry */
+	if (write_block_size != nvs_write_block_size(fs) ||
+	    fs->sector_size != nvs_sector_size(fs) ||
+	    fs->sector_count != nvs_sector_count(fs)) {
+		LOG_ERR("Geometry does not match the fixed configuration");
+		return -EINVAL;
+	}
+
+	/* check that the write block size is supported */
+	if (write_block_size > NVS_BLOCK_SIZE || write_block_size == 0) {
+		LOG_ERR("Unsupported write block size");
+		return -EINVAL;
+	}
+
+	if (!fs->sector_size || fs->sector_size % write_block_size ||
+	    fs->sector_size % nvs_ate_blk_size(fs) ||
+	    fs->sector_size > NVS_MAX_SECTOR_SIZE) {
+		LOG_ERR("Invalid sector size");
+		return -EINVAL;
+	}
+
+	if (fs->lookup_cache && !fs->lookup_cache_size) {
+		LOG_ERR("Invalid lookup cache size");
+		return -EINVAL;
+	}
+
+	if (fs->gc_buf && (fs->gc_buf_size < write_block_size)) {
+		LOG_ERR("Invalid gc buffer size");
+		return -EINVAL;
+	}
+
+#ifdef CONFIG_NVS_GC_POLICY
+	/* the gc walks rely on the lookup cache to stay short */
+	if (fs->sector_info && (!fs->lookup_cache ||
+				(fs->gc_policy > NVS_GC_GREEDY))) {
+		LOG_ERR("Invalid gc policy configuration");
+		return -EINVAL;
+	}
+#endif
+
+	/* check the number of sectors, it should be at least 2 */
+	if (fs->sector_count < 2) {
+		LOG_ERR("Configuration error - sector count");
+		return -EINVAL;
+	}
+
+#if ADDR_SECT_SHIFT > 16
+	/* the wide layout leaves fewer address bits for the sector number */
+	if (fs->sector_count > NVS_MAX_SECTOR_COUNT) {
+		LOG_ERR("Configuration error - sector count");
+		return -EINVAL;
+	}
+#endif
+
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+	fs->lookup_cache_next = NVS_LOOKUP_CACHE_NO_ADDR;
+#endif
+	fs->scrub_addr = NVS_LOOKUP_CACHE_NO_ADDR;
+	fs->scrub_walk = NVS_LOOKUP_CACHE_NO_ADDR;
+
+	rc = nvs_startup(fs);
+	if (rc) {
+		return rc;
+	}
+
+#ifdef CONFIG_NVS_WRITE_BACK
+	for (size_t i = 0; i < fs->wb_slot_count; i++) {
+		fs->wb_slots[i].dirty = false;
+	}
+#endif
+
+	fs->host_bytes = 0U;
+	fs->flash_bytes = 0U;
+	if (fs->stats) {
+		fs->stats->gc_count = 0U;
+		fs->stats->gc_bytes = 0U;
+	}
+
+	/* nvs is ready for use */
+	fs->ready = true;
+
+	LOG_INF("%d Sectors of %d bytes", nvs_sector_count(fs), nvs_sector_size(fs));
+	LOG_INF("alloc wra: %d, %x",
+		(fs->ate_wra >> ADDR_SECT_SHIFT),
+		(fs->ate_wra & ADDR_OFFS_MASK));
+	LOG_INF("data wra: %d, %x",
+		(fs->data_wra >> ADDR_SECT_SHIFT),
+		(fs->data_wra & ADDR_OFFS_MASK));
+
+	return 0;
+}
+
+/* write an entry to flash, called with the mutex held */
+#ifdef CONFIG_NVS_GC_POLICY
+/* the entry of id at prev_addr is about to be replaced, it is no longer live.
+ * When gc ran it may have been moved, look it up again.
+ */
+static int nvs_write_live_update(struct nvs_fs *fs, nvs_id_t id, bool prev_found,
+				 uint32_t prev_addr, struct nvs_ate *prev_ate, int gc_count)
+{
+	int rc;
+
+	if (gc_count) {
+		rc = nvs_newest_ate(fs, id, &prev_addr, prev_ate);
+		if (rc < 0) {
+			return rc;
+		}
+		prev_found = rc;
+	}
+
+	if (prev_found) {
+		nvs_sector_live_add(fs, prev_addr, -(int32_t)nvs_ate_space(fs, prev_ate));
+	}
+
+	return 0;
+}
+#endif
+
+static ssize_t nvs_write_locked(struct nvs_fs *fs, nvs_id_t id, const void *data,
+				size_t len)
+{
+	int rc, gc_count;
+	size_t ate_size, data_size;
+	struct nvs_ate wlk_ate;
+	struct nvs_ate_win win;
+	uint32_t wlk_addr, rd_addr;
+#ifdef CONFIG_NVS_GC_POLICY
+	uint32_t prev_addr = 0U;
+#endif
+	size_t required_space = 0U; /* no space, appropriate for delete ate */
+	bool prev_found = false;
+	/* bytes stored on flash, differ from data when compressed */
+	const void *st_data = data;
+	size_t st_len = len;
+	uint8_t part = NVS_ATE_PART_DEFAULT;
+
+	/* space used in the allocation table by a single write */
+	ate_size = nvs_ate_blk_size(fs);
+
+#ifdef CONFIG_NVS_INLINE_VALUE
+	/* small values are held by their ate, no data is written */
+	if (len && (len <= NVS_ATE_INLINE_SIZE)) {
+		part = NVS_ATE_PART_INLINE;
+	}
+#endif
+
+#ifdef CONFIG_NVS_COMPRESS
+	if (fs->lz_buf && (fs->lz_buf_size > NVS_LZ_HDR_SIZE) &&
+	    (part == NVS_ATE_PART_DEFAULT) && (len > NVS_LZ_HDR_SIZE + 1U)) {
+		uint32_t raw_len = (uint32_t)len;
+		size_t lz_len;
+
+		/* only keep the compressed form if it is smaller */
+		lz_len = nvs_lz_compress(data, len, &fs->lz_buf[NVS_LZ_HDR_SIZE],
+					 MIN(fs->lz_buf_size, len - 1U) - NVS_LZ_HDR_SIZE);
+		if (lz_len) {
+			memcpy(fs->lz_buf, &raw_len, sizeof(raw_len));
+			st_data = fs->lz_buf;
+			st_len = lz_len + NVS_LZ_HDR_SIZE;
+			part = NVS_ATE_PART_LZ;
+		}
+	}
+#endif
+
+	data_size = (part == NVS_ATE_PART_INLINE) ? 0U : nvs_al_size(fs, st_len);
+
+	/* find latest entry with same id */
+	wlk_addr = nvs_lookup_start(fs, id);
+
+	if (wlk_addr == NVS_LOOKUP_CACHE_NO_ADDR) {
+		goto no_cached_entry;
+	}
+
+	rd_addr = wlk_addr;
+	nvs_ate_win_reset(&win);
+
+	while (1) {
+		rd_addr = wlk_addr;
+		rc = nvs_prev_ate(fs, &wlk_addr, &wlk_ate, &win);
+		if (rc) {
+			return rc;
+		}
+		rc = nvs_ate_match(fs, rd_addr, &wlk_ate, id);
+		if (rc < 0) {
+			return rc;
+		}
+		if (rc) {
+			prev_found = true;
+#ifdef CONFIG_NVS_GC_POLICY
+			prev_addr = rd_addr;
+#endif
+			break;
+		}
+		if (wlk_addr == fs->ate_wra) {
+			break;
+		}
+	}
+
+no_cached_entry:
+
+	if (prev_found) {
+		/* previous entry found */
+		rd_addr &= ADDR_SECT_MASK;
+		rd_addr += wlk_ate.offset;
+
+		if (len == 0) {
+			/* do not try to compare with empty data */
+			if (wlk_ate.len == 0U) {
+				/* skip delete entry as it is already the
+				 * last one
+				 */
+				return 0;
+			}
+#ifdef CONFIG_NVS_INLINE_VALUE
+		} else if (part == NVS_ATE_PART_INLINE) {
+			uint8_t value[NVS_ATE_INLINE_SIZE];
+
+			if (nvs_ate_inline(&wlk_ate) && (wlk_ate.len == len)) {
+				nvs_ate_inline_get(&wlk_ate, value, len);
+				if (!memcmp(value, data, len)) {
+					return 0;
+				}
+			}
+#endif
+		} else if ((st_len + NVS_DATA_CRC_SIZE == wlk_ate.len) &&
+			   (part == wlk_ate.part)) {
+			/* do not try to compare if lengths are not equal */
+			/* compare the data and if equal return 0, the data CRC
+			 * follows from the data and is not compared
+			 */
+			rc = nvs_flash_block_cmp(fs, rd_addr, st_data, st_len);
+			if (rc <= 0) {
+				return rc;
+			}
+		}
+	} else {
+		/* skip delete entry for non-existing entry */
+		if (len == 0) {
+			return 0;
+		}
+	}
+
+	/* calculate required space if the entry contains data */
+	if (data_size) {
+		/* Leave space for delete ate */
+		required_space = data_size + ate_size + NVS_DATA_CRC_SIZE;
+	} else if (part == NVS_ATE_PART_INLINE) {
+		required_space = ate_size;
+	}
+
+	gc_count = 0;
+	while (1) {
+		if (gc_count == nvs_sector_count(fs)) {
+			/* gc'ed all sectors, no extra space will be created
+			 * by extra gc.
+			 */
+			return -ENOSPC;
+		}
+
+		if (nvs_ate_wra_blk(fs) >= (fs->data_wra + required_space)) {
+#ifdef CONFIG_NVS_GC_POLICY
+			if (fs->sector_info) {
+				rc = nvs_write_live_update(fs, id, prev_found, prev_addr,
+							   &wlk_ate, gc_count);
+				if (rc) {
+					return rc;
+				}
+			}
+#endif
+
+#ifdef CONFIG_NVS_INLINE_VALUE
+			if (part == NVS_ATE_PART_INLINE) {
+				rc = nvs_flash_wrt_inline(fs, id, data, len);
+			} else
+#endif
+			{
+				rc = nvs_flash_wrt_entry(fs, id, st_data, st_len, part);
+			}
+			if (rc) {
+				return rc;
+			}
+#ifdef CONFIG_NVS_GC_POLICY
+			if (fs->sector_info && len) {
+				nvs_sector_live_add(fs, fs->ate_wra + ate_size,
+						    (part == NVS_ATE_PART_INLINE) ? ate_size :
+						    nvs_entry_space(fs, st_len + NVS_DATA_CRC_SIZE));
+			}
+#endif
+			if (fs->stats) {
+				nvs_stats_entry(fs, prev_found ? &wlk_ate : NULL,
+						(part == NVS_ATE_PART_INLINE) ? ate_size :
+						nvs_entry_space(fs, len ? st_len + NVS_DATA_CRC_SIZE : 0U));
+			}
+			fs->host_bytes += len;
+			break;
+		}
+
+
+		rc = nvs_sector_close(fs);
+		if (rc) {
+			return rc;
+		}
+
+		rc = nvs_gc(fs);
+		if (rc) {
+			return rc;
+		}
+		gc_count++;
+	}
+
+#ifdef CONFIG_NVS_CHECKPOINT_ON_SECTOR_CLOSE
+	/* a sector has been closed, record a checkpoint if it still fits */
+	if (gc_count && fs->lookup_cache && nvs_checkpoint_fits(fs)) {
+		rc = nvs_checkpoint_wrt(fs);
+		if (rc) {
+			return rc;
+		}
+	}
+#endif
+	return len;
+}
+
+#ifdef CONFIG_NVS_WRITE_BACK
+
+/* Write-back tier: the pending value of a hot id lives in a caller provided
+ * slot until it is flushed. Slot updates are done with the mutex held and
+ * bracketed by slot->seq (odd while updating) so that lock-free readers can
+ * copy the value.
+ */
+static struct nvs_wb_slot *nvs_wb_slot_find(struct nvs_fs *fs, nvs_id_t id)
+{
+	for (size_t i = 0; i < fs->wb_slot_count; i++) {
+		if (fs->wb_slots[i].id == id) {
+			return &fs->wb_slots[i];
+		}
+	}
+
+	return NULL;
+}
+
+static inline void nvs_wb_begin(struct nvs_wb_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1U, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void nvs_wb_end(struct nvs_wb_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1U, __ATOMIC_RELEASE);
+}
+
+/* copy the pending value of slot, -ENOENT if the slot is clean */
+static ssize_t nvs_wb_read(struct nvs_wb_slot *slot, void *data, size_t len)
+{
+	uint32_t seq;
+	ssize_t rc = -ENOENT;
+
+	do {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1U) {
+			continue;
+		}
+		if (!slot->dirty) {
+			rc = -ENOENT;
+		} else {
+			rc = slot->len;
+			memcpy(data, slot->data, MIN(len, slot->len));
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1U) || (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq));
+
+	return rc;
+}
+
+/* flush all pending values, called with the mutex held */
+static int nvs_wb_flush(struct nvs_fs *fs)
+{
+	struct nvs_wb_slot *slot;
+	ssize_t rc;
+
+	for (size_t i = 0; i < fs->wb_slot_count; i++) {
+		slot = &fs->wb_slots[i];
+		if (!slot->dirty) {
+			continue;
+		}
+
+		rc = nvs_write_locked(fs, slot->id, slot->data, slot->len);
+		if (rc < 0) {
+			return rc;
+		}
+
+		nvs_wb_begin(slot);
+		slot->dirty = false;
+		nvs_wb_end(slot);
+	}
+
+	return 0;
+}
+
+/* nvs_wb_due returns true if the pending values reached a flush threshold */
+static bool nvs_wb_due(struct nvs_fs *fs)
+{
+	size_t dirty_bytes = 0U;
+	uint32_t now = 0U;
+
+	if (fs->wb_max_age_ms && fs->impl_uptime_ms) {
+		now = fs->impl_uptime_ms();
+	}
+
+	for (size_t i = 0; i < fs->wb_slot_count; i++) {
+		if (!fs->wb_slots[i].dirty) {
+			continue;
+		}
+		dirty_bytes += fs->wb_slots[i].len;
+		if (fs->wb_max_age_ms && fs->impl_uptime_ms &&
+		    (now - fs->wb_slots[i].dirty_since >= fs->wb_max_age_ms)) {
+			return true;
+		}
+	}
+
+	return fs->wb_max_dirty && (dirty_bytes >= fs->wb_max_dirty);
+}
+
+static ssize_t nvs_wb_write(struct nvs_fs *fs, struct nvs_wb_slot *slot,
+			    const void *data, size_t len)
+{
+	ssize_t rc;
+
+	if (fs->impl_mutex_lock_forever)
+		fs->impl_mutex_lock_forever();
+
+	if ((len == 0U) || (len > slot->size)) {
+		/* deletes and values that do not fit the slot are written
+		 * through, the pending value is dropped once they are on flash
+		 */
+		rc = nvs_write_locked(fs, slot->id, data, len);
+		if (rc >= 0) {
+			nvs_wb_begin(slot);
+			slot->dirty = false;
+			nvs_wb_end(slot);
+		}
+		goto end;
+	}
+
+	nvs_wb_begin(slot);
+	memcpy(slot->data, data, len);
+	slot->len = len;
+	if (!slot->dirty) {
+		slot->dirty = true;
+		slot->dirty_since = fs->impl_uptime_ms ? fs->impl_uptime_ms() : 0U;
+	}
+	nvs_wb_end(slot);
+
+	rc = len;
+	if (nvs_wb_due(fs)) {
+		int flush_rc = nvs_wb_flush(fs);
+
+		if (flush_rc) {
+			rc = flush_rc;
+		}
+	}
+
+end:
+	if (fs->impl_mutex_unlock)
+		fs->impl_mutex_unlock();
+	return rc;
+}
+
+#endif /* CONFIG_NVS_WRITE_BACK */
+
+ssize_t nvs_write(struct nvs_fs *fs, nvs_id_t id, const void *data, size_t len)
+{
+	ssize_t rc;
+	size_t ate_size;
+
+	if (!fs->ready) {
+		LOG_ERR("NVS not initialized");
+		return -EACCES;
+	}
+
+	if (fs->read_only) {
+		return -EROFS;
+	}
+
+	ate_size = nvs_ate_blk_size(fs);
+
+	/* The maximum data size is sector size - 4 ate
+	 * where: 1 ate for data, 1 ate for sector close, 1 ate for gc done,
+	 * and 1 ate to always allow a delete.
+	 * Also take into account the data CRC that is appended at the end of the data field,
+	 * if any, and the sector header in the gc policy mode.
+	 */
+	if ((len > (nvs_sector_size(fs) - 4 * ate_size - NVS_DATA_CRC_SIZE -
+		    nvs_sector_hdr_space(fs))) ||
+	    ((len > 0) && (data == NULL)) || (id == NVS_SPECIAL_ATE_ID)) {
+		return -EINVAL;
+	}
+
+#ifdef CONFIG_NVS_WRITE_BACK
+	struct nvs_wb_slot *slot = nvs_wb_slot_find(fs, id);
+
+	if (slot) {
+		return nvs_wb_write(fs, slot, data, len);
+	}
+#endif
+
+	if (fs->impl_mutex_lock_forever)
+		fs->impl_mutex_lock_forever();
+
+	rc = nvs_write_locked(fs, id, data, len);
+
+	if (fs->impl_mutex_unlock)
+		fs->impl_mutex_unlock();
+	return rc;
+}
+
+int nvs_sync(struct nvs_fs *fs)
+{
+#ifdef CONFIG_NVS_WRITE_BACK
+	int rc;
+
+	if (!fs->ready) {
+		LOG_ERR("NVS not initialized");
+		return -EACCES;
+	}
+
+	if (fs->impl_mutex_lock_forever)
+		fs->impl_mutex_lock_forever();
+
+	rc = nvs_wb_flush(fs);
+
+	if (fs->impl_mutex_unlock)
+		fs->impl_mutex_unlock();
+	return rc;
+#else
+	(void)fs;
+	return 0;
+#endif
+}
+
+int nvs_sync_poll(struct nvs_fs *fs)
+{
+#ifdef CONFIG_NVS_WRITE_BACK
+	int rc = 0;
+
+	if (!fs->ready) {
+		LOG_ERR("NVS not initialized");
+		return -EACCES;
+	}
+
+	if (fs->impl_mutex_lock_forever)
+		fs->impl_mutex_lock_forever();
+
+	if (nvs_wb_due(fs)) {
+		rc = nvs_wb_flush(fs);
+		if (!rc) {
+			rc = 1;
+		}
+	}
+
+	if (fs->impl_mutex_unlock)
+		fs->impl_mutex_unlock();
+	return rc;
+#else
+	(void)fs;
+	return 0;
+#endif
+}
+
+int nvs_lookup_cache_step(struct nvs_fs *fs)
+{
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+	int rc;
+
+	if (!fs->ready) {
+		LOG_ERR("NVS not initialized");
+		return -EACCES;
+	}
+
+	if (!fs->lookup_cache) {
+		return 0;
+	}
+
+	if (fs->impl_mutex_lock_forever)
+		fs->impl_mutex_lock_forever();
+
+	rc = nvs_lookup_cache_index(fs);
+
+	if (fs->impl_mutex_unlock)
+		fs->impl_mutex_unlock();
+	return rc;
+#else
+	(void)fs;
+	return 0;
+#endif
+}
+
+int nvs_delete(struct nvs_fs *fs, nvs_id_t id)
+{
+	return nvs_write(fs, id, NULL, 0);
+}
+
+/* the entry of ate at addr is hidden by a range delete */
+static void nvs_range_hide_entry(struct nvs_fs *fs, uint32_t addr, const struct nvs_ate *ate)
+{
+	uint32_t space = nvs_ate_space(fs, ate);
+
+	if (!ate->len) {
+		return;
+	}
+
+#ifdef CONFIG_NVS_GC_POLICY
+	if (fs->sector_info) {
+		nvs_sector_live_add(fs, addr, -(int32_t)space);
+	}
+#else
+	(void)addr;
+#endif
+	if (fs->stats) {
+		fs->stats->live_bytes -= MIN(fs->stats->live_bytes, space);
+	}
+}
+
+/* account the live entries a range delete of first to last is about to hide.
+ * A range that spans no more ids than the lookup cache has positions looks
+ * each id up, a wider one walks the allocation table once and only checks
+ * the entries of ids it holds.
+ */
+static int nvs_range_hide(struct nvs_fs *fs, nvs_id_t first, nvs_id_t last)
+{
+	struct nvs_ate ate;
+	struct nvs_ate_win win;
+	uint32_t addr, prev_addr;
+	int rc;
+
+#ifdef CONFIG_NVS_GC_POLICY
+	if (!fs->stats && !fs->sector_info) {
+#else
+	if (!fs->stats) {
+#endif
+		return 0;
+	}
+
+	if (fs->lookup_cache && ((uint64_t)last - first < fs->lookup_cache_size)) {
+		for (nvs_id_t id = first;; id++) {
+			rc = nvs_newest_ate(fs, id, &addr, &ate);
+			if (rc < 0) {
+				return rc;
+			}
+			if (rc) {
+				nvs_range_hide_entry(fs, addr, &ate);
+			}
+			if (id == last) {
+				return 0;
+			}
+		}
+	}
+
+	addr = fs->ate_wra;
+	nvs_ate_win_reset(&win);
+	do {
+		prev_addr = addr;
+		rc = nvs_prev_ate(fs, &addr, &ate, &win);
+		if (rc) {
+			return rc;
+		}
+		if (!nvs_ate_valid(fs, &ate) || (ate.id == NVS_SPECIAL_ATE_ID) ||
+		    !ate.len || (ate.id < first) || (ate.id > last)) {
+			continue;
+		}
+		rc = nvs_ate_is_newest(fs, prev_addr, &ate);
+		if (rc < 0) {
+			return rc;
+		}
+		if (rc) {
+			nvs_range_hide_entry(fs, prev_addr, &ate);
+		}
+	} while (addr != fs->ate_wra);
 
-			data_addr = (gc_prev_addr & ADDR_SECT_MASK);
-			data_addr += gc_ate.offset;
+	return 0;
+}
 
-			gc_ate.offset = (uint16_t)(fs->data_wra & ADDR_OFFS_MASK);
-			nvs_ate_crc8_update(&gc_ate);
+static int nvs_delete_range_locked(struct nvs_fs *fs, nvs_id_t first, nvs_id_t last)
+{
+	int rc;
+	size_t ate_size, required_space;
+	uint32_t gc_count;
 
-			rc = nvs_flash_block_move(fs, data_addr, gc_ate.len);
-			if (rc) {
-				return rc;
+	/* the start and end entries share a write block when it holds several
+	 * entries, one more block is left for deletes
+	 */
+	ate_size = nvs_ate_blk_size(fs);
+	required_space = (ate_size >= 2U * nvs_ate_size(fs)) ? ate_size : 2U * ate_size;
+
+	gc_count = 0;
+	while (nvs_ate_wra_blk(fs) < (fs->data_wra + required_space)) {
+		if (gc_count == nvs_sector_count(fs)) {
+			return -ENOSPC;
+		}
+
+		rc = nvs_sector_close(fs);
+		if (rc) {
+			return rc;
+		}
+
+		rc = nvs_gc(fs);
+		if (rc) {
+			return rc;
+		}
+		gc_count++;
+	}
+
+	/* entries hidden by the range are no longer live */
+	rc = nvs_range_hide(fs, first, last);
+	if (rc) {
+		return rc;
+	}
+
+	rc = nvs_flash_wrt_range(fs, first, last);
+	if (rc) {
+		return rc;
+	}
+
+	if (fs->stats) {
+		nvs_stats_entry(fs, NULL, 0U);
+	}
+
+#ifdef CONFIG_NVS_CHECKPOINT_ON_SECTOR_CLOSE
+	if (gc_count && fs->lookup_cache && nvs_checkpoint_fits(fs)) {
+		rc = nvs_checkpoint_wrt(fs);
+		if (rc) {
+			return rc;
+		}
+	}
+#endif
+	return 0;
+}
+
+int nvs_delete_range(struct nvs_fs *fs, nvs_id_t first, nvs_id_t last)
+{
+	int rc;
+
+	if (!fs->ready) {
+		LOG_ERR("NVS not initialized");
+		return -EACCES;
+	}
+
+	if (fs->read_only) {
+		return -EROFS;
+	}
+
+	if ((first > last) || (last == NVS_SPECIAL_ATE_ID)) {
+		return -EINVAL;
+	}
+
+	if (fs->impl_mutex_lock_forever)
+		fs->impl_mutex_lock_forever();
+
+	rc = nvs_delete_range_locked(fs, first, last);
+
+#ifdef CONFIG_NVS_WRITE_BACK
+	/* pending values are older than the range delete */
+	for (size_t i = 0; !rc && (i < fs->wb_slot_count); i++) {
+		struct nvs_wb_slot *slot = &fs->wb_slots[i];
+
+		if (slot->dirty && (slot->id >= first) && (slot->id <= last)) {
+			nvs_wb_begin(slot);
+			slot->dirty = false;
+			nvs_wb_end(slot);
+		}
+	}
+#endif
+
+	if (fs->impl_mutex_unlock)
+		fs->impl_mutex_unlock();
+	return rc;
+}
+
+/* nvs_ate_newer returns true if the ate at addr was written after ate_wra
+ * had the value snap: it lies below snap in the same sector or in the sector
+ * after it, which was the empty sector when snap was taken.
+ */
+static bool nvs_ate_newer(struct nvs_fs *fs, uint32_t snap, uint32_t addr)
+{
+	uint32_t next = snap & ADDR_SECT_MASK;
+
+	if ((addr & ADDR_SECT_MASK) == next) {
+		return addr <= snap;
+	}
+
+	nvs_sector_advance(fs, &next);
+
+	return (addr & ADDR_SECT_MASK) == next;
+}
+
+#ifdef CONFIG_NVS_COMPRESS
+
+/* stream reader for the decompressor, keeps the data CRC of what it read */
+struct nvs_lz_rd_ctx {
+	struct nvs_fs *fs;
+	uint32_t addr;
+	uint32_t crc;
+};
+
+static int nvs_lz_rd(void *ctx, void *buf, size_t len)
+{
+	struct nvs_lz_rd_ctx *rd = ctx;
+	int rc;
+
+	rc = nvs_flash_rd(rd->fs, rd->addr, buf, len);
+	if (rc) {
+		return rc;
+	}
+	rd->addr += len;
+	rd->crc = nvs_crc(rd->fs)->crc32(rd->crc, buf, len);
+
+	return 0;
+}
+
+/* read a compressed value of st_len stored bytes (data CRC excluded) at addr,
+ * returns the uncompressed length
+ */
+static ssize_t nvs_lz_read(struct nvs_fs *fs, uint32_t addr, size_t st_len,
+			   void *data, size_t len)
+{
+	struct nvs_lz_rd_ctx rd = { .fs = fs, .addr = addr, .crc = 0U };
+	uint32_t raw_len;
+	ssize_t rc;
+#ifdef CONFIG_NVS_DATA_CRC
+	uint32_t read_data_crc;
+#endif
+
+	if (st_len < NVS_LZ_HDR_SIZE) {
+		return -EIO;
+	}
+
+	rc = nvs_lz_rd(&rd, &raw_len, sizeof(raw_len));
+	if (rc) {
+		return rc;
+	}
+
+	rc = nvs_lz_decompress(nvs_lz_rd, &rd, st_len - NVS_LZ_HDR_SIZE, data,
+			       MIN(len, raw_len));
+	if (rc < 0) {
+		return rc;
+	}
+
+	/* Check the stream and the data CRC (only if the whole element has been read) */
+	if (len >= raw_len) {
+		if (((size_t)rc != raw_len) || (rd.addr != addr + st_len)) {
+			return -EIO;
+		}
+#ifdef CONFIG_NVS_DATA_CRC
+		rc = nvs_flash_rd(fs, rd.addr, &read_data_crc, sizeof(read_data_crc));
+		if (rc) {
+			return rc;
+		}
+		if (read_data_crc != rd.crc) {
+			LOG_ERR("Invalid data CRC: read_data_crc=0x%08X, computed_data_crc=0x%08X",
+				read_data_crc, rd.crc);
+			return -EIO;
+		}
+#endif
+	}
+
+	return raw_len;
+}
+
+#endif /* CONFIG_NVS_COMPRESS */
+
+/* nvs_read_changed returns true if a sector erase started or finished since
+ * the reader sampled erase_seq as seq (seqlock read side).
+ */
+static inline bool nvs_read_changed(struct nvs_fs *fs, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&fs->erase_seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* nvs_read_walk reads the cnt-th most recent value of id from flash. It
+ * neither takes the mutex nor looks at the write-back slots, callers that
+ * hold the mutex use it directly.
+ */
+static ssize_t nvs_read_walk(struct nvs_fs *fs, nvs_id_t id, void *data, size_t len,
+			     uint16_t cnt)
+{
+	int rc;
+	uint32_t wlk_addr, rd_addr, end_addr, seq, skip_sector;
+	uint16_t cnt_his;
+	struct nvs_ate wlk_ate;
+	struct nvs_ate_win win;
+#ifdef CONFIG_NVS_DATA_CRC
+	uint32_t read_data_crc, computed_data_crc;
+#endif
+
+	/* Reads do not take the mutex. The walk is done on a snapshot of
+	 * ate_wra: sectors that are closed at that point only change when they
+	 * are erased by gc, which is detected through erase_seq. A read that
+	 * starts while a sector is being erased skips that sector, its live
+	 * entries have already been copied by gc.
+	 */
+retry:
+	seq = __atomic_load_n(&fs->erase_seq, __ATOMIC_ACQUIRE);
+	skip_sector = NVS_NO_SECTOR;
+	if (seq & 1U) {
+		skip_sector = __atomic_load_n(&fs->erase_sector, __ATOMIC_RELAXED);
+	}
+	end_addr = __atomic_load_n(&fs->ate_wra, __ATOMIC_ACQUIRE);
+
+	cnt_his = 0U;
+
+	wlk_addr = nvs_lookup_start(fs, id);
+
+	if ((wlk_addr == NVS_LOOKUP_CACHE_NO_ADDR) ||
+	    ((wlk_addr >> ADDR_SECT_SHIFT) == skip_sector)) {
+		rc = -ENOENT;
+		goto err;
+	}
+
+	if (nvs_ate_newer(fs, end_addr, wlk_addr)) {
+		wlk_addr = end_addr;
+	}
+
+	rd_addr = wlk_addr;
+	nvs_ate_win_reset(&win);
+
+	while (cnt_his <= cnt) {
+		rd_addr = wlk_addr;
+		rc = nvs_prev_ate_upto(fs, &wlk_addr, &wlk_ate, end_addr, skip_sector, &win);
+		if (rc) {
+			goto err;
+		}
+		rc = nvs_ate_match(fs, rd_addr, &wlk_ate, id);
+		if (rc < 0) {
+			goto err;
+		}
+		cnt_his += rc;
+		if (wlk_addr == end_addr) {
+			break;
+		}
+		if (nvs_read_changed(fs, seq)) {
+			goto retry;
+		}
+	}
+
+	if (((wlk_addr == end_addr) && (wlk_ate.id != id)) ||
+	    (wlk_ate.len == 0U) || (cnt_his < cnt)) {
+		rc = -ENOENT;
+		goto err;
+	}
+
+#ifdef CONFIG_NVS_INLINE_VALUE
+	if (nvs_ate_inline(&wlk_ate)) {
+		/* the value was read with its ate, crc8 covers it */
+		nvs_ate_inline_get(&wlk_ate, data, MIN(len, wlk_ate.len));
+		if (nvs_read_changed(fs, seq)) {
+			goto retry;
+		}
+		return wlk_ate.len;
+	}
+#endif
+
+#ifdef CONFIG_NVS_DATA_CRC
+	/* When data CRC is enabled, there should be at least the CRC stored in the data field */
+	if (wlk_ate.len < NVS_DATA_CRC_SIZE) {
+		rc = -ENOENT;
+		goto err;
+	}
+#endif
+
+	rd_addr &= ADDR_SECT_MASK;
+	rd_addr += wlk_ate.offset;
+
+#ifdef CONFIG_NVS_COMPRESS
+	if (wlk_ate.part == NVS_ATE_PART_LZ) {
+		ssize_t raw_len = nvs_lz_read(fs, rd_addr, wlk_ate.len - NVS_DATA_CRC_SIZE,
+					      data, len);
+
+		if (raw_len < 0) {
+			rc = raw_len;
+			goto err;
+		}
+		if (nvs_read_changed(fs, seq)) {
+			goto retry;
+		}
+		return raw_len;
+	}
+#endif
+
+	rc = nvs_flash_rd(fs, rd_addr, data, MIN(len, wlk_ate.len - NVS_DATA_CRC_SIZE));
+	if (rc) {
+		goto err;
+	}
+
+	/* Check data CRC (only if the whole element data has been read) */
+#ifdef CONFIG_NVS_DATA_CRC
+	if (len >= (wlk_ate.len - NVS_DATA_CRC_SIZE)) {
+		rd_addr += wlk_ate.len - NVS_DATA_CRC_SIZE;
+		rc = nvs_flash_rd(fs, rd_addr, &read_data_crc, sizeof(read_data_crc));
+		if (rc) {
+			goto err;
+		}
+
+		computed_data_crc = nvs_crc(fs)->crc32(0U, data, wlk_ate.len - NVS_DATA_CRC_SIZE);
+		if (read_data_crc != computed_data_crc) {
+			if (nvs_read_changed(fs, seq)) {
+				goto retry;
 			}
+			LOG_ERR("Invalid data CRC: read_data_crc=0x%08X, computed_data_crc=0x%08X",
+				read_data_crc, computed_data_crc);
+			rc = -EIO;
+			goto err;
+		}
+	}
+#endif
+
+	if (nvs_read_changed(fs, seq)) {
+		goto retry;
+	}
+
+	return wlk_ate.len - NVS_DATA_CRC_SIZE;
+
+err:
+	if (nvs_read_changed(fs, seq)) {
+		goto retry;
+	}
+
+	return rc;
+}
+
+ssize_t nvs_read_hist(struct nvs_fs *fs, nvs_id_t id, void *data, size_t len,
+		      uint16_t cnt)
+{
+	int rc;
+	size_t ate_size;
+
+	if (!fs->ready) {
+		LOG_ERR("NVS not initialized");
+		return -EACCES;
+	}
+
+	ate_size = nvs_ate_size(fs);
+
+	if (len > (nvs_sector_size(fs) - 2 * ate_size)) {
+		return -EINVAL;
+	}
 
-			rc = nvs_flash_ate_wrt(fs, &gc_ate);
-			if (rc) {
+#ifdef CONFIG_NVS_WRITE_BACK
+	struct nvs_wb_slot *slot = nvs_wb_slot_find(fs, id);
+
+	if (slot) {
+		rc = nvs_wb_read(slot, data, len);
+		if (rc != -ENOENT) {
+			if (cnt == 0U) {
 				return rc;
 			}
+			/* the pending value is the most recent one */
+			cnt--;
 		}
-	} while (gc_prev_addr != stop_addr);
-
-gc_done:
-
-	/* Make it possible to detect that gc has finished by writing a
-	 * gc done ate to the sector. In the field we might have nvs systems
-	 * that do not have sufficient space to add this ate, so for these
-	 * situations avoid adding the gc done ate.
-	 */
+	}
+#endif
 
-	if (fs->ate_wra >= (fs->data_wra + ate_size)) {
-		rc = nvs_add_gc_done_ate(fs);
-		if (rc) {
-			return rc;
-		}
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+	rc = nvs_lookup_cache_demand(fs, id);
+	if (rc) {
+		return rc;
 	}
+#endif
 
-	/* Erase the gc'ed sector */
-	rc = nvs_flash_erase_sector(fs, sec_addr);
+	return nvs_read_walk(fs, id, data, len, cnt);
+}
+
+ssize_t nvs_read(struct nvs_fs *fs, nvs_id_t id, void *data, size_t len)
+{
+	int rc;
 
+	rc = nvs_read_hist(fs, id, data, len, 0);
 	return rc;
 }
 
-static int nvs_startup(struct nvs_fs *fs)
+ssize_t nvs_calc_free_space(struct nvs_fs *fs)
 {
 	int rc;
-	struct nvs_ate last_ate;
-	size_t ate_size, empty_len;
-	/* Initialize addr to 0 for the case fs->sector_count == 0. This
-	 * should never happen as this is verified in nvs_mount() but both
-	 * Coverity and GCC believe the contrary.
-	 */
-	uint32_t addr = 0U;
-	uint16_t i, closed_sectors = 0;
-	uint8_t erase_value = fs->flash_parameters->erase_value;
+	struct nvs_ate step_ate, wlk_ate;
+	struct nvs_ate_win step_win, wlk_win;
+	uint32_t step_addr, wlk_addr, wlk_prev_addr;
+	nvs_id_t first;
+	size_t ate_size, free_space;
 
-	if(fs->impl_mutex_lock_forever)
-		fs->impl_mutex_lock_forever();
+	if (!fs->ready) {
+		LOG_ERR("NVS not initialized");
+		return -EACCES;
+	}
 
-	ate_size = nvs_al_size(fs, sizeof(struct nvs_ate));
-	/* step through the sectors to find a open sector following
-	 * a closed sector, this is where NVS can write.
+	ate_size = nvs_ate_blk_size(fs);
+
+	/*
+	 * There is always a closing ATE and a reserved ATE for
+	 * deletion in each sector.
+	 * Take into account one less sector because it is reserved for the
+	 * garbage collection.
 	 */
-	for (i = 0; i < fs->sector_count; i++) {
-		addr = (i << ADDR_SECT_SHIFT) +
-		       (uint16_t)(fs->sector_size - ate_size);
-		rc = nvs_flash_cmp_const(fs, addr, erase_value,
-					 sizeof(struct nvs_ate));
+	free_space = (nvs_sector_count(fs) - 1) *
+		     (nvs_sector_size(fs) - (2 * ate_size) - nvs_sector_hdr_space(fs));
+
+	step_addr = fs->ate_wra;
+	nvs_ate_win_reset(&step_win);
+
+	while (1) {
+		rc = nvs_prev_ate(fs, &step_addr, &step_ate, &step_win);
 		if (rc) {
-			/* closed sector */
-			closed_sectors++;
-			nvs_sector_advance(fs, &addr);
-			rc = nvs_flash_cmp_const(fs, addr, erase_value,
-						 sizeof(struct nvs_ate));
-			if (!rc) {
-				/* open sector */
+			return rc;
+		}
+
+		wlk_addr = fs->ate_wra;
+		nvs_ate_win_reset(&wlk_win);
+
+		while (1) {
+			wlk_prev_addr = wlk_addr;
+			rc = nvs_prev_ate(fs, &wlk_addr, &wlk_ate, &wlk_win);
+			if (rc) {
+				return rc;
+			}
+			/* a range delete covering the id hides older entries */
+			rc = nvs_ate_range_first(fs, wlk_prev_addr, &wlk_ate, &first);
+			if (rc < 0) {
+				return rc;
+			}
+			if ((wlk_ate.id == step_ate.id) ||
+			    (rc && (step_ate.id >= first) && (step_ate.id <= wlk_ate.id)) ||
+			    (wlk_addr == fs->ate_wra)) {
 				break;
 			}
 		}
+
+		if (nvs_ate_valid(fs, &step_ate) &&
+		    ((step_ate.id != NVS_SPECIAL_ATE_ID) ||
+		     (step_ate.part != NVS_ATE_PART_SECTOR))) {
+			/* Take into account the GC done ATE if it is present */
+			if (step_ate.len == 0) {
+				if (step_ate.id == NVS_SPECIAL_ATE_ID) {
+					free_space -= ate_size;
+				}
+			} else if (wlk_addr == step_addr) {
+				/* count needed */
+				if (!nvs_ate_inline(&step_ate)) {
+					free_space -= nvs_al_size(fs, step_ate.len);
+				}
+				free_space -= ate_size;
+			}
+		}
+
+		if (step_addr == fs->ate_wra) {
+			break;
+		}
 	}
-	/* all sectors are closed, this is not a nvs fs */
-	if (closed_sectors == fs->sector_count) {
-		rc = -EDEADLK;
-		goto end;
+	return free_space;
+}
+
+size_t nvs_sector_max_data_size(struct nvs_fs *fs)
+{
+	size_t ate_size;
+
+	if (!fs->ready) {
+		LOG_ERR("NVS not initialized");
+		return -EACCES;
 	}
 
-	if (i == fs->sector_count) {
-		/* none of the sectors where closed, in most cases we can set
-		 * the address to the first sector, except when there are only
-		 * two sectors. Then we can only set it to the first sector if
-		 * the last sector contains no ate's. So we check this first
-		 */
-		rc = nvs_flash_cmp_const(fs, addr - ate_size, erase_value,
-				sizeof(struct nvs_ate));
-		if (!rc) {
-			/* empty ate */
-			nvs_sector_advance(fs, &addr);
-		}
+	ate_size = nvs_ate_blk_size(fs);
+
+	return nvs_ate_wra_blk(fs) - fs->data_wra - ate_size - NVS_DATA_CRC_SIZE;
+}
+
+int nvs_sector_use_next(struct nvs_fs *fs)
+{
+	int ret;
+
+	if (!fs->ready) {
+		LOG_ERR("NVS not initialized");
+		return -EACCES;
 	}
 
-	/* addr contains address of closing ate in the most recent sector,
-	 * search for the last valid ate using the recover_last_ate routine
-	 */
+	if (fs->read_only) {
+		return -EROFS;
+	}
 
-	rc = nvs_recover_last_ate(fs, &addr);
-	if (rc) {
+	if (fs->impl_mutex_lock_forever)
+		fs->impl_mutex_lock_forever();
+
+	ret = nvs_sector_close(fs);
+	if (ret != 0) {
 		goto end;
 	}
 
-	/* addr contains address of the last valid ate in the most recent sector
-	 * search for the first ate containing all cells erased, in the process
-	 * also update fs->data_wra.
-	 */
-	fs->ate_wra = addr;
-	fs->data_wra = addr & ADDR_SECT_MASK;
+	ret = nvs_gc(fs);
 
-	while (fs->ate_wra >= fs->data_wra) {
-		rc = nvs_flash_ate_rd(fs, fs->ate_wra, &last_ate);
-		if (rc) {
-			goto end;
-		}
+#ifdef CONFIG_NVS_CHECKPOINT_ON_SECTOR_CLOSE
+	if (!ret && fs->lookup_cache && nvs_checkpoint_fits(fs)) {
+		ret = nvs_checkpoint_wrt(fs);
+	}
+#endif
 
-		rc = nvs_ate_cmp_const(&last_ate, erase_value);
+end:
+	if (fs->impl_mutex_unlock)
+		fs->impl_mutex_unlock();
+	return ret;
+}
 
-		if (!rc) {
-			/* found ff empty location */
-			break;
-		}
+#ifdef CONFIG_NVS_CHECKPOINT
+int nvs_checkpoint(struct nvs_fs *fs)
+{
+	int rc, gc_count;
+	size_t ate_size;
 
-		if (nvs_ate_valid(fs, &last_ate)) {
-			/* complete write of ate was performed */
-			fs->data_wra = addr & ADDR_SECT_MASK;
-			/* Align the data write address to the current
-			 * write block size so that it is possible to write to
-			 * the sector even if the block size has changed after
-			 * a software upgrade (unless the physical ATE size
-			 * will change)."
-			 */
-			fs->data_wra += nvs_al_size(fs, last_ate.offset + last_ate.len);
+	if (!fs->ready) {
+		LOG_ERR("NVS not initialized");
+		return -EACCES;
+	}
 
-			/* ate on the last position within the sector is
-			 * reserved for deletion an entry
-			 */
-			if (fs->ate_wra == fs->data_wra && last_ate.len) {
-				/* not a delete ate */
-				rc = -ESPIPE;
-				goto end;
-			}
-		}
+	if (fs->read_only) {
+		return -EROFS;
+	}
 
-		fs->ate_wra -= ate_size;
+	if (!fs->lookup_cache) {
+		return -ENOTSUP;
 	}
 
-	/* if the sector after the write sector is not empty gc was interrupted
-	 * we might need to restart gc if it has not yet finished. Otherwise
-	 * just erase the sector.
-	 * When gc needs to be restarted, first erase the sector otherwise the
-	 * data might not fit into the sector.
-	 */
-	addr = fs->ate_wra & ADDR_SECT_MASK;
-	nvs_sector_advance(fs, &addr);
-	rc = nvs_flash_cmp_const(fs, addr, erase_value, fs->sector_size);
-	if (rc < 0) {
-		goto end;
+	ate_size = nvs_ate_blk_size(fs);
+
+	/* same limit as for the largest entry */
+	if (nvs_checkpoint_len(fs) > (nvs_sector_size(fs) - 4 * ate_size)) {
+		return -EINVAL;
 	}
-	if (rc) {
-		/* the sector after fs->ate_wrt is not empty, look for a marker
-		 * (gc_done_ate) that indicates that gc was finished.
-		 */
-		bool gc_done_marker = false;
-		struct nvs_ate gc_done_ate;
 
-		addr = fs->ate_wra + ate_size;
-		while ((addr & ADDR_OFFS_MASK) < (fs->sector_size - ate_size)) {
-			rc = nvs_flash_ate_rd(fs, addr, &gc_done_ate);
-			if (rc) {
-				goto end;
-			}
-			if (nvs_ate_valid(fs, &gc_done_ate) &&
-			    (gc_done_ate.id == 0xffff) &&
-			    (gc_done_ate.len == 0U)) {
-				gc_done_marker = true;
-				break;
-			}
-			addr += ate_size;
-		}
+	if (fs->impl_mutex_lock_forever)
+		fs->impl_mutex_lock_forever();
 
-		if (gc_done_marker) {
-			/* erase the next sector */
-			LOG_INF("GC Done marker found");
-			addr = fs->ate_wra & ADDR_SECT_MASK;
-			nvs_sector_advance(fs, &addr);
-			rc = nvs_flash_erase_sector(fs, addr);
+	gc_count = 0;
+	while (!nvs_checkpoint_fits(fs)) {
+		if (gc_count == nvs_sector_count(fs)) {
+			rc = -ENOSPC;
 			goto end;
 		}
-		LOG_INF("No GC Done marker found: restarting gc");
-		rc = nvs_flash_erase_sector(fs, fs->ate_wra);
+
+		rc = nvs_sector_close(fs);
 		if (rc) {
 			goto end;
 		}
-		fs->ate_wra &= ADDR_SECT_MASK;
-		fs->ate_wra += (fs->sector_size - 2 * ate_size);
-		fs->data_wra = (fs->ate_wra & ADDR_SECT_MASK);
-#ifdef CONFIG_NVS_LOOKUP_CACHE
-		/**
-		 * At this point, the lookup cache wasn't built but the gc function need to use it.
-		 * So, temporarily, we set the lookup cache to the end of the fs.
-		 * The cache will be rebuilt afterwards
-		 **/
-		for (i = 0; i < CONFIG_NVS_LOOKUP_CACHE_SIZE; i++) {
-			fs->lookup_cache[i] = fs->ate_wra;
-		}
-#endif
+
 		rc = nvs_gc(fs);
-		goto end;
+		if (rc) {
+			goto end;
+		}
+		gc_count++;
 	}
 
-	/* possible data write after last ate write, update data_wra */
-	while (fs->ate_wra > fs->data_wra) {
-		empty_len = fs->ate_wra - fs->data_wra;
+	rc = nvs_checkpoint_wrt(fs);
+end:
+	if (fs->impl_mutex_unlock)
+		fs->impl_mutex_unlock();
+	return rc;
+}
+#endif
+
+static int nvs_export_locked(struct nvs_fs *fs, const struct nvs_image_sink *sink)
+{
+	struct nvs_image_rec rec;
+	struct nvs_ate ate, newest_ate;
+	struct nvs_ate_win win;
+	uint32_t addr, ate_addr, newest_addr;
+	ssize_t len;
+	int rc;
+
+	addr = fs->ate_wra;
+	nvs_ate_win_reset(&win);
+	do {
+		ate_addr = addr;
+		rc = nvs_prev_ate(fs, &addr, &ate, &win);
+		if (rc) {
+			return rc;
+		}
 
-		rc = nvs_flash_cmp_const(fs, fs->data_wra, erase_value,
-				empty_len);
+		if ((ate.id == NVS_SPECIAL_ATE_ID) || !ate.len || !nvs_ate_valid(fs, &ate)) {
+			continue;
+		}
+
+		/* only the most recent entry of an id is exported */
+		rc = nvs_newest_ate(fs, ate.id, &newest_addr, &newest_ate);
 		if (rc < 0) {
-			goto end;
+			return rc;
 		}
-		if (!rc) {
-			break;
+		if (!rc || (newest_addr != ate_addr)) {
+			continue;
 		}
 
-		fs->data_wra += fs->flash_parameters->write_block_size;
-	}
+		/* the mutex is held, nvs_read() could wait on it for the lookup
+		 * cache of a lazy mount
+		 */
+		len = nvs_read_walk(fs, ate.id, sink->buf, sink->buf_size, 0);
+		if (len == -ENOENT) {
+			/* deleted */
+			continue;
+		}
+		if (len < 0) {
+			return len;
+		}
+		if ((size_t)len > sink->buf_size) {
+			return -ENOBUFS;
+		}
 
-	/* If the ate_wra is pointing to the first ate write location in a
-	 * sector and data_wra is not 0, erase the sector as it contains no
-	 * valid data (this also avoids closing a sector without any data).
-	 */
-	if (((fs->ate_wra + 2 * ate_size) == fs->sector_size) &&
-	    (fs->data_wra != (fs->ate_wra & ADDR_SECT_MASK))) {
-		rc = nvs_flash_erase_sector(fs, fs->ate_wra);
+		rec.id = ate.id;
+		rec.len = (uint32_t)len;
+		rc = sink->write(sink->ctx, &rec, sizeof(rec));
 		if (rc) {
-			goto end;
+			return rc;
 		}
-		fs->data_wra = fs->ate_wra & ADDR_SECT_MASK;
+		rc = sink->write(sink->ctx, sink->buf, len);
+		if (rc) {
+			return rc;
+		}
+	} while (addr != fs->ate_wra);
+
+	return 0;
+}
+
+int nvs_export(struct nvs_fs *fs, const struct nvs_image_sink *sink)
+{
+	int rc;
+
+	if (!fs->ready) {
+		LOG_ERR("NVS not initialized");
+		return -EACCES;
 	}
 
-end:
+	if (!sink->write || !sink->buf) {
+		return -EINVAL;
+	}
 
-#ifdef CONFIG_NVS_LOOKUP_CACHE
-	if (!rc) {
-		rc = nvs_lookup_cache_rebuild(fs);
+	if (fs->impl_mutex_lock_forever)
+		fs->impl_mutex_lock_forever();
+
+#ifdef CONFIG_NVS_WRITE_BACK
+	rc = nvs_wb_flush(fs);
+	if (rc) {
+		goto end;
 	}
 #endif
-	/* If the sector is empty add a gc done ate to avoid having insufficient
-	 * space when doing gc.
-	 */
-	if ((!rc) && ((fs->ate_wra & ADDR_OFFS_MASK) ==
-		      (fs->sector_size - 2 * ate_size))) {
 
-		rc = nvs_add_gc_done_ate(fs);
-	}
+	rc = nvs_export_locked(fs, sink);
 
+#ifdef CONFIG_NVS_WRITE_BACK
+end:
+#endif
 	if (fs->impl_mutex_unlock)
 		fs->impl_mutex_unlock();
 	return rc;
 }
 
-int nvs_clear(struct nvs_fs *fs)
+/* Import state: values are gathered in the stage and programmed together,
+ * allocation table entries are queued and programmed as one run of blocks.
+ * data_wra already includes the staged values.
+ */
+struct nvs_import_ctx {
+	struct nvs_fs *fs;
+	const struct nvs_image_source *source;
+	uint8_t *stage;
+	size_t stage_size;
+	size_t stage_fill;
+	struct nvs_ate queue[NVS_ATE_RUN_BLOCKS * NVS_BLOCK_SIZE / sizeof(struct nvs_ate)];
+	size_t queued;
+	size_t queue_max;
+	uint8_t local[NVS_BLOCK_SIZE];
+};
+
+/* program cnt allocation entries as a single run of write blocks below
+ * ate_wra
+ */
+static int nvs_flash_ate_run_wrt(struct nvs_fs *fs, const struct nvs_ate *entry,
+				 size_t cnt)
 {
+	size_t ate_size = nvs_ate_size(fs), blk_size = nvs_ate_blk_size(fs);
+	size_t per_blk = blk_size / ate_size, blocks = (cnt + per_blk - 1U) / per_blk;
+	uint8_t buf[NVS_ATE_RUN_BLOCKS * NVS_BLOCK_SIZE];
+	uint32_t top = fs->ate_wra + ate_size, start = top - blocks * blk_size, addr;
 	int rc;
-	uint32_t addr;
 
-	if (!fs->ready) {
-		LOG_ERR("NVS not initialized");
-		return -EACCES;
+	(void)memset(buf, fs->flash_parameters->erase_value, blocks * blk_size);
+	for (size_t i = 0; i < cnt; i++) {
+		addr = top - (i / per_blk) * blk_size - (i % per_blk + 1U) * ate_size;
+		memcpy(&buf[addr - start], &entry[i], sizeof(struct nvs_ate));
 	}
 
-	for (uint16_t i = 0; i < fs->sector_count; i++) {
-		addr = i << ADDR_SECT_SHIFT;
-		rc = nvs_flash_erase_sector(fs, addr);
-		if (rc) {
-			return rc;
-		}
+	rc = nvs_flash_al_wrt(fs, start, buf, blocks * blk_size);
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+	/* the cache may only point at entries that made it to flash */
+	for (size_t i = 0; !rc && fs->lookup_cache && (i < cnt); i++) {
+		addr = top - (i / per_blk) * blk_size - (i % per_blk + 1U) * ate_size;
+		__atomic_store_n(&fs->lookup_cache[nvs_lookup_cache_pos(fs, entry[i].id)],
+				 addr, __ATOMIC_RELEASE);
 	}
+#endif
+	__atomic_store_n(&fs->ate_wra, start - ate_size, __ATOMIC_RELEASE);
 
-	/* nvs needs to be reinitialized after clearing */
-	fs->ready = false;
-
-	return 0;
+	return rc;
 }
 
-int nvs_mount(struct nvs_fs *fs)
+/* program the staged values, then the queued entries that refer to them */
+static int nvs_import_flush(struct nvs_import_ctx *ctx)
 {
+	struct nvs_fs *fs = ctx->fs;
 	int rc;
-	size_t write_block_size;
 
-	if (fs->impl_init)
-		fs->impl_init();
-
-	if(!fil_is_ready()) {
-		LOG_ERR("Flash Interface Layer is not ready");
-		return -EPERM;
+	rc = nvs_flash_al_wrt(fs, fs->data_wra - ctx->stage_fill, ctx->stage,
+			      ctx->stage_fill);
+	ctx->stage_fill = 0U;
+	if (rc || !ctx->queued) {
+		return rc;
 	}
 
-	fs->flash_parameters = fil_get_flash_parameters();
-	if (fs->flash_parameters == NULL) {
-		LOG_ERR("Could not obtain flash parameters");
-		return -EINVAL;
-	}
+	rc = nvs_flash_ate_run_wrt(fs, ctx->queue, ctx->queued);
+	ctx->queued = 0U;
 
-	write_block_size = fs->flash_parameters->write_block_size;
+	return rc;
+}
 
-	/* check that the write block size is supported */
-	if (write_block_size > NVS_BLOCK_SIZE || write_block_size == 0) {
-		LOG_ERR("Unsupported write block size");
-		return -EINVAL;
-	}
+static int nvs_import_rd(struct nvs_import_ctx *ctx, void *data, size_t len)
+{
+	ssize_t rd;
 
-	if (!fs->sector_size || fs->sector_size % write_block_size) {
-		LOG_ERR("Invalid sector size");
-		return -EINVAL;
+	rd = ctx->source->read(ctx->source->ctx, data, len);
+	if (rd < 0) {
+		return rd;
 	}
 
-	/* check the number of sectors, it should be at least 2 */
-	if (fs->sector_count < 2) {
-		LOG_ERR("Configuration error - sector count");
-		return -EINVAL;
+	return ((size_t)rd == len) ? 0 : -EIO;
+}
+
+/* add a value of len bytes and its data CRC at data_wra. Values that do not
+ * fit in the stage are programmed piece by piece through it.
+ */
+static int nvs_import_data(struct nvs_import_ctx *ctx, size_t len)
+{
+	struct nvs_fs *fs = ctx->fs;
+	size_t write_block_size = nvs_write_block_size(fs);
+	size_t st_len = nvs_al_size(fs, len + NVS_DATA_CRC_SIZE), chunk, aligned;
+	uint8_t tail[NVS_BLOCK_SIZE + NVS_DATA_CRC_SIZE], *buf;
+	uint32_t data_crc = 0U;
+	int rc;
+
+	if (st_len <= ctx->stage_size - ctx->stage_fill) {
+		buf = &ctx->stage[ctx->stage_fill];
+		rc = nvs_import_rd(ctx, buf, len);
+		if (rc) {
+			return rc;
+		}
+		if (IS_ENABLED(CONFIG_NVS_DATA_CRC)) {
+			data_crc = nvs_crc(fs)->crc32(0U, buf, len);
+			memcpy(&buf[len], &data_crc, NVS_DATA_CRC_SIZE);
+		}
+		(void)memset(&buf[len + NVS_DATA_CRC_SIZE], fs->flash_parameters->erase_value,
+			     st_len - len - NVS_DATA_CRC_SIZE);
+		ctx->stage_fill += st_len;
+		fs->data_wra += st_len;
+		return 0;
 	}
 
-	rc = nvs_startup(fs);
+	rc = nvs_import_flush(ctx);
 	if (rc) {
 		return rc;
 	}
 
-	/* nvs is ready for use */
-	fs->ready = true;
+	while (len) {
+		chunk = MIN(len, ctx->stage_size);
+		rc = nvs_import_rd(ctx, ctx->stage, chunk);
+		if (rc) {
+			return rc;
+		}
+		len -= chunk;
+		if (IS_ENABLED(CONFIG_NVS_DATA_CRC)) {
+			data_crc = nvs_crc(fs)->crc32(data_crc, ctx->stage, chunk);
+		}
 
-	LOG_INF("%d Sectors of %d bytes", fs->sector_count, fs->sector_size);
-	LOG_INF("alloc wra: %d, %x",
-		(fs->ate_wra >> ADDR_SECT_SHIFT),
-		(fs->ate_wra & ADDR_OFFS_MASK));
-	LOG_INF("data wra: %d, %x",
-		(fs->data_wra >> ADDR_SECT_SHIFT),
-		(fs->data_wra & ADDR_OFFS_MASK));
+		aligned = len ? chunk : (chunk & ~(write_block_size - 1U));
+		rc = nvs_flash_al_wrt(fs, fs->data_wra, ctx->stage, aligned);
+		if (rc) {
+			return rc;
+		}
+		fs->data_wra += aligned;
+		chunk -= aligned;
+		if (len) {
+			continue;
+		}
+
+		/* the unaligned end of the value and the data CRC */
+		memcpy(tail, &ctx->stage[aligned], chunk);
+		memcpy(&tail[chunk], &data_crc, NVS_DATA_CRC_SIZE);
+		chunk += NVS_DATA_CRC_SIZE;
+		rc = nvs_flash_al_wrt(fs, fs->data_wra, tail, chunk);
+		if (rc) {
+			return rc;
+		}
+		fs->data_wra += nvs_al_size(fs, chunk);
+	}
 
 	return 0;
 }
 
-ssize_t nvs_write(struct nvs_fs *fs, uint16_t id, const void *data, size_t len)
+/* the newest entry of id before the record being imported: one still queued,
+ * they are all in the write sector, or one already programmed. Returns 1 if
+ * found.
+ */
+static int nvs_import_prev(struct nvs_import_ctx *ctx, nvs_id_t id, uint32_t *addr,
+			   struct nvs_ate *ate)
 {
-	int rc, gc_count;
-	size_t ate_size, data_size;
-	struct nvs_ate wlk_ate;
-	uint32_t wlk_addr, rd_addr;
-	uint16_t required_space = 0U; /* no space, appropriate for delete ate */
-	bool prev_found = false;
-
-	if (!fs->ready) {
-		LOG_ERR("NVS not initialized");
-		return -EACCES;
+	for (size_t i = ctx->queued; i-- > 0;) {
+		if (ctx->queue[i].id == id) {
+			*addr = ctx->fs->ate_wra;
+			*ate = ctx->queue[i];
+			return 1;
+		}
 	}
 
-	ate_size = nvs_al_size(fs, sizeof(struct nvs_ate));
-	data_size = nvs_al_size(fs, len);
+	return nvs_newest_ate(ctx->fs, id, addr, ate);
+}
 
-	/* The maximum data size is sector size - 4 ate
-	 * where: 1 ate for data, 1 ate for sector close, 1 ate for gc done,
-	 * and 1 ate to always allow a delete.
-	 * Also take into account the data CRC that is appended at the end of the data field,
-	 * if any.
-	 */
-	if ((len > (fs->sector_size - 4 * ate_size - NVS_DATA_CRC_SIZE)) ||
-	    ((len > 0) && (data == NULL))) {
-		return -EINVAL;
+static int nvs_import_rec(struct nvs_import_ctx *ctx, const struct nvs_image_rec *rec,
+			  uint32_t first)
+{
+	struct nvs_fs *fs = ctx->fs;
+	struct nvs_ate *entry, prev_ate;
+	size_t ate_size, required_space = 0U;
+	uint32_t ate_blk, prev_addr;
+	bool prev_found;
+	int rc;
+
+	ate_size = nvs_ate_blk_size(fs);
+
+	entry = &ctx->queue[ctx->queued];
+	memset(entry, 0xff, sizeof(*entry));
+	entry->id = (nvs_id_t)rec->id;
+	entry->part = NVS_ATE_PART_DEFAULT;
+#ifdef CONFIG_NVS_INLINE_VALUE
+	if (rec->len && (rec->len <= NVS_ATE_INLINE_SIZE)) {
+		entry->part = NVS_ATE_PART_INLINE;
+		required_space = ate_size;
+	} else
+#endif
+	if (rec->len) {
+		required_space = nvs_al_size(fs, rec->len) + ate_size + NVS_DATA_CRC_SIZE;
 	}
 
-	/* find latest entry with same id */
-#ifdef CONFIG_NVS_LOOKUP_CACHE
-	wlk_addr = fs->lookup_cache[nvs_lookup_cache_pos(id)];
+	/* the queued entries take the blocks below ate_wra. There is no gc: the
+	 * sectors after the write sector are empty, one of them has to stay so.
+	 */
+	ate_blk = nvs_ate_wra_blk(fs) - (ctx->queued / (ate_size / nvs_ate_size(fs))) * ate_size;
+	if (ate_blk < (fs->data_wra + required_space)) {
+		rc = nvs_import_flush(ctx);
+		if (rc) {
+			return rc;
+		}
+		memmove(ctx->queue, entry, sizeof(*entry));
+		entry = ctx->queue;
 
-	if (wlk_addr == NVS_LOOKUP_CACHE_NO_ADDR) {
-		goto no_cached_entry;
+		if (nvs_sector_next(fs, nvs_sector_next(fs, fs->ate_wra >> ADDR_SECT_SHIFT)) ==
+		    first) {
+			return -ENOSPC;
+		}
+		rc = nvs_sector_close(fs);
+		if (rc) {
+			return rc;
+		}
+		rc = nvs_add_gc_done_ate(fs);
+		if (rc) {
+			return rc;
+		}
 	}
-#else
-	wlk_addr = fs->ate_wra;
-#endif
-	rd_addr = wlk_addr;
 
-	while (1) {
-		rd_addr = wlk_addr;
-		rc = nvs_prev_ate(fs, &wlk_addr, &wlk_ate);
+	entry->offset = (nvs_ate_off_t)(fs->data_wra & ADDR_OFFS_MASK);
+	entry->len = (nvs_ate_off_t)rec->len;
+#ifdef CONFIG_NVS_INLINE_VALUE
+	if (entry->part == NVS_ATE_PART_INLINE) {
+		uint8_t value[NVS_ATE_INLINE_SIZE];
+
+		rc = nvs_import_rd(ctx, value, rec->len);
 		if (rc) {
 			return rc;
 		}
-		if ((wlk_ate.id == id) && (nvs_ate_valid(fs, &wlk_ate))) {
-			prev_found = true;
-			break;
+		nvs_ate_inline_set(entry, value, rec->len);
+	} else
+#endif
+	if (rec->len) {
+		rc = nvs_import_data(ctx, rec->len);
+		if (rc) {
+			return rc;
 		}
-		if (wlk_addr == fs->ate_wra) {
-			break;
+		/* a value larger than the free stage flushes the queue first */
+		if (entry != &ctx->queue[ctx->queued]) {
+			memmove(ctx->queue, entry, sizeof(*entry));
+			entry = ctx->queue;
 		}
+		entry->len += NVS_DATA_CRC_SIZE;
 	}
+	nvs_ate_crc8_update(fs, entry);
+	fs->host_bytes += rec->len;
 
-#ifdef CONFIG_NVS_LOOKUP_CACHE
-no_cached_entry:
+	/* an id can appear more than once, the last record wins */
+#ifdef CONFIG_NVS_GC_POLICY
+	if (!fs->stats && !fs->sector_info) {
+#else
+	if (!fs->stats) {
 #endif
-
-	if (prev_found) {
-		/* previous entry found */
-		rd_addr &= ADDR_SECT_MASK;
-		rd_addr += wlk_ate.offset;
-
-		if (len == 0) {
-			/* do not try to compare with empty data */
-			if (wlk_ate.len == 0U) {
-				/* skip delete entry as it is already the
-				 * last one
-				 */
-				return 0;
-			}
-		} else if (len + NVS_DATA_CRC_SIZE == wlk_ate.len) {
-			/* do not try to compare if lengths are not equal */
-			/* compare the data and if equal return 0 */
-			rc = nvs_flash_block_cmp(fs, rd_addr, data, len + NVS_DATA_CRC_SIZE);
-			if (rc <= 0) {
-				return rc;
-			}
+		goto queue;
+	}
+	rc = nvs_import_prev(ctx, entry->id, &prev_addr, &prev_ate);
+	if (rc < 0) {
+		return rc;
+	}
+	prev_found = rc;
+#ifdef CONFIG_NVS_GC_POLICY
+	if (fs->sector_info) {
+		if (prev_found) {
+			nvs_sector_live_add(fs, prev_addr, -(int32_t)nvs_ate_space(fs, &prev_ate));
 		}
-	} else {
-		/* skip delete entry for non-existing entry */
-		if (len == 0) {
-			return 0;
+		if (rec->len) {
+			nvs_sector_live_add(fs, fs->ate_wra, nvs_ate_space(fs, entry));
 		}
 	}
+#endif
+	if (fs->stats) {
+		nvs_stats_entry(fs, prev_found ? &prev_ate : NULL,
+				rec->len ? nvs_ate_space(fs, entry) : 0U);
+	}
 
-	/* calculate required space if the entry contains data */
-	if (data_size) {
-		/* Leave space for delete ate */
-		required_space = data_size + ate_size + NVS_DATA_CRC_SIZE;
+queue:
+
+	if (++ctx->queued == ctx->queue_max) {
+		return nvs_import_flush(ctx);
 	}
 
-	if (fs->impl_mutex_lock_forever)
-		fs->impl_mutex_lock_forever();
+	return 0;
+}
 
-	gc_count = 0;
-	while (1) {
-		if (gc_count == fs->sector_count) {
-			/* gc'ed all sectors, no extra space will be created
-			 * by extra gc.
-			 */
-			rc = -ENOSPC;
-			goto end;
+static int nvs_import_locked(struct nvs_fs *fs, const struct nvs_image_source *source)
+{
+	struct nvs_import_ctx ctx;
+	struct nvs_image_rec rec;
+	struct nvs_ate ate;
+	struct nvs_ate_win win;
+	size_t max_len, ate_size;
+	uint32_t addr, first;
+	ssize_t rd;
+	int rc;
+
+	/* the file system must not hold any entry */
+	addr = fs->ate_wra;
+	nvs_ate_win_reset(&win);
+	do {
+		rc = nvs_prev_ate(fs, &addr, &ate, &win);
+		if (rc) {
+			return rc;
 		}
+		if ((ate.id != NVS_SPECIAL_ATE_ID) && nvs_ate_valid(fs, &ate)) {
+			return -ENOTEMPTY;
+		}
+	} while (addr != fs->ate_wra);
 
-		if (fs->ate_wra >= (fs->data_wra + required_space)) {
+	ate_size = nvs_ate_blk_size(fs);
+	max_len = nvs_sector_size(fs) - 4 * ate_size - NVS_DATA_CRC_SIZE - nvs_sector_hdr_space(fs);
 
-			rc = nvs_flash_wrt_entry(fs, id, data, len);
-			if (rc) {
-				goto end;
-			}
+	ctx.fs = fs;
+	ctx.source = source;
+	ctx.stage = source->buf ? source->buf : ctx.local;
+	ctx.stage_size = source->buf ? source->buf_size : sizeof(ctx.local);
+	ctx.stage_size &= ~(nvs_write_block_size(fs) - 1U);
+	ctx.stage_fill = 0U;
+	ctx.queued = 0U;
+	ctx.queue_max = NVS_ATE_RUN_BLOCKS * (ate_size / nvs_ate_size(fs));
+
+	first = fs->ate_wra >> ADDR_SECT_SHIFT;
+
+	while (true) {
+		rd = source->read(source->ctx, &rec, sizeof(rec));
+		if (rd <= 0) {
+			rc = rd;
+			break;
+		}
+		if ((size_t)rd != sizeof(rec)) {
+			rc = -EIO;
 			break;
 		}
-
-
-		rc = nvs_sector_close(fs);
-		if (rc) {
-			goto end;
+		if ((rec.id > NVS_ID_MAX) || (rec.len > max_len)) {
+			rc = -EINVAL;
+			break;
 		}
 
-		rc = nvs_gc(fs);
+		rc = nvs_import_rec(&ctx, &rec, first);
 		if (rc) {
-			goto end;
+			break;
 		}
-		gc_count++;
 	}
-	rc = len;
-end:
-	if (fs->impl_mutex_unlock)
-		fs->impl_mutex_unlock();
+
+	if (!rc) {
+		rc = nvs_import_flush(&ctx);
+	}
+
 	return rc;
 }
 
-int nvs_delete(struct nvs_fs *fs, uint16_t id)
+int nvs_import(struct nvs_fs *fs, const struct nvs_image_source *source)
 {
-	return nvs_write(fs, id, NULL, 0);
+	int rc;
+
+	if (!fs->ready) {
+		LOG_ERR("NVS not initialized");
+		return -EACCES;
+	}
+
+	if (fs->read_only) {
+		return -EROFS;
+	}
+
+	if (!source->read ||
+	    (source->buf && (source->buf_size < nvs_write_block_size(fs)))) {
+		return -EINVAL;
+	}
+
+	if (fs->impl_mutex_lock_forever)
+		fs->impl_mutex_lock_forever();
+
+	rc = nvs_import_locked(fs, source);
+
+	if (fs->impl_mutex_unlock)
+		fs->impl_mutex_unlock();
+	return rc;
 }
 
-ssize_t nvs_read_hist(struct nvs_fs *fs, uint16_t id, void *data, size_t len,
-		      uint16_t cnt)
+/* read the value of entry stored at addr and check its data CRC, -EIO when
+ * it is corrupted
+ */
+static int nvs_scrub_value(struct nvs_fs *fs, uint32_t addr, const struct nvs_ate *entry)
 {
+	uint8_t buf[NVS_BLOCK_SIZE];
+	size_t len, chunk;
 	int rc;
-	uint32_t wlk_addr, rd_addr;
-	uint16_t cnt_his;
-	struct nvs_ate wlk_ate;
-	size_t ate_size;
 #ifdef CONFIG_NVS_DATA_CRC
-	uint32_t read_data_crc, computed_data_crc;
+	uint32_t read_data_crc, computed_data_crc = 0U;
 #endif
 
-	if (!fs->ready) {
-		LOG_ERR("NVS not initialized");
-		return -EACCES;
+	if (nvs_ate_inline(entry)) {
+		/* crc8 covers the value */
+		return 0;
 	}
 
-	ate_size = nvs_al_size(fs, sizeof(struct nvs_ate));
+#ifdef CONFIG_NVS_DATA_CRC
+	if (entry->len < NVS_DATA_CRC_SIZE) {
+		return -EIO;
+	}
+#endif
 
-	if (len > (fs->sector_size - 2 * ate_size)) {
-		return -EINVAL;
+	len = entry->len - NVS_DATA_CRC_SIZE;
+	while (len) {
+		chunk = MIN(len, sizeof(buf));
+		rc = nvs_flash_rd(fs, addr, buf, chunk);
+		if (rc) {
+			return rc;
+		}
+#ifdef CONFIG_NVS_DATA_CRC
+		computed_data_crc = nvs_crc(fs)->crc32(computed_data_crc, buf, chunk);
+#endif
+		addr += chunk;
+		len -= chunk;
 	}
 
-	cnt_his = 0U;
+#ifdef CONFIG_NVS_DATA_CRC
+	rc = nvs_flash_rd(fs, addr, &read_data_crc, sizeof(read_data_crc));
+	if (rc) {
+		return rc;
+	}
+	if (read_data_crc != computed_data_crc) {
+		LOG_ERR("Invalid data CRC: read_data_crc=0x%08X, computed_data_crc=0x%08X",
+			read_data_crc, computed_data_crc);
+		return -EIO;
+	}
+#endif
+
+	return 0;
+}
+
+/* nvs_scrub_live returns 1 if the ate at addr holds the value of its id. The
+ * walk looking for a newer entry of the id is charged to the budget, when it
+ * runs out -EAGAIN is returned and the walk continues from scrub_walk in the
+ * next call. At least one entry is walked per call.
+ */
+static int nvs_scrub_live(struct nvs_fs *fs, uint32_t addr, const struct nvs_ate *entry,
+			  size_t *done, size_t budget)
+{
+	struct nvs_ate wlk_ate;
+	struct nvs_ate_win win;
+	uint32_t wlk_addr, prev_addr;
+	int rc;
+
+	if ((entry->id == NVS_SPECIAL_ATE_ID) || !entry->len) {
+		return 0;
+	}
 
 #ifdef CONFIG_NVS_LOOKUP_CACHE
-	wlk_addr = fs->lookup_cache[nvs_lookup_cache_pos(id)];
+	if (fs->lookup_cache &&
+	    (__atomic_load_n(&fs->lookup_cache[nvs_lookup_cache_pos(fs, entry->id)],
+			     __ATOMIC_ACQUIRE) == addr)) {
+		return 1;
+	}
+#endif
 
+	wlk_addr = fs->scrub_walk;
 	if (wlk_addr == NVS_LOOKUP_CACHE_NO_ADDR) {
-		rc = -ENOENT;
-		goto err;
+		wlk_addr = nvs_lookup_start(fs, entry->id);
+		if (wlk_addr == NVS_LOOKUP_CACHE_NO_ADDR) {
+			return 0;
+		}
 	}
-#else
-	wlk_addr = fs->ate_wra;
-#endif
-	rd_addr = wlk_addr;
 
-	while (cnt_his <= cnt) {
-		rd_addr = wlk_addr;
-		rc = nvs_prev_ate(fs, &wlk_addr, &wlk_ate);
+	nvs_ate_win_reset(&win);
+	do {
+		prev_addr = wlk_addr;
+		rc = nvs_prev_ate(fs, &wlk_addr, &wlk_ate, &win);
 		if (rc) {
-			goto err;
+			break;
 		}
-		if ((wlk_ate.id == id) &&  (nvs_ate_valid(fs, &wlk_ate))) {
-			cnt_his++;
+		*done += nvs_ate_size(fs);
+		rc = nvs_ate_match(fs, prev_addr, &wlk_ate, entry->id);
+		if (rc) {
+			if (rc > 0) {
+				rc = (prev_addr == addr);
+			}
+			break;
 		}
 		if (wlk_addr == fs->ate_wra) {
 			break;
 		}
-	}
+		if (*done >= budget) {
+			fs->scrub_walk = wlk_addr;
+			return -EAGAIN;
+		}
+	} while (true);
 
-	if (((wlk_addr == fs->ate_wra) && (wlk_ate.id != id)) ||
-	    (wlk_ate.len == 0U) || (cnt_his < cnt)) {
-		return -ENOENT;
-	}
+	fs->scrub_walk = NVS_LOOKUP_CACHE_NO_ADDR;
+	return rc;
+}
 
-#ifdef CONFIG_NVS_DATA_CRC
-	/* When data CRC is enabled, there should be at least the CRC stored in the data field */
-	if (wlk_ate.len < NVS_DATA_CRC_SIZE) {
-		return -ENOENT;
+/* move the intact live values of sector to the write sector, as long as they
+ * fit in it without garbage collection. The values that do not fit are moved
+ * by gc later on.
+ */
+static int nvs_scrub_relocate(struct nvs_fs *fs, uint32_t sector)
+{
+	struct nvs_ate close_ate, ate;
+	struct nvs_ate_win win;
+	uint32_t addr, ate_addr, data_addr;
+	size_t ate_size, blk_size, space;
+	int rc;
+
+	if (sector == (fs->ate_wra >> ADDR_SECT_SHIFT)) {
+		/* the values would stay in the same sector */
+		return 0;
 	}
-#endif
 
-	rd_addr &= ADDR_SECT_MASK;
-	rd_addr += wlk_ate.offset;
-	rc = nvs_flash_rd(fs, rd_addr, data, MIN(len, wlk_ate.len - NVS_DATA_CRC_SIZE));
+	ate_size = nvs_ate_size(fs);
+	blk_size = nvs_ate_blk_size(fs);
+
+	addr = (sector << ADDR_SECT_SHIFT) + nvs_sector_size(fs) - ate_size;
+	rc = nvs_flash_ate_rd(fs, addr, &close_ate);
 	if (rc) {
-		goto err;
+		return rc;
 	}
 
-	/* Check data CRC (only if the whole element data has been read) */
-#ifdef CONFIG_NVS_DATA_CRC
-	if (len >= (wlk_ate.len - NVS_DATA_CRC_SIZE)) {
-		rd_addr += wlk_ate.len - NVS_DATA_CRC_SIZE;
-		rc = nvs_flash_rd(fs, rd_addr, &read_data_crc, sizeof(read_data_crc));
+	if (nvs_close_ate_valid(fs, &close_ate)) {
+		addr &= ADDR_SECT_MASK;
+		addr += close_ate.offset;
+	} else {
+		rc = nvs_recover_last_ate(fs, &addr);
 		if (rc) {
-			goto err;
+			return rc;
 		}
+	}
 
-		computed_data_crc = crc32_ieee(data, wlk_ate.len - NVS_DATA_CRC_SIZE);
-		if (read_data_crc != computed_data_crc) {
-			LOG_ERR("Invalid data CRC: read_data_crc=0x%08X, computed_data_crc=0x%08X",
-				read_data_crc, computed_data_crc);
-			rc = -EIO;
-			goto err;
+	nvs_ate_win_reset(&win);
+	do {
+		ate_addr = addr;
+		rc = nvs_prev_ate(fs, &addr, &ate, &win);
+		if (rc) {
+			return rc;
 		}
-	}
-#endif
 
-	return wlk_ate.len - NVS_DATA_CRC_SIZE;
+		if (!nvs_ate_valid(fs, &ate) || (ate.id == NVS_SPECIAL_ATE_ID) || !ate.len) {
+			continue;
+		}
 
-err:
-	return rc;
-}
+		rc = nvs_ate_is_newest(fs, ate_addr, &ate);
+		if (rc < 0) {
+			return rc;
+		}
+		if (!rc) {
+			continue;
+		}
 
-ssize_t nvs_read(struct nvs_fs *fs, uint16_t id, void *data, size_t len)
-{
-	int rc;
+		data_addr = (ate_addr & ADDR_SECT_MASK) + ate.offset;
+		rc = nvs_scrub_value(fs, data_addr, &ate);
+		if (rc == -EIO) {
+			/* lost, reported by the scrub walk */
+			continue;
+		}
+		if (rc) {
+			return rc;
+		}
 
-	rc = nvs_read_hist(fs, id, data, len, 0);
-	return rc;
+		/* leave room for a delete ate */
+		space = (nvs_ate_inline(&ate) ? 0U : nvs_al_size(fs, ate.len)) + 2U * blk_size;
+		if (nvs_ate_wra_blk(fs) < (fs->data_wra + space)) {
+			break;
+		}
+
+		LOG_DBG("Relocating %d, len %d", ate.id, ate.len);
+#ifdef CONFIG_NVS_GC_POLICY
+		if (fs->sector_info) {
+			nvs_sector_live_add(fs, ate_addr, -(int32_t)nvs_ate_space(fs, &ate));
+		}
+#endif
+		if (!nvs_ate_inline(&ate)) {
+			ate.offset = (nvs_ate_off_t)(fs->data_wra & ADDR_OFFS_MASK);
+			nvs_ate_crc8_update(fs, &ate);
+			rc = nvs_flash_block_move(fs, data_addr, ate.len);
+			if (rc) {
+				return rc;
+			}
+		}
+
+		rc = nvs_flash_ate_wrt(fs, &ate);
+		if (rc) {
+			return rc;
+		}
+#ifdef CONFIG_NVS_GC_POLICY
+		if (fs->sector_info) {
+			nvs_sector_live_add(fs, fs->ate_wra + ate_size, nvs_ate_space(fs, &ate));
+		}
+#endif
+	} while ((addr >> ADDR_SECT_SHIFT) == sector);
+
+	return 0;
 }
 
-ssize_t nvs_calc_free_space(struct nvs_fs *fs)
+static int nvs_scrub_locked(struct nvs_fs *fs, size_t budget)
 {
+	struct nvs_ate ate;
+	struct nvs_ate_win win;
+	uint32_t addr, ate_addr;
+	size_t ate_size, done = 0U;
+	bool corrupted;
 	int rc;
-	struct nvs_ate step_ate, wlk_ate;
-	uint32_t step_addr, wlk_addr;
-	size_t ate_size, free_space;
 
-	if (!fs->ready) {
-		LOG_ERR("NVS not initialized");
-		return -EACCES;
+	if (fs->scrub_addr == NVS_SCRUB_PASS_END) {
+		fs->scrub_addr = NVS_LOOKUP_CACHE_NO_ADDR;
+		return 1;
 	}
 
-	ate_size = nvs_al_size(fs, sizeof(struct nvs_ate));
-
-	/*
-	 * There is always a closing ATE and a reserved ATE for
-	 * deletion in each sector.
-	 * Take into account one less sector because it is reserved for the
-	 * garbage collection.
-	 */
-	free_space = (fs->sector_count - 1) * (fs->sector_size - (2 * ate_size));
+	ate_size = nvs_ate_size(fs);
 
-	step_addr = fs->ate_wra;
+	addr = fs->scrub_addr;
+	if (addr == NVS_LOOKUP_CACHE_NO_ADDR) {
+		addr = fs->ate_wra;
+	}
 
-	while (1) {
-		rc = nvs_prev_ate(fs, &step_addr, &step_ate);
+	nvs_ate_win_reset(&win);
+	do {
+		ate_addr = addr;
+		rc = nvs_prev_ate(fs, &addr, &ate, &win);
 		if (rc) {
 			return rc;
 		}
+		done += ate_size;
+		corrupted = false;
 
-		wlk_addr = fs->ate_wra;
+		if (!nvs_ate_cmp_const(&ate, fs->flash_parameters->erase_value)) {
+			/* free slot of a write block */
+			continue;
+		}
 
-		while (1) {
-			rc = nvs_prev_ate(fs, &wlk_addr, &wlk_ate);
-			if (rc) {
+		if (!nvs_ate_valid(fs, &ate)) {
+			LOG_WRN("Damaged ate at %x, id %d", ate_addr, ate.id);
+			if (fs->impl_scrub_report) {
+				fs->impl_scrub_report(ate.id, -EBADMSG);
+			}
+			corrupted = true;
+		} else {
+			rc = nvs_scrub_live(fs, ate_addr, &ate, &done, budget);
+			if (rc == -EAGAIN) {
+				/* continue with this entry in the next call */
+				fs->scrub_addr = ate_addr;
+				return 0;
+			}
+			if (rc < 0) {
 				return rc;
 			}
-			if ((wlk_ate.id == step_ate.id) ||
-			    (wlk_addr == fs->ate_wra)) {
-				break;
+			if (rc) {
+				done += ate.len;
+				rc = nvs_scrub_value(fs, (ate_addr & ADDR_SECT_MASK) + ate.offset,
+						     &ate);
+				if (rc == -EIO) {
+					if (fs->impl_scrub_report) {
+						fs->impl_scrub_report(ate.id, -EIO);
+					}
+					corrupted = true;
+				} else if (rc) {
+					return rc;
+				}
 			}
 		}
 
-		if (nvs_ate_valid(fs, &step_ate)) {
-			/* Take into account the GC done ATE if it is present */
-			if (step_ate.len == 0) {
-				if (step_ate.id == 0xFFFF) {
-					free_space -= ate_size;
-				}
-			} else if (wlk_addr == step_addr) {
-				/* count needed */
-				free_space -= nvs_al_size(fs, step_ate.len);
-				free_space -= ate_size;
+		if (corrupted && fs->scrub_relocate && !fs->read_only) {
+			rc = nvs_scrub_relocate(fs, ate_addr >> ADDR_SECT_SHIFT);
+			if (rc) {
+				return rc;
 			}
 		}
+	} while ((addr != fs->ate_wra) && (done < budget));
 
-		if (step_addr == fs->ate_wra) {
-			break;
-		}
+	if (addr == fs->ate_wra) {
+		fs->scrub_addr = NVS_LOOKUP_CACHE_NO_ADDR;
+		return 1;
 	}
-	return free_space;
+
+	fs->scrub_addr = addr;
+	return 0;
 }
 
-size_t nvs_sector_max_data_size(struct nvs_fs *fs)
+int nvs_scrub(struct nvs_fs *fs, size_t budget)
 {
-	size_t ate_size;
+	int rc;
 
 	if (!fs->ready) {
 		LOG_ERR("NVS not initialized");
 		return -EACCES;
 	}
 
-	ate_size = nvs_al_size(fs, sizeof(struct nvs_ate));
+	if (fs->impl_mutex_lock_forever)
+		fs->impl_mutex_lock_forever();
 
-	return fs->ate_wra - fs->data_wra - ate_size - NVS_DATA_CRC_SIZE;
+	rc = nvs_scrub_locked(fs, budget);
+
+	if (fs->impl_mutex_unlock)
+		fs->impl_mutex_unlock();
+	return rc;
 }
 
-int nvs_sector_use_next(struct nvs_fs *fs)
+int nvs_stats_get(struct nvs_fs *fs, struct nvs_stats *stats)
 {
-	int ret;
+	uint32_t used;
 
 	if (!fs->ready) {
 		LOG_ERR("NVS not initialized");
 		return -EACCES;
 	}
 
+	if (!fs->stats) {
+		return -ENOTSUP;
+	}
+
 	if (fs->impl_mutex_lock_forever)
 		fs->impl_mutex_lock_forever();
 
-	ret = nvs_sector_close(fs);
-	if (ret != 0) {
-		goto end;
-	}
+	*stats = *fs->stats;
 
-	ret = nvs_gc(fs);
+	/* closed sectors and the part of the write sector in use */
+	used = (uint32_t)stats->closed_sectors * nvs_sector_size(fs) + nvs_sector_size(fs) -
+	       (nvs_ate_wra_blk(fs) - fs->data_wra);
+	stats->dead_bytes = used - MIN(used, stats->live_bytes);
+	stats->write_amp = nvs_write_amp(fs);
 
-end:
 	if (fs->impl_mutex_unlock)
 		fs->impl_mutex_unlock();
-	return ret;
+	return 0;
+}
+
+uint32_t nvs_write_amp(const struct nvs_fs *fs)
+{
+	if (!fs->host_bytes) {
+		return 0;
+	}
+
+	return (uint32_t)((fs->flash_bytes * 100U) / fs->host_bytes);
 }
@@ -0,0 +1,143 @@
+/*  NVS image builder: mount-ready NVS partitions built on the host
+ *
+ * Copyright (c) 2024 imwoo90
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <nvs_image.h>
+#include "nvs_priv.h"
+
+/* the flash interface has no context, the image being built is global */
+static uint8_t *nvs_image_mem;
+static size_t nvs_image_mem_size;
+
+static int nvs_image_rd(off_t offset, void *data, size_t len)
+{
+	if ((offset < 0) || ((size_t)offset + len > nvs_image_mem_size)) {
+		return -EINVAL;
+	}
+	memcpy(data, &nvs_image_mem[offset], len);
+	return 0;
+}
+
+static int nvs_image_wrt(off_t offset, const void *data, size_t len)
+{
+	if ((offset < 0) || ((size_t)offset + len > nvs_image_mem_size)) {
+		return -EINVAL;
+	}
+	memcpy(&nvs_image_mem[offset], data, len);
+	return 0;
+}
+
+static int nvs_image_erase(off_t offset, size_t len)
+{
+	if ((offset < 0) || ((size_t)offset + len > nvs_image_mem_size)) {
+		return -EINVAL;
+	}
+	memset(&nvs_image_mem[offset], fil_get_flash_parameters()->erase_value, len);
+	return 0;
+}
+
+/* the entries seen as the records of nvs_import() */
+struct nvs_image_entry_rd {
+	const struct nvs_image_entry *entries;
+	size_t count;
+	size_t idx;
+	/* position in the current record, header included */
+	size_t pos;
+};
+
+static ssize_t nvs_image_entry_read(void *ctx, void *data, size_t len)
+{
+	struct nvs_image_entry_rd *rd = ctx;
+	const struct nvs_image_entry *entry;
+	struct nvs_image_rec rec;
+	uint8_t *data8 = data;
+	size_t done = 0U, n;
+
+	while ((done < len) && (rd->idx < rd->count)) {
+		entry = &rd->entries[rd->idx];
+		if (rd->pos < sizeof(rec)) {
+			rec.id = entry->id;
+			rec.len = (uint32_t)entry->len;
+			n = MIN(len - done, sizeof(rec) - rd->pos);
+			memcpy(&data8[done], (uint8_t *)&rec + rd->pos, n);
+		} else {
+			n = MIN(len - done, sizeof(rec) + entry->len - rd->pos);
+			memcpy(&data8[done], (const uint8_t *)entry->data + rd->pos - sizeof(rec), n);
+		}
+		done += n;
+		rd->pos += n;
+		if (rd->pos == sizeof(rec) + entry->len) {
+			rd->idx++;
+			rd->pos = 0U;
+		}
+	}
+
+	return done;
+}
+
+int nvs_image_build(const struct nvs_image_geometry *geo,
+		    const struct nvs_image_entry *entries, size_t count,
+		    uint8_t *image, size_t image_size)
+{
+	struct fil image_fil = {
+		.read = nvs_image_rd,
+		.write = nvs_image_wrt,
+		.erase = nvs_image_erase,
+	};
+	struct flash_parameters params = {
+		.write_block_size = geo->write_block_size,
+		.erase_value = geo->erase_value,
+	};
+	struct fil saved_fil;
+	struct flash_parameters saved_params = { .write_block_size = 0 };
+	struct nvs_image_entry_rd rd = { .entries = entries, .count = count };
+	uint8_t stage[1024];
+	struct nvs_image_source source = {
+		.read = nvs_image_entry_read,
+		.ctx = &rd,
+		.buf = stage,
+		.buf_size = sizeof(stage),
+	};
+	struct nvs_fs fs;
+	bool restore;
+	int rc;
+
+	if ((size_t)geo->sector_size * geo->sector_count != image_size) {
+		LOG_ERR("Invalid image size");
+		return -EINVAL;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if ((entries[i].len && !entries[i].data) || (entries[i].id > NVS_ID_MAX)) {
+			return -EINVAL;
+		}
+	}
+
+	restore = !fil_get(&saved_fil, &saved_params);
+	nvs_image_mem = image;
+	nvs_image_mem_size = image_size;
+	fil_init(&image_fil, &params);
+	memset(image, geo->erase_value, image_size);
+
+	memset(&fs, 0, sizeof(fs));
+	fs.sector_size = geo->sector_size;
+	fs.sector_count = geo->sector_count;
+
+	rc = nvs_mount(&fs);
+	if (!rc) {
+		rc = nvs_import(&fs, &source);
+	}
+
+	if (restore) {
+		fil_init(&saved_fil, &saved_params);
+	}
+	nvs_image_mem = NULL;
+	nvs_image_mem_size = 0U;
+
+	return rc;
+}
@@ -0,0 +1,168 @@
+/*  NVS: small LZ77 codec for value compression
+ *
+ * Copyright (c) 2024 imwoo90
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <nvs.h>
+#include "nvs_priv.h"
+
+#ifdef CONFIG_NVS_COMPRESS
+
+/*
+ * Stream format, a sequence of tokens:
+ *   0x00-0x7f: literal run, followed by (token + 1) literal bytes
+ *   0x80-0xff: match of ((token & 0x7f) + NVS_LZ_MIN_MATCH) bytes, followed
+ *              by a 16 bit little endian distance (1..0xffff) back into the
+ *              output
+ * The compressor only keeps a hash table of NVS_LZ_HASH_SIZE positions, the
+ * decompressor only needs the output buffer.
+ */
+#define NVS_LZ_HASH_BITS 8
+#define NVS_LZ_HASH_SIZE (1U << NVS_LZ_HASH_BITS)
+#define NVS_LZ_MIN_MATCH 3U
+#define NVS_LZ_MAX_MATCH (0x7fU + NVS_LZ_MIN_MATCH)
+#define NVS_LZ_MAX_LITERAL 0x80U
+#define NVS_LZ_MAX_DIST 0xffffU
+
+static inline uint32_t nvs_lz_hash(const uint8_t *p)
+{
+	uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+
+	return (v * 2654435761U) >> (32 - NVS_LZ_HASH_BITS);
+}
+
+/* emit literals, return the new output length or 0 if out is too small */
+static size_t nvs_lz_literals(const uint8_t *lit, size_t len, uint8_t *out,
+			      size_t op, size_t out_size)
+{
+	size_t run;
+
+	while (len) {
+		run = MIN(len, NVS_LZ_MAX_LITERAL);
+		if (op + 1 + run > out_size) {
+			return 0;
+		}
+		out[op++] = (uint8_t)(run - 1);
+		memcpy(&out[op], lit, run);
+		op += run;
+		lit += run;
+		len -= run;
+	}
+
+	return op;
+}
+
+size_t nvs_lz_compress(const uint8_t *in, size_t in_len, uint8_t *out,
+		       size_t out_size)
+{
+	uint16_t table[NVS_LZ_HASH_SIZE];
+	size_t ip = 0U, lit = 0U, op = 0U, ref, match;
+	uint32_t h;
+
+	/* positions are kept as 16 bit + 1 */
+	if (in_len >= NVS_LZ_MAX_DIST) {
+		return 0;
+	}
+
+	memset(table, 0, sizeof(table));
+
+	while (ip + NVS_LZ_MIN_MATCH <= in_len) {
+		h = nvs_lz_hash(&in[ip]);
+		ref = table[h];
+		table[h] = (uint16_t)(ip + 1U);
+
+		if (!ref || memcmp(&in[ref - 1U], &in[ip], NVS_LZ_MIN_MATCH)) {
+			ip++;
+			continue;
+		}
+		ref--;
+
+		if (lit < ip) {
+			op = nvs_lz_literals(&in[lit], ip - lit, out, op, out_size);
+			if (!op) {
+				return 0;
+			}
+		}
+
+		match = NVS_LZ_MIN_MATCH;
+		while ((ip + match < in_len) && (match < NVS_LZ_MAX_MATCH) &&
+		       (in[ref + match] == in[ip + match])) {
+			match++;
+		}
+
+		if (op + 3 > out_size) {
+			return 0;
+		}
+		out[op++] = (uint8_t)(0x80U | (match - NVS_LZ_MIN_MATCH));
+		out[op++] = (uint8_t)((ip - ref) & 0xffU);
+		out[op++] = (uint8_t)((ip - ref) >> 8);
+
+		ip += match;
+		lit = ip;
+	}
+
+	if (lit < in_len) {
+		op = nvs_lz_literals(&in[lit], in_len - lit, out, op, out_size);
+	}
+
+	return op;
+}
+
+ssize_t nvs_lz_decompress(nvs_lz_rd_t rd, void *ctx, size_t in_len, uint8_t *out,
+			  size_t out_len)
+{
+	size_t ip = 0U, op = 0U, n, dist;
+	uint8_t token, d[2];
+	int rc;
+
+	while ((ip < in_len) && (op < out_len)) {
+		rc = rd(ctx, &token, 1);
+		if (rc) {
+			return rc;
+		}
+		ip++;
+
+		if (token < 0x80U) {
+			n = (size_t)token + 1U;
+			if (ip + n > in_len) {
+				return -EIO;
+			}
+			/* a partial read stops in the middle of the run */
+			n = MIN(n, out_len - op);
+			rc = rd(ctx, &out[op], n);
+			if (rc) {
+				return rc;
+			}
+			ip += n;
+			op += n;
+			continue;
+		}
+
+		if (ip + sizeof(d) > in_len) {
+			return -EIO;
+		}
+		rc = rd(ctx, d, sizeof(d));
+		if (rc) {
+			return rc;
+		}
+		ip += sizeof(d);
+
+		dist = d[0] | ((size_t)d[1] << 8);
+		if (!dist || (dist > op)) {
+			return -EIO;
+		}
+
+		n = MIN((size_t)(token & 0x7fU) + NVS_LZ_MIN_MATCH, out_len - op);
+		for (; n; n--, op++) {
+			out[op] = out[op - dist];
+		}
+	}
+
+	return op;
+}
+
+#endif /* CONFIG_NVS_COMPRESS */
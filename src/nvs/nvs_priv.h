@@ -12,16 +12,38 @@ extern "C" {
 #endif
 
 #include "../fil/fil_priv.h"
+#include "../zephyr_macros.h"
 
 /*
  * MASKS AND SHIFT FOR ADDRESSES
  * an address in nvs is an uint32_t where:
  *   high 2 bytes represent the sector number
  *   low 2 bytes represent the offset in a sector
+ * With CONFIG_NVS_WIDE_ADDR the split is moved to
+ * CONFIG_NVS_WIDE_ADDR_SECT_SHIFT bits, trading sector count for sector size.
  */
-#define ADDR_SECT_MASK 0xFFFF0000
+#ifdef CONFIG_NVS_WIDE_ADDR
+#ifndef CONFIG_NVS_WIDE_ADDR_SECT_SHIFT
+#define CONFIG_NVS_WIDE_ADDR_SECT_SHIFT 20
+#endif
+#define ADDR_SECT_SHIFT CONFIG_NVS_WIDE_ADDR_SECT_SHIFT
+#else
 #define ADDR_SECT_SHIFT 16
-#define ADDR_OFFS_MASK 0x0000FFFF
+#endif
+#define ADDR_OFFS_MASK ((uint32_t)((1UL << ADDR_SECT_SHIFT) - 1U))
+#define ADDR_SECT_MASK (~ADDR_OFFS_MASK)
+
+/* Largest sector size and sector count that can be addressed */
+#define NVS_MAX_SECTOR_SIZE (ADDR_OFFS_MASK + 1U)
+#define NVS_MAX_SECTOR_COUNT (ADDR_SECT_MASK >> ADDR_SECT_SHIFT)
+
+#if defined(CONFIG_NVS_CHECKPOINT) && !defined(CONFIG_NVS_LOOKUP_CACHE)
+#error "CONFIG_NVS_CHECKPOINT requires CONFIG_NVS_LOOKUP_CACHE"
+#endif
+
+#if defined(CONFIG_NVS_CHECKPOINT_ON_SECTOR_CLOSE) && !defined(CONFIG_NVS_CHECKPOINT)
+#error "CONFIG_NVS_CHECKPOINT_ON_SECTOR_CLOSE requires CONFIG_NVS_CHECKPOINT"
+#endif
 
 /*
  * Status return values
@@ -30,7 +52,31 @@ extern "C" {
 
 #define NVS_BLOCK_SIZE 32
 
+/* write blocks of allocation table entries programmed at once by an import */
+#define NVS_ATE_RUN_BLOCKS 8
+
 #define NVS_LOOKUP_CACHE_NO_ADDR 0xFFFFFFFF
+#define NVS_NO_SECTOR 0xFFFFFFFF
+/* scrub cursor once gc erased the rest of the pass */
+#define NVS_SCRUB_PASS_END 0xFFFFFFFE
+
+/*
+ * Identifier used by the special purpose ATEs (sector close, gc done and
+ * checkpoint)
+ */
+#define NVS_SPECIAL_ATE_ID ((nvs_id_t)~(nvs_id_t)0)
+
+/*
+ * Values of the ATE part field. Regular entries keep the historical 0xff,
+ * other values tag special purpose entries.
+ */
+#define NVS_ATE_PART_DEFAULT 0xff
+#define NVS_ATE_PART_CHECKPOINT 0xfe
+#define NVS_ATE_PART_LZ 0xfd	/* data entry stored compressed */
+#define NVS_ATE_PART_SECTOR 0xfc	/* sector header (CONFIG_NVS_GC_POLICY) */
+#define NVS_ATE_PART_INLINE 0xfb	/* value held by the ATE (CONFIG_NVS_INLINE_VALUE) */
+#define NVS_ATE_PART_RANGE_LO 0xfa	/* first id of a range delete */
+#define NVS_ATE_PART_RANGE_HI 0xf9	/* last id of a range delete, follows its RANGE_LO */
 
 /*
  * Allow to use the NVS_DATA_CRC_SIZE macro in computations whether data CRC is enabled or not
@@ -41,15 +87,114 @@ extern "C" {
 #define NVS_DATA_CRC_SIZE 0
 #endif
 
+/*
+ * Allocation Table Entry layout. The default entry is 8 bytes, entries with
+ * wider fields are padded to 16 bytes so that the ATE slot size still divides
+ * power of two sector sizes.
+ */
+#ifdef CONFIG_NVS_ID_32BIT
+#define NVS_ATE_ID_SIZE 4
+#else
+#define NVS_ATE_ID_SIZE 2
+#endif
+
+#ifdef CONFIG_NVS_WIDE_ADDR
+typedef uint32_t nvs_ate_off_t;
+#define NVS_ATE_OFF_SIZE 4
+#else
+typedef uint16_t nvs_ate_off_t;
+#define NVS_ATE_OFF_SIZE 2
+#endif
+
+#define NVS_ATE_FIELDS_SIZE (NVS_ATE_ID_SIZE + 2 * NVS_ATE_OFF_SIZE + 2)
+#define NVS_ATE_SIZE (NVS_ATE_FIELDS_SIZE > 8 ? 16 : 8)
+#define NVS_ATE_RESERVED_SIZE (NVS_ATE_SIZE - NVS_ATE_FIELDS_SIZE)
+
+/* Values up to this size are stored in the offset and reserved fields of
+ * their ATE (CONFIG_NVS_INLINE_VALUE)
+ */
+#define NVS_ATE_INLINE_SIZE (NVS_ATE_OFF_SIZE + NVS_ATE_RESERVED_SIZE)
+
 /* Allocation Table Entry */
 struct nvs_ate {
-	uint16_t id;	/* data id */
-	uint16_t offset;	/* data offset within sector */
-	uint16_t len;	/* data len within sector */
+	nvs_id_t id;	/* data id */
+	nvs_ate_off_t offset;	/* data offset within sector */
+	nvs_ate_off_t len;	/* data len within sector */
 	uint8_t part;	/* part of a multipart data - future extension */
+#if NVS_ATE_RESERVED_SIZE > 0
+	uint8_t reserved[NVS_ATE_RESERVED_SIZE];	/* written as 0xff - future extension */
+#endif
 	uint8_t crc8;	/* crc8 check of the entry */
 } __packed;
 
+/*
+ * Read-ahead window of the allocation table walks: entries are read
+ * CONFIG_NVS_ATE_READ_AHEAD bytes at a time, or one by one when it is 0.
+ */
+#ifndef CONFIG_NVS_ATE_READ_AHEAD
+#define CONFIG_NVS_ATE_READ_AHEAD 0
+#endif
+
+#define NVS_ATE_WIN_SIZE MAX(CONFIG_NVS_ATE_READ_AHEAD, NVS_ATE_SIZE)
+
+struct nvs_ate_win {
+	uint32_t addr;	/* address of buf[0] */
+	uint32_t len;	/* bytes in buf, 0 when empty */
+	uint8_t buf[NVS_ATE_WIN_SIZE];
+};
+
+static inline void nvs_ate_win_reset(struct nvs_ate_win *win)
+{
+	win->addr = 0U;
+	win->len = 0U;
+}
+
+#ifdef CONFIG_NVS_GC_POLICY
+#if defined(CONFIG_NVS_CHECKPOINT)
+#error "CONFIG_NVS_GC_POLICY can not be combined with CONFIG_NVS_CHECKPOINT"
+#endif
+#if !defined(CONFIG_NVS_LOOKUP_CACHE)
+#error "CONFIG_NVS_GC_POLICY requires CONFIG_NVS_LOOKUP_CACHE"
+#endif
+
+/*
+ * Sector header: the first entry of each sector in the gc policy mode, an
+ * entry with NVS_SPECIAL_ATE_ID and NVS_ATE_PART_SECTOR. The sequence number
+ * orders the sectors at mount. The victim is the sector selected for garbage
+ * collection when the sector was opened, an interrupted collection is resumed
+ * from it.
+ */
+struct nvs_sector_hdr {
+	uint32_t seq;
+	uint16_t victim;
+	uint16_t reserved;
+};
+
+#define NVS_NO_VICTIM 0xFFFF
+#endif
+
+#ifdef CONFIG_NVS_COMPRESS
+/*
+ * Compressed values are stored as a 32 bit uncompressed length followed by
+ * the nvs_lz stream, the data CRC covers the stored bytes.
+ */
+#define NVS_LZ_HDR_SIZE 4
+
+typedef int (*nvs_lz_rd_t)(void *ctx, void *buf, size_t len);
+
+/* compress in into out, returns the compressed length or 0 if it does not
+ * fit in out_size bytes
+ */
+size_t nvs_lz_compress(const uint8_t *in, size_t in_len, uint8_t *out,
+		       size_t out_size);
+
+/* decompress in_len stream bytes obtained through rd into out, stops after
+ * out_len bytes. Returns the number of bytes produced or -errno.
+ */
+ssize_t nvs_lz_decompress(nvs_lz_rd_t rd, void *ctx, size_t in_len, uint8_t *out,
+			  size_t out_len);
+#endif
+
 // BUILD_ASSERT(offsetof(struct nvs_ate, crc8) ==
 // 		 sizeof(struct nvs_ate) - sizeof(uint8_t),
 // 		 "crc8 must be the last member");
@@ -0,0 +1,175 @@
+/*  NVS stream set: hot/cold write streams over several NVS file systems
+ *
+ * Copyright (c) 2024 imwoo90
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <nvs_stream.h>
+#include "nvs_priv.h"
+
+/* learn the stream of id from the number of writes it received */
+static uint8_t nvs_stream_learn(struct nvs_stream_set *set, nvs_id_t id)
+{
+	uint8_t *heat;
+
+	if (!set->heat) {
+		return 0;
+	}
+
+	heat = &set->heat[id % set->heat_size];
+	if (*heat < UINT8_MAX) {
+		(*heat)++;
+	}
+
+	/* age the counters so that ids that are no longer written cool down
+	 * and do not push new ids to a hotter stream
+	 */
+	if (++set->heat_age >= set->heat_size * set->heat_step) {
+		for (size_t i = 0; i < set->heat_size; i++) {
+			set->heat[i] >>= 1;
+		}
+		set->heat_age = 0U;
+	}
+
+	return MIN(*heat / set->heat_step, set->stream_count - 1);
+}
+
+/* find the hottest stream holding id, -ENOENT if there is none */
+static int nvs_stream_find(struct nvs_stream_set *set, nvs_id_t id)
+{
+	uint8_t probe;
+	ssize_t rc;
+
+	for (int i = set->stream_count - 1; i >= 0; i--) {
+		rc = nvs_read(set->streams[i], id, &probe, 0);
+		if (rc >= 0) {
+			return i;
+		}
+		if (rc != -ENOENT) {
+			return rc;
+		}
+	}
+
+	return -ENOENT;
+}
+
+int nvs_stream_mount(struct nvs_stream_set *set)
+{
+	int rc;
+
+	if (!set->streams || !set->stream_count) {
+		LOG_ERR("No streams");
+		return -EINVAL;
+	}
+
+	if (set->heat && (!set->heat_size || !set->heat_step)) {
+		LOG_ERR("Invalid stream heat configuration");
+		return -EINVAL;
+	}
+
+	for (uint8_t i = 0; i < set->stream_count; i++) {
+		rc = nvs_mount(set->streams[i]);
+		if (rc) {
+			return rc;
+		}
+	}
+
+	if (set->heat) {
+		memset(set->heat, 0, set->heat_size);
+	}
+	set->heat_age = 0U;
+
+	return 0;
+}
+
+ssize_t nvs_stream_write(struct nvs_stream_set *set, nvs_id_t id, const void *data,
+			 size_t len)
+{
+	int target, cur, del_rc;
+	ssize_t rc;
+
+	if (len == 0U) {
+		return nvs_stream_delete(set, id);
+	}
+
+	if (set->impl_classify) {
+		target = MIN(set->impl_classify(id), set->stream_count - 1);
+	} else {
+		target = nvs_stream_learn(set, id);
+	}
+
+	cur = nvs_stream_find(set, id);
+	if ((cur < 0) && (cur != -ENOENT)) {
+		return cur;
+	}
+
+	/* ids only move to hotter streams, see nvs_stream_read */
+	if (cur > target) {
+		target = cur;
+	}
+
+	rc = nvs_write(set->streams[target], id, data, len);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if ((cur >= 0) && (cur < target)) {
+		LOG_DBG("Moving %d to stream %d", id, target);
+		del_rc = nvs_delete(set->streams[cur], id);
+		if (del_rc < 0) {
+			return del_rc;
+		}
+	}
+
+	return rc;
+}
+
+int nvs_stream_delete(struct nvs_stream_set *set, nvs_id_t id)
+{
+	int rc;
+
+	for (uint8_t i = 0; i < set->stream_count; i++) {
+		rc = nvs_delete(set->streams[i], id);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+ssize_t nvs_stream_read(struct nvs_stream_set *set, nvs_id_t id, void *data, size_t len)
+{
+	ssize_t rc;
+
+	/* an interrupted move leaves the new value in a hotter stream and the
+	 * old one in a colder stream, the hottest copy is the most recent one
+	 */
+	for (int i = set->stream_count - 1; i >= 0; i--) {
+		rc = nvs_read(set->streams[i], id, data, len);
+		if (rc != -ENOENT) {
+			return rc;
+		}
+	}
+
+	return -ENOENT;
+}
+
+uint32_t nvs_stream_write_amp(const struct nvs_stream_set *set)
+{
+	uint64_t host_bytes = 0U, flash_bytes = 0U;
+
+	for (uint8_t i = 0; i < set->stream_count; i++) {
+		host_bytes += set->streams[i]->host_bytes;
+		flash_bytes += set->streams[i]->flash_bytes;
+	}
+
+	if (!host_bytes) {
+		return 0;
+	}
+
+	return (uint32_t)((flash_bytes * 100U) / host_bytes);
+}
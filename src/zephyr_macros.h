@@ -119,6 +119,9 @@ extern "C" {
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
+#ifndef __packed
+#define __packed __attribute__((__packed__))
+#endif
 
 #define LOG_DBG(...)
 #define LOG_INF(...)
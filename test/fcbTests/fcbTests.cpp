@@ -172,6 +172,54 @@ TEST(FCBTest, fcbTest)
     EXPECT_EQ(test_pop(), 0);
 }
 
+static int g_crc8_calls;
+
+static uint8_t counting_crc8(uint8_t seed, const void *buf, size_t len)
+{
+    g_crc8_calls++;
+    return crc8_rohc(seed, buf, len);
+}
+
+static const struct crc_provider counting_crc = {
+    .crc8 = counting_crc8,
+    .crc32 = crc32_c_update,
+};
+
+int count_cb(struct fcb_entry_ctx *loc_ctx, void *arg)
+{
+    (*(int *)arg)++;
+    return 0;
+}
+
+TEST(FCBTest, fcbCrcProvider)
+{
+    struct fcb fcb = {};
+    int cnt;
+
+    fcb.f_sector_size = 4096;
+    fcb.f_sector_cnt = 4;
+    fcb.impl_init = init_before_test;
+    fcb.f_crc = &counting_crc;
+    ASSERT_EQ(fcb_init(&fcb), 0);
+
+    g_crc8_calls = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        ASSERT_EQ(fcb_append_data(&fcb, "provider", 9), 0);
+    }
+    EXPECT_GT(g_crc8_calls, 0);
+
+    cnt = 0;
+    EXPECT_EQ(fcb_walk(&fcb, -1, count_cb, &cnt), 0);
+    EXPECT_EQ(cnt, 3);
+
+    /* the elements do not verify with other checksums */
+    fcb.f_crc = NULL;
+    cnt = 0;
+    EXPECT_EQ(fcb_walk(&fcb, -1, count_cb, &cnt), 0);
+    EXPECT_EQ(cnt, 0);
+}
+
 int main(int argc, char **argv)
 {
     ::testing::InitGoogleTest(&argc, argv);
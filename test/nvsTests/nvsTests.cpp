@@ -1,6 +1,16 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <fil.h>
 #include <nvs.h>
+#include <nvs.hpp>
+#include <nvs_image.h>
+#include <nvs_stream.h>
 
 static uint8_t flash_sim[4096*1024]; // 4M
 
@@ -12,7 +22,17 @@ int impl_write(off_t offset, const void *data, size_t len) {
     memcpy(flash_sim + offset, data, len);
     return 0;
 }
+/* when set, erases take a while so that concurrent readers overlap them */
+static std::atomic<bool> g_slow_erase(false);
+
 int impl_erase(off_t offset, size_t len) {
+    if (g_slow_erase.load()) {
+        for (size_t i = 0; i < len; i += 64) {
+            memset(flash_sim + offset + i, 0xff, std::min(len - i, (size_t)64));
+            std::this_thread::sleep_for(std::chrono::microseconds(1));
+        }
+        return 0;
+    }
     memset(flash_sim + offset, 0xff, len);
     return 0;
 }
@@ -23,8 +43,28 @@ struct fil g_fil = {
     .erase = impl_erase,
 };
 
+/* with CONFIG_NVS_FIXED_* nvs_mount() only accepts the configured geometry,
+ * the shared fixtures are built from it and the tests written for another
+ * geometry are skipped
+ */
+#ifdef CONFIG_NVS_FIXED_WRITE_BLOCK_SIZE
+#define FIXTURE_WRITE_BLOCK_SIZE(size) CONFIG_NVS_FIXED_WRITE_BLOCK_SIZE
+#else
+#define FIXTURE_WRITE_BLOCK_SIZE(size) (size)
+#endif
+#ifdef CONFIG_NVS_FIXED_SECTOR_SIZE
+#define FIXTURE_SECTOR_SIZE(size) CONFIG_NVS_FIXED_SECTOR_SIZE
+#else
+#define FIXTURE_SECTOR_SIZE(size) (size)
+#endif
+#ifdef CONFIG_NVS_FIXED_SECTOR_COUNT
+#define FIXTURE_SECTOR_COUNT(count) CONFIG_NVS_FIXED_SECTOR_COUNT
+#else
+#define FIXTURE_SECTOR_COUNT(count) (count)
+#endif
+
 struct flash_parameters g_fp = {
-    .write_block_size = 0x4,
+    .write_block_size = FIXTURE_WRITE_BLOCK_SIZE(0x4),
     .erase_value = 0xff,
 };
 
@@ -34,24 +74,55 @@ int init_before_test() {
     return 0;
 }
 
+static uint32_t g_lookup_cache[256];
+
 struct nvs_fs g_nvs = {
     .offset = 0,
-    .sector_size = 4096,
-    .sector_count = 1024,
+    .sector_size = FIXTURE_SECTOR_SIZE(4096),
+    .sector_count = FIXTURE_SECTOR_COUNT(1024),
     .impl_init = init_before_test,
     .impl_mutex_lock_forever = NULL,
-    .impl_mutex_unlock = NULL
+    .impl_mutex_unlock = NULL,
+    .lookup_cache = g_lookup_cache,
+    .lookup_cache_size = 256
 };
 
+static bool geometry_supported(const struct nvs_fs &fs,
+                               const struct flash_parameters &fp = g_fp) {
+    (void)fs;
+    (void)fp;
+#ifdef CONFIG_NVS_FIXED_WRITE_BLOCK_SIZE
+    if (fp.write_block_size != CONFIG_NVS_FIXED_WRITE_BLOCK_SIZE)
+        return false;
+#endif
+#ifdef CONFIG_NVS_FIXED_SECTOR_SIZE
+    if (fs.sector_size != CONFIG_NVS_FIXED_SECTOR_SIZE)
+        return false;
+#endif
+#ifdef CONFIG_NVS_FIXED_SECTOR_COUNT
+    if (fs.sector_count != CONFIG_NVS_FIXED_SECTOR_COUNT)
+        return false;
+#endif
+    return true;
+}
+
+#define SKIP_UNLESS_GEOMETRY(...)                                        \
+    do {                                                                 \
+        if (!geometry_supported(__VA_ARGS__))                            \
+            GTEST_SKIP() << "geometry differs from CONFIG_NVS_FIXED_*"; \
+    } while (0)
+
 int write_read() {
+    /* as many ids as a fixed geometry partition holds, up to 256 */
+    int ids = std::min<size_t>(256, g_nvs.sector_size * (g_nvs.sector_count - 1) / 48);
     char test_str_buf[100];
-    for (int i = 0; i < 256; i++) {
+    for (int i = 0; i < ids; i++) {
         int len = sprintf(test_str_buf, "hello test %d", i);
         nvs_write(&g_nvs, i, test_str_buf, len+1);
     }
 
     char check_str_buf[100];
-    for (int i = 0; i < 256; i++) {
+    for (int i = 0; i < ids; i++) {
         int len = sprintf(check_str_buf, "hello test %d", i);
         int read_len = nvs_read(&g_nvs, i, test_str_buf, sizeof(test_str_buf));
         
@@ -69,6 +140,2176 @@ TEST(NVSTest, nvsTest) {
     EXPECT_EQ(write_read(), 0);
 }
 
+int init_keep_flash() {
+    fil_init(&g_fil, &g_fp);
+    return 0;
+}
+
+/* small partition so that the random workload wraps around several times,
+ * with a small lookup cache so that ids collide in it
+ */
+void init_small_fs(struct nvs_fs *fs) {
+    static uint32_t cache[16];
+
+    memset(fs, 0, sizeof(*fs));
+    fs->offset = 0;
+    fs->sector_size = FIXTURE_SECTOR_SIZE(1024);
+    fs->sector_count = FIXTURE_SECTOR_COUNT(8);
+    fs->impl_init = init_keep_flash;
+    fs->lookup_cache = cache;
+    fs->lookup_cache_size = 16;
+}
+
+/* random writes, deletes and remounts checked against an in-memory model */
+int random_model(struct nvs_fs *fs, nvs_id_t id_base, int ops) {
+    std::map<nvs_id_t, std::vector<uint8_t>> model;
+    uint8_t buf[128], rd[128];
+
+    srand(1234);
+    for (int op = 0; op < ops; op++) {
+        nvs_id_t id = id_base + rand() % 24;
+        int action = rand() % 10;
+
+        if (action == 0) {
+            if (nvs_delete(fs, id))
+                return -__LINE__;
+            model.erase(id);
+        } else if (action == 1) {
+            if (nvs_mount(fs))
+                return -__LINE__;
+#ifdef CONFIG_NVS_CHECKPOINT
+        } else if (action == 2 && rand() % 4 == 0) {
+            /* the checkpoint does not fit in very small sectors and
+             * needs the lookup cache
+             */
+            int rc = nvs_checkpoint(fs);
+            if (rc && rc != -EINVAL && rc != -ENOTSUP)
+                return -__LINE__;
+#endif
+        } else {
+            size_t len = 1 + rand() % 64;
+            for (size_t i = 0; i < len; i++)
+                buf[i] = rand();
+            if (nvs_write(fs, id, buf, len) < 0)
+                return -__LINE__;
+            model[id].assign(buf, buf + len);
+        }
+
+        for (nvs_id_t chk = id_base; chk < id_base + 24; chk++) {
+            ssize_t rc = nvs_read(fs, chk, rd, sizeof(rd));
+            auto it = model.find(chk);
+            if (it == model.end()) {
+                if (rc != -ENOENT)
+                    return -__LINE__;
+                continue;
+            }
+            if (rc != (ssize_t)it->second.size() || memcmp(rd, it->second.data(), rc))
+                return -__LINE__;
+        }
+    }
+    return 0;
+}
+
+TEST(NVSTest, nvsRandomModel) {
+    struct nvs_fs fs;
+
+    init_small_fs(&fs);
+    init_before_test();
+    EXPECT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(random_model(&fs, 0, 3000), 0);
+
+    /* same workload without lookup cache */
+    init_small_fs(&fs);
+    fs.lookup_cache = NULL;
+    init_before_test();
+    EXPECT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(random_model(&fs, 0, 3000), 0);
+}
+
+/* value layout used by the concurrent test, the payload is derived from
+ * the header so that readers can check it is not torn
+ */
+struct concurrent_value {
+    uint32_t id;
+    uint32_t seq;
+    uint32_t len;
+    uint8_t payload[52];
+};
+
+static size_t concurrent_fill(struct concurrent_value *v, uint32_t id, uint32_t seq) {
+    v->id = id;
+    v->seq = seq;
+    v->len = 12 + (seq * 7 + id) % sizeof(v->payload);
+    for (size_t i = 0; i < v->len - 12; i++)
+        v->payload[i] = (uint8_t)(seq + id + i);
+    return v->len;
+}
+
+static bool concurrent_check(const struct concurrent_value *v, uint32_t id, ssize_t rc) {
+    if (rc < 12 || (size_t)rc != v->len || v->id != id)
+        return false;
+    for (size_t i = 0; i < v->len - 12; i++)
+        if (v->payload[i] != (uint8_t)(v->seq + id + i))
+            return false;
+    return true;
+}
+
+TEST(NVSTest, nvsConcurrentReaders) {
+    /* cold ids are written once and keep being moved by gc, hot ids are
+     * rewritten to force gc
+     */
+    const uint32_t cold = 12, ids = 16;
+    struct nvs_fs fs;
+    struct concurrent_value v;
+    std::atomic<bool> done(false);
+    std::atomic<int> bad(0);
+    std::vector<std::thread> readers;
+
+    init_small_fs(&fs);
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    g_slow_erase = true;
+    for (uint32_t id = 0; id < ids; id++) {
+        size_t len = concurrent_fill(&v, id, 0);
+        ASSERT_EQ(nvs_write(&fs, id, &v, len), (ssize_t)len);
+    }
+
+    for (int t = 0; t < 3; t++) {
+        readers.emplace_back([&, t]() {
+            struct concurrent_value r;
+            uint32_t id = t;
+            while (!done.load()) {
+                id = (id + 1) % ids;
+                ssize_t rc = nvs_read(&fs, id, &r, sizeof(r));
+                if (!concurrent_check(&r, id, rc))
+                    bad++;
+            }
+        });
+    }
+
+    /* a single writer, many sector erases happen under the readers */
+    for (uint32_t seq = 1; seq < 4000; seq++) {
+        uint32_t id = cold + seq % (ids - cold);
+        size_t len = concurrent_fill(&v, id, seq);
+        if (nvs_write(&fs, id, &v, len) != (ssize_t)len)
+            bad++;
+    }
+    done = true;
+    for (auto &r : readers)
+        r.join();
+    g_slow_erase = false;
+
+    EXPECT_EQ(bad.load(), 0);
+    EXPECT_GT(fs.erase_seq, 2U * fs.sector_count);
+}
+
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+static std::atomic<int> g_parallel_jobs;
+
+/* runs the jobs on a few threads taking indexes from a shared counter */
+static int thread_parallel(void (*job)(void *ctx, uint32_t idx), void *ctx,
+                           uint32_t count) {
+    std::atomic<uint32_t> next(0);
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < 4; t++) {
+        workers.emplace_back([&]() {
+            for (uint32_t i = next++; i < count; i = next++) {
+                job(ctx, i);
+                g_parallel_jobs++;
+            }
+        });
+    }
+    for (auto &w : workers)
+        w.join();
+    return 0;
+}
+
+#ifndef CONFIG_NVS_CHECKPOINT
+static int failing_parallel(void (*job)(void *ctx, uint32_t idx), void *ctx,
+                            uint32_t count) {
+    return -EIO;
+}
+#endif
+
+TEST(NVSTest, nvsParallelMount) {
+    struct nvs_fs fs;
+    uint32_t serial[16];
+    uint8_t val[40];
+
+    init_small_fs(&fs);
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    for (uint32_t i = 0; i < 400; i++) {
+        memset(val, i, sizeof(val));
+        ASSERT_EQ(nvs_write(&fs, i % 20, val, sizeof(val)), (ssize_t)sizeof(val));
+        if (i % 7 == 0) {
+            ASSERT_EQ(nvs_delete(&fs, (i / 7) % 20), 0);
+        }
+    }
+
+    /* the merged cache is the one of the walk from the write position */
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    memcpy(serial, fs.lookup_cache, sizeof(serial));
+    fs.impl_parallel = thread_parallel;
+    g_parallel_jobs = 0;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+#ifndef CONFIG_NVS_CHECKPOINT
+    /* a valid checkpoint is loaded instead */
+    EXPECT_EQ(g_parallel_jobs.load(), fs.sector_count);
+#endif
+    EXPECT_EQ(memcmp(serial, fs.lookup_cache, sizeof(serial)), 0);
+
+    /* a partition that has not wrapped yet */
+    init_small_fs(&fs);
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    for (uint32_t i = 0; i < 40; i++)
+        ASSERT_EQ(nvs_write(&fs, i, val, sizeof(val)), (ssize_t)sizeof(val));
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    memcpy(serial, fs.lookup_cache, sizeof(serial));
+    fs.impl_parallel = thread_parallel;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(memcmp(serial, fs.lookup_cache, sizeof(serial)), 0);
+
+    EXPECT_EQ(random_model(&fs, 50, 1000), 0);
+
+#ifdef CONFIG_NVS_GC_POLICY
+    static struct nvs_sector_info info[8];
+
+    init_small_fs(&fs);
+    fs.sector_info = info;
+    fs.impl_parallel = thread_parallel;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(random_model(&fs, 0, 2000), 0);
+#endif
+
+#ifndef CONFIG_NVS_CHECKPOINT
+    fs.impl_parallel = failing_parallel;
+    EXPECT_EQ(nvs_mount(&fs), -EIO);
+#endif
+}
+#endif
+
+#ifdef CONFIG_NVS_WRITE_BACK
+static uint32_t g_uptime_ms;
+
+static uint32_t fake_uptime_ms() {
+    return g_uptime_ms;
+}
+
+TEST(NVSTest, nvsWriteBack) {
+    static uint8_t slot_buf[8];
+    struct nvs_wb_slot slot = {};
+    struct nvs_fs fs;
+    uint32_t val, ate_wra;
+
+    slot.id = 7;
+    slot.data = slot_buf;
+    slot.size = sizeof(slot_buf);
+
+    init_small_fs(&fs);
+    fs.wb_slots = &slot;
+    fs.wb_slot_count = 1;
+    fs.impl_uptime_ms = fake_uptime_ms;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+
+    val = 1;
+    ASSERT_EQ(nvs_write(&fs, 7, &val, sizeof(val)), (ssize_t)sizeof(val));
+    ASSERT_EQ(nvs_sync(&fs), 0);
+
+    /* repeated updates stay in RAM and are visible to readers */
+    ate_wra = fs.ate_wra;
+    for (val = 2; val < 1000; val++)
+        ASSERT_EQ(nvs_write(&fs, 7, &val, sizeof(val)), (ssize_t)sizeof(val));
+    EXPECT_EQ(fs.ate_wra, ate_wra);
+    EXPECT_EQ(nvs_read(&fs, 7, &val, sizeof(val)), (ssize_t)sizeof(val));
+    EXPECT_EQ(val, 999U);
+    EXPECT_EQ(nvs_read_hist(&fs, 7, &val, sizeof(val), 1), (ssize_t)sizeof(val));
+    EXPECT_EQ(val, 1U);
+
+    /* only the last value is flushed and survives a remount */
+    ASSERT_EQ(nvs_sync(&fs), 0);
+    EXPECT_NE(fs.ate_wra, ate_wra);
+    ate_wra = fs.ate_wra;
+    ASSERT_EQ(nvs_sync(&fs), 0);
+    EXPECT_EQ(fs.ate_wra, ate_wra);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_read(&fs, 7, &val, sizeof(val)), (ssize_t)sizeof(val));
+    EXPECT_EQ(val, 999U);
+
+    /* age threshold */
+    fs.wb_max_age_ms = 100;
+    val = 1000;
+    ASSERT_EQ(nvs_write(&fs, 7, &val, sizeof(val)), (ssize_t)sizeof(val));
+    EXPECT_EQ(fs.ate_wra, ate_wra);
+    g_uptime_ms += 100;
+    val = 1001;
+    ASSERT_EQ(nvs_write(&fs, 7, &val, sizeof(val)), (ssize_t)sizeof(val));
+    EXPECT_NE(fs.ate_wra, ate_wra);
+    EXPECT_FALSE(slot.dirty);
+
+    /* a value that is not written again is flushed by polling */
+    ate_wra = fs.ate_wra;
+    val = 1010;
+    ASSERT_EQ(nvs_write(&fs, 7, &val, sizeof(val)), (ssize_t)sizeof(val));
+    g_uptime_ms += 99;
+    EXPECT_EQ(nvs_sync_poll(&fs), 0);
+    EXPECT_TRUE(slot.dirty);
+    EXPECT_EQ(fs.ate_wra, ate_wra);
+    g_uptime_ms += 1;
+    EXPECT_EQ(nvs_sync_poll(&fs), 1);
+    EXPECT_FALSE(slot.dirty);
+    EXPECT_NE(fs.ate_wra, ate_wra);
+    EXPECT_EQ(nvs_sync_poll(&fs), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_read(&fs, 7, &val, sizeof(val)), (ssize_t)sizeof(val));
+    EXPECT_EQ(val, 1010U);
+
+    /* deletes are written through and drop the pending value */
+    val = 1002;
+    ASSERT_EQ(nvs_write(&fs, 7, &val, sizeof(val)), (ssize_t)sizeof(val));
+    ASSERT_EQ(nvs_delete(&fs, 7), 0);
+    EXPECT_EQ(nvs_read(&fs, 7, &val, sizeof(val)), -ENOENT);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_read(&fs, 7, &val, sizeof(val)), -ENOENT);
+}
+#endif
+
+#ifdef CONFIG_NVS_COMPRESS
+TEST(NVSTest, nvsCompress) {
+    static uint8_t lz_buf[512];
+    struct nvs_fs fs;
+    uint8_t sparse[300], val[300], rd[300];
+    uint32_t data_wra;
+
+    init_small_fs(&fs);
+    fs.lz_buf = lz_buf;
+    fs.lz_buf_size = sizeof(lz_buf);
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+
+    /* sparse struct like value */
+    memset(val, 0, sizeof(val));
+    for (size_t i = 0; i < sizeof(val); i += 25)
+        val[i] = (uint8_t)i;
+    memcpy(sparse, val, sizeof(val));
+    data_wra = fs.data_wra;
+    ASSERT_EQ(nvs_write(&fs, 1, val, sizeof(val)), (ssize_t)sizeof(val));
+    EXPECT_LT(fs.data_wra - data_wra, sizeof(val) / 3);
+    EXPECT_EQ(nvs_read(&fs, 1, rd, sizeof(rd)), (ssize_t)sizeof(val));
+    EXPECT_EQ(memcmp(val, rd, sizeof(val)), 0);
+
+    /* partial read */
+    memset(rd, 0xaa, sizeof(rd));
+    EXPECT_EQ(nvs_read(&fs, 1, rd, 60), (ssize_t)sizeof(val));
+    EXPECT_EQ(memcmp(val, rd, 60), 0);
+    EXPECT_EQ(rd[60], 0xaa);
+
+    /* rewriting the same value is detected on the stored form */
+    EXPECT_EQ(nvs_write(&fs, 1, val, sizeof(val)), 0);
+
+    /* incompressible data is stored as is */
+    srand(3);
+    for (size_t i = 0; i < sizeof(val); i++)
+        val[i] = rand();
+    data_wra = fs.data_wra;
+    ASSERT_EQ(nvs_write(&fs, 2, val, sizeof(val)), (ssize_t)sizeof(val));
+    EXPECT_GE(fs.data_wra - data_wra, sizeof(val));
+    EXPECT_EQ(nvs_read(&fs, 2, rd, sizeof(rd)), (ssize_t)sizeof(val));
+    EXPECT_EQ(memcmp(val, rd, sizeof(val)), 0);
+
+    /* compressed entries survive gc and remounts */
+    EXPECT_EQ(random_model(&fs, 10, 2000), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_read(&fs, 1, rd, sizeof(rd)), (ssize_t)sizeof(sparse));
+    EXPECT_EQ(memcmp(sparse, rd, sizeof(sparse)), 0);
+    EXPECT_EQ(nvs_read(&fs, 2, rd, sizeof(rd)), (ssize_t)sizeof(val));
+    EXPECT_EQ(memcmp(val, rd, sizeof(val)), 0);
+}
+#endif
+
+/* static calibration like ids are written once, a few counters are
+ * rewritten all the time
+ */
+static int hot_cold_workload(struct nvs_stream_set *set, struct nvs_fs *fs) {
+    uint8_t buf[40];
+
+    for (nvs_id_t id = 0; id < 12; id++) {
+        memset(buf, id, sizeof(buf));
+        if (set ? nvs_stream_write(set, id, buf, sizeof(buf)) < 0 :
+                  nvs_write(fs, id, buf, sizeof(buf)) < 0)
+            return -__LINE__;
+    }
+    for (uint32_t i = 0; i < 2000; i++) {
+        nvs_id_t id = 100 + i % 3;
+        memset(buf, i, sizeof(buf));
+        if (set ? nvs_stream_write(set, id, buf, 8) < 0 :
+                  nvs_write(fs, id, buf, 8) < 0)
+            return -__LINE__;
+    }
+    for (nvs_id_t id = 0; id < 12; id++) {
+        if ((set ? nvs_stream_read(set, id, buf, sizeof(buf)) :
+                   nvs_read(fs, id, buf, sizeof(buf))) != sizeof(buf))
+            return -__LINE__;
+        if (buf[0] != id || buf[sizeof(buf) - 1] != id)
+            return -__LINE__;
+    }
+    for (nvs_id_t id = 100; id < 103; id++) {
+        if ((set ? nvs_stream_read(set, id, buf, sizeof(buf)) :
+                   nvs_read(fs, id, buf, sizeof(buf))) != 8)
+            return -__LINE__;
+    }
+    return 0;
+}
+
+static uint8_t hot_cold_classify(nvs_id_t id) {
+    return id >= 100 ? 1 : 0;
+}
+
+TEST(NVSTest, nvsStreams) {
+    struct nvs_fs single, cold, hot;
+    struct nvs_fs *streams[] = { &cold, &hot };
+    struct nvs_stream_set set = {};
+    uint8_t heat[16];
+    uint32_t single_wa, stream_wa;
+
+    /* baseline: one write stream over the same amount of flash. The streams
+     * split it into partitions of 3 sectors, which a fixed sector count
+     * does not allow.
+     */
+    init_small_fs(&single);
+    single.sector_count = 6;
+    SKIP_UNLESS_GEOMETRY(single);
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&single), 0);
+    ASSERT_EQ(hot_cold_workload(NULL, &single), 0);
+    single_wa = nvs_write_amp(&single);
+
+    /* only values that reach flash count as host writes */
+    uint64_t host_bytes = single.host_bytes;
+    uint32_t value = 0x5a5a5a5a;
+    ASSERT_EQ(nvs_write(&single, 200, &value, sizeof(value)), sizeof(value));
+    EXPECT_EQ(single.host_bytes, host_bytes + sizeof(value));
+    ASSERT_EQ(nvs_write(&single, 200, &value, sizeof(value)), 0);
+    EXPECT_EQ(single.host_bytes, host_bytes + sizeof(value));
+
+    /* hinted streams */
+    init_small_fs(&cold);
+    cold.sector_count = 3;
+    init_small_fs(&hot);
+    hot.lookup_cache = NULL;
+    hot.offset = 3 * 1024;
+    hot.sector_count = 3;
+    set.streams = streams;
+    set.stream_count = 2;
+    set.impl_classify = hot_cold_classify;
+    init_before_test();
+    ASSERT_EQ(nvs_stream_mount(&set), 0);
+    ASSERT_EQ(hot_cold_workload(&set, NULL), 0);
+    stream_wa = nvs_stream_write_amp(&set);
+    EXPECT_LT(stream_wa, single_wa);
+
+    /* learned streams: the counters move to the hot stream */
+    set.impl_classify = NULL;
+    set.heat = heat;
+    set.heat_size = sizeof(heat);
+    set.heat_step = 4;
+    init_before_test();
+    ASSERT_EQ(nvs_stream_mount(&set), 0);
+    ASSERT_EQ(hot_cold_workload(&set, NULL), 0);
+    EXPECT_LT(nvs_stream_write_amp(&set), single_wa);
+    uint8_t buf[8];
+    EXPECT_EQ(nvs_read(&hot, 100, buf, sizeof(buf)), 8);
+    EXPECT_EQ(nvs_read(&cold, 100, buf, sizeof(buf)), -ENOENT);
+    EXPECT_EQ(nvs_read(&cold, 1, buf, sizeof(buf)), 8 * 5);
+
+    /* the hottest copy wins after a remount, deletes reach all streams */
+    ASSERT_EQ(nvs_stream_mount(&set), 0);
+    EXPECT_EQ(hot_cold_workload(&set, NULL), 0);
+    EXPECT_EQ(nvs_stream_delete(&set, 100), 0);
+    EXPECT_EQ(nvs_stream_read(&set, 100, buf, sizeof(buf)), -ENOENT);
+}
+
+static int g_read_calls, g_copy_calls;
+
+int counting_read(off_t offset, void *data, size_t len) {
+    g_read_calls++;
+    return impl_read(offset, data, len);
+}
+
+int impl_copy(off_t src, off_t dst, size_t len) {
+    g_copy_calls++;
+    memcpy(flash_sim + dst, flash_sim + src, len);
+    return 0;
+}
+
+struct fil g_counting_fil = {
+    .read = counting_read,
+    .write = impl_write,
+    .erase = impl_erase,
+};
+
+int init_counting() {
+    fil_init(&g_counting_fil, &g_fp);
+    return 0;
+}
+
+/* large cold values that gc keeps moving, with a hot counter */
+static int gc_move_workload(struct nvs_fs *fs) {
+    uint8_t val[300], rd[300];
+    /* enough small writes to wrap around the partition */
+    uint32_t writes = fs->sector_size * fs->sector_count / 12;
+
+    for (nvs_id_t id = 0; id < 4; id++) {
+        memset(val, id, sizeof(val));
+        if (nvs_write(fs, id, val, sizeof(val)) < 0)
+            return -__LINE__;
+    }
+    for (uint32_t i = 0; i < writes; i++) {
+        if (nvs_write(fs, 10, &i, sizeof(i)) < 0)
+            return -__LINE__;
+    }
+    for (nvs_id_t id = 0; id < 4; id++) {
+        memset(val, id, sizeof(val));
+        if (nvs_read(fs, id, rd, sizeof(rd)) != sizeof(rd) || memcmp(val, rd, sizeof(rd)))
+            return -__LINE__;
+    }
+    return 0;
+}
+
+TEST(NVSTest, nvsGcBuffer) {
+    static uint8_t gc_buf[512];
+    struct nvs_fs fs;
+    int small_reads;
+
+    init_small_fs(&fs);
+    fs.impl_init = init_counting;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    g_read_calls = 0;
+    ASSERT_EQ(gc_move_workload(&fs), 0);
+    small_reads = g_read_calls;
+
+    /* a large buffer moves each value in one read */
+    init_small_fs(&fs);
+    fs.impl_init = init_counting;
+    fs.gc_buf = gc_buf;
+    fs.gc_buf_size = sizeof(gc_buf);
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    g_read_calls = 0;
+    ASSERT_EQ(gc_move_workload(&fs), 0);
+    EXPECT_LT(g_read_calls, small_reads);
+    EXPECT_EQ(random_model(&fs, 20, 1000), 0);
+
+    /* the device copies by itself */
+    g_counting_fil.copy = impl_copy;
+    init_small_fs(&fs);
+    fs.impl_init = init_counting;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    g_read_calls = 0;
+    g_copy_calls = 0;
+    ASSERT_EQ(gc_move_workload(&fs), 0);
+    EXPECT_GT(g_copy_calls, 0);
+    EXPECT_LT(g_read_calls, small_reads);
+    EXPECT_EQ(random_model(&fs, 20, 1000), 0);
+    g_counting_fil.copy = NULL;
+
+    fs.gc_buf = gc_buf;
+    fs.gc_buf_size = 2;
+    EXPECT_EQ(nvs_mount(&fs), -EINVAL);
+}
+
+/* mount time and flash reads per mount with the write sector in a given
+ * state
+ */
+static int mount_bench(const char *name, struct nvs_fs *fs) {
+    const int runs = 20;
+    auto start = std::chrono::steady_clock::now();
+
+    g_read_calls = 0;
+    for (int i = 0; i < runs; i++) {
+        if (nvs_mount(fs))
+            return -1;
+    }
+    auto us = std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - start).count();
+    printf("mount %-8s %8.2f us/sector %6d reads\n", name,
+           us / runs / fs->sector_count, g_read_calls / runs);
+    return g_read_calls / runs;
+}
+
+TEST(NVSTest, nvsMountBench) {
+    struct nvs_fs fs;
+    uint8_t val[64];
+    uint32_t data_wra;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.sector_size = FIXTURE_SECTOR_SIZE(4096);
+    fs.sector_count = FIXTURE_SECTOR_COUNT(4);
+    fs.impl_init = init_counting;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    /* the table is searched, only the free space is read in full */
+    EXPECT_LT(mount_bench("empty", &fs), 400);
+
+    memset(val, 0x3c, sizeof(val));
+    for (nvs_id_t id = 0; id < 20; id++) {
+        ASSERT_EQ(nvs_write(&fs, id, val, sizeof(val)), (ssize_t)sizeof(val));
+    }
+    EXPECT_LT(mount_bench("partial", &fs), 400);
+
+    /* data programmed after the last ate, as after a power loss */
+    data_wra = fs.data_wra;
+    ASSERT_LT(data_wra + 1024, fs.sector_size);
+    memset(flash_sim + data_wra, 0x5a, 1024);
+    EXPECT_LT(mount_bench("orphan", &fs), 400);
+    EXPECT_EQ(fs.data_wra, data_wra + 1024);
+    uint8_t rd[64];
+    EXPECT_EQ(nvs_read(&fs, 19, rd, sizeof(rd)), (ssize_t)sizeof(rd));
+    EXPECT_EQ(memcmp(val, rd, sizeof(rd)), 0);
+}
+
+/* values made of copies of a valid ate, the write pointer search at mount
+ * probes into them and must not take them for allocation table entries
+ */
+TEST(NVSTest, nvsAteLookalikeData) {
+    struct nvs_fs fs;
+    uint8_t ate[16], val[1024], rd[1024];
+    uint32_t ate_wra, data_wra, ate_size;
+    nvs_id_t id;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.sector_size = FIXTURE_SECTOR_SIZE(4096);
+    fs.sector_count = FIXTURE_SECTOR_COUNT(4);
+    fs.impl_init = init_keep_flash;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    ASSERT_LT(fs.ate_wra, fs.sector_size);
+
+    ate_wra = fs.ate_wra;
+    val[0] = 0x11;
+    ASSERT_EQ(nvs_write(&fs, 0, val, 4), 4);
+    ate_size = ate_wra - fs.ate_wra;
+    ASSERT_LE(ate_size, sizeof(ate));
+    memcpy(ate, flash_sim + ate_wra, ate_size);
+
+    /* fill the sector, the last value reaches the allocation table */
+    for (id = 1; ; id++) {
+        size_t len = 380;
+
+        ate_wra = fs.ate_wra;
+        data_wra = fs.data_wra;
+        if (ate_wra - data_wra < 2 * len) {
+            /* the value, its data crc and the ate of a delete */
+            len = ate_wra - data_wra - ate_size - 4;
+        }
+        for (size_t i = 0; i < len; i++) {
+            val[i] = ate[(data_wra + i - ate_wra) % ate_size];
+        }
+        ASSERT_EQ(nvs_write(&fs, id, val, len), (ssize_t)len);
+        ASSERT_LT(fs.ate_wra, fs.sector_size);
+        if (len != 380) {
+            break;
+        }
+    }
+
+    ate_wra = fs.ate_wra;
+    data_wra = fs.data_wra;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(fs.ate_wra, ate_wra);
+    EXPECT_EQ(fs.data_wra, data_wra);
+
+    /* a write after the remount must not corrupt the table */
+    memset(val, 0x22, 16);
+    ASSERT_EQ(nvs_write(&fs, id + 1, val, 16), 16);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_read(&fs, id + 1, rd, sizeof(rd)), 16);
+    EXPECT_EQ(memcmp(val, rd, 16), 0);
+    for (nvs_id_t i = 1; i <= id; i++) {
+        EXPECT_GT(nvs_read(&fs, i, rd, sizeof(rd)), 0);
+    }
+}
+
+#if CONFIG_NVS_ATE_READ_AHEAD >= 64
+TEST(NVSTest, nvsAteReadAhead) {
+    struct nvs_fs fs;
+    uint8_t val[16];
+    int entries = 60;
+
+    init_small_fs(&fs);
+    fs.lookup_cache = NULL;
+    fs.impl_init = init_counting;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    for (int i = 0; i < entries; i++) {
+        memset(val, i, sizeof(val));
+        ASSERT_EQ(nvs_write(&fs, i, val, sizeof(val)), (ssize_t)sizeof(val));
+    }
+
+    /* the oldest entry is found after walking through all of them */
+    g_read_calls = 0;
+    EXPECT_EQ(nvs_read(&fs, 0, val, sizeof(val)), (ssize_t)sizeof(val));
+    EXPECT_EQ(val[0], 0);
+    EXPECT_LT(g_read_calls, entries / 4);
+
+    /* one walk per entry */
+    g_read_calls = 0;
+    EXPECT_GT(nvs_calc_free_space(&fs), 0);
+    EXPECT_LT(g_read_calls, entries * entries / 4);
+
+    EXPECT_EQ(random_model(&fs, 100, 1000), 0);
+}
+#endif
+
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+TEST(NVSTest, nvsLazyLookupCache) {
+    static uint32_t cache[64];
+    uint32_t serial[64];
+    struct nvs_fs fs;
+    uint8_t val[32];
+    int full_reads, lazy_reads, steps, rc;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.sector_size = FIXTURE_SECTOR_SIZE(4096);
+    fs.sector_count = FIXTURE_SECTOR_COUNT(64);
+    fs.impl_init = init_counting;
+    fs.lookup_cache = cache;
+    fs.lookup_cache_size = 64;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    for (uint32_t i = 0; i < 5000; i++) {
+        memset(val, i, sizeof(val));
+        ASSERT_EQ(nvs_write(&fs, i % 300, val, sizeof(val)), (ssize_t)sizeof(val));
+    }
+
+    g_read_calls = 0;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    full_reads = g_read_calls;
+    memcpy(serial, cache, sizeof(serial));
+
+    /* only the write position is recovered */
+    fs.lookup_cache_lazy = true;
+    g_read_calls = 0;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    lazy_reads = g_read_calls;
+    EXPECT_LE(lazy_reads, full_reads);
+#if !defined(CONFIG_NVS_CHECKPOINT_ON_SECTOR_CLOSE) && !defined(CONFIG_NVS_FIXED_SECTOR_COUNT)
+    /* unless both load the cache from a checkpoint. What the full index
+     * costs grows with the sector count, a fixed count of a few sectors
+     * leaves little to save.
+     */
+    EXPECT_LT(lazy_reads * 2, full_reads);
+#endif
+
+    /* recent ids not indexed yet only index the newest sectors */
+    g_read_calls = 0;
+    EXPECT_EQ(nvs_read(&fs, 99, val, sizeof(val)), (ssize_t)sizeof(val));
+    EXPECT_EQ(val[0], 4899 & 0xff);
+    EXPECT_EQ(nvs_read(&fs, 100, val, sizeof(val)), (ssize_t)sizeof(val));
+    EXPECT_EQ(val[0], 4900 & 0xff);
+#ifndef CONFIG_NVS_CHECKPOINT_ON_SECTOR_CLOSE
+    EXPECT_LT(g_read_calls * 8, full_reads);
+    EXPECT_NE(fs.lookup_cache_next, 0xffffffffU);
+#endif
+
+    steps = 0;
+    while ((rc = nvs_lookup_cache_step(&fs)) == 1)
+        steps++;
+    EXPECT_EQ(rc, 0);
+#ifndef CONFIG_NVS_CHECKPOINT_ON_SECTOR_CLOSE
+    EXPECT_GT(steps, 1);
+#endif
+    EXPECT_EQ(fs.lookup_cache_next, 0xffffffffU);
+    EXPECT_EQ(memcmp(serial, cache, sizeof(serial)), 0);
+    EXPECT_EQ(nvs_read(&fs, 300, val, sizeof(val)), -ENOENT);
+
+    /* garbage collection while the cache is being built */
+    init_small_fs(&fs);
+    fs.lookup_cache_lazy = true;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(random_model(&fs, 400, 2000), 0);
+}
+#endif
+
+static int vector_sink_write(void *ctx, const void *data, size_t len) {
+    auto *image = static_cast<std::vector<uint8_t> *>(ctx);
+    image->insert(image->end(), (const uint8_t *)data, (const uint8_t *)data + len);
+    return 0;
+}
+
+struct image_cursor {
+    const std::vector<uint8_t> *image;
+    size_t pos;
+};
+
+static ssize_t cursor_read(void *ctx, void *data, size_t len) {
+    auto *cur = static_cast<struct image_cursor *>(ctx);
+    len = std::min(len, cur->image->size() - cur->pos);
+    memcpy(data, cur->image->data() + cur->pos, len);
+    cur->pos += len;
+    return len;
+}
+
+static int g_write_calls;
+
+int counting_write(off_t offset, const void *data, size_t len) {
+    g_write_calls++;
+    return impl_write(offset, data, len);
+}
+
+struct fil g_write_counting_fil = {
+    .read = impl_read,
+    .write = counting_write,
+    .erase = impl_erase,
+};
+
+int init_write_counting() {
+    fil_init(&g_write_counting_fil, &g_fp);
+    return 0;
+}
+
+TEST(NVSTest, nvsExportImport) {
+    std::map<nvs_id_t, std::vector<uint8_t>> model;
+    std::vector<uint8_t> image;
+    static uint8_t value_buf[512], stage[1024];
+    struct nvs_image_sink sink = { vector_sink_write, &image, value_buf, sizeof(value_buf) };
+    struct image_cursor cur = { &image, 0 };
+    struct nvs_image_source source = { cursor_read, &cur, stage, sizeof(stage) };
+    struct nvs_fs fs;
+    struct nvs_stats stats, st, remount;
+    uint8_t val[300], rd[300];
+    int writes_one_by_one;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.sector_size = FIXTURE_SECTOR_SIZE(4096);
+    fs.sector_count = FIXTURE_SECTOR_COUNT(16);
+    fs.impl_init = init_write_counting;
+    fs.lookup_cache = g_lookup_cache;
+    fs.lookup_cache_size = 256;
+    memset(&stats, 0, sizeof(stats));
+    fs.stats = &stats;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+
+    /* values of all sizes, rewritten and deleted so that gc runs */
+    srand(42);
+    for (int i = 0; i < 3000; i++) {
+        nvs_id_t id = rand() % 150;
+        size_t len = 1 + rand() % (id < 10 ? sizeof(val) : 40);
+        if (rand() % 8 == 0) {
+            ASSERT_EQ(nvs_delete(&fs, id), 0);
+            model.erase(id);
+            continue;
+        }
+        for (size_t j = 0; j < len; j++)
+            val[j] = rand();
+        ASSERT_EQ(nvs_write(&fs, id, val, len), (ssize_t)len);
+        model[id].assign(val, val + len);
+    }
+
+    ASSERT_EQ(nvs_export(&fs, &sink), 0);
+    size_t records = 0;
+    for (size_t pos = 0; pos < image.size(); records++) {
+        struct nvs_image_rec rec;
+        memcpy(&rec, &image[pos], sizeof(rec));
+        ASSERT_TRUE(model.count(rec.id));
+        ASSERT_EQ(rec.len, model[rec.id].size());
+        EXPECT_EQ(memcmp(&image[pos + sizeof(rec)], model[rec.id].data(), rec.len), 0);
+        pos += sizeof(rec) + rec.len;
+    }
+    EXPECT_EQ(records, model.size());
+
+    /* only into an empty file system */
+    EXPECT_EQ(nvs_import(&fs, &source), -ENOTEMPTY);
+
+    /* the same entries written one by one */
+    ASSERT_EQ(nvs_clear(&fs), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    g_write_calls = 0;
+    for (auto &kv : model)
+        ASSERT_EQ(nvs_write(&fs, kv.first, kv.second.data(), kv.second.size()),
+                  (ssize_t)kv.second.size());
+    writes_one_by_one = g_write_calls;
+
+    ASSERT_EQ(nvs_clear(&fs), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    g_write_calls = 0;
+    ASSERT_EQ(nvs_import(&fs, &source), 0);
+    EXPECT_LT(g_write_calls * 4, writes_one_by_one);
+
+    /* the statistics are kept up to date by the import */
+    ASSERT_EQ(nvs_stats_get(&fs, &st), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    ASSERT_EQ(nvs_stats_get(&fs, &remount), 0);
+    EXPECT_EQ(st.live_bytes, remount.live_bytes);
+    EXPECT_EQ(st.tombstones, remount.tombstones);
+    for (nvs_id_t id = 0; id < 150; id++) {
+        ssize_t rc = nvs_read(&fs, id, rd, sizeof(rd));
+        if (!model.count(id)) {
+            EXPECT_EQ(rc, -ENOENT);
+            continue;
+        }
+        ASSERT_EQ(rc, (ssize_t)model[id].size());
+        EXPECT_EQ(memcmp(rd, model[id].data(), rc), 0);
+    }
+    memset(val, 0x11, sizeof(val));
+    EXPECT_EQ(nvs_write(&fs, 7, val, 100), 100);
+
+    /* the last record of an id wins */
+    std::vector<uint8_t> twice;
+    for (uint32_t v : { 1U, 2U }) {
+        struct nvs_image_rec rec = { 500, sizeof(v) };
+        vector_sink_write(&twice, &rec, sizeof(rec));
+        vector_sink_write(&twice, &v, sizeof(v));
+    }
+    struct image_cursor twice_cur = { &twice, 0 };
+    struct nvs_image_source twice_src = { cursor_read, &twice_cur, NULL, 0 };
+    uint32_t v;
+    ASSERT_EQ(nvs_clear(&fs), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    ASSERT_EQ(nvs_import(&fs, &twice_src), 0);
+    EXPECT_EQ(nvs_read(&fs, 500, &v, sizeof(v)), (ssize_t)sizeof(v));
+    EXPECT_EQ(v, 2U);
+    ASSERT_EQ(nvs_stats_get(&fs, &st), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    ASSERT_EQ(nvs_stats_get(&fs, &remount), 0);
+    EXPECT_EQ(st.live_bytes, remount.live_bytes);
+
+    /* a value larger than what is left of the stage after small records */
+    std::vector<uint8_t> staged;
+    for (nvs_id_t id : { 1U, 2U, 3U, 4U }) {
+        struct nvs_image_rec rec = { id, id == 2 ? 100U : 4U };
+        memset(val, id, rec.len);
+        vector_sink_write(&staged, &rec, sizeof(rec));
+        vector_sink_write(&staged, val, rec.len);
+    }
+    struct image_cursor staged_cur = { &staged, 0 };
+    struct nvs_image_source staged_src = { cursor_read, &staged_cur, NULL, 0 };
+    ASSERT_EQ(nvs_clear(&fs), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    ASSERT_EQ(nvs_import(&fs, &staged_src), 0);
+    for (int remount = 0; remount < 2; remount++) {
+        for (nvs_id_t id : { 1U, 2U, 3U, 4U }) {
+            ASSERT_EQ(nvs_read(&fs, id, rd, sizeof(rd)), id == 2 ? 100 : 4) << id;
+            EXPECT_EQ(rd[0], id);
+        }
+        ASSERT_EQ(nvs_mount(&fs), 0);
+    }
+
+    /* truncated image */
+    twice.pop_back();
+    twice_cur.pos = 0;
+    ASSERT_EQ(nvs_clear(&fs), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_import(&fs, &twice_src), -EIO);
+
+    /* an image larger than the file system */
+    std::vector<uint8_t> large;
+    memset(val, 0x33, sizeof(val));
+    for (nvs_id_t id = 0; large.size() <= (size_t)fs.sector_size * fs.sector_count; id++) {
+        struct nvs_image_rec rec = { id, sizeof(val) };
+        vector_sink_write(&large, &rec, sizeof(rec));
+        vector_sink_write(&large, val, sizeof(val));
+    }
+    struct image_cursor large_cur = { &large, 0 };
+    struct nvs_image_source large_src = { cursor_read, &large_cur, stage, sizeof(stage) };
+    ASSERT_EQ(nvs_clear(&fs), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_import(&fs, &large_src), -ENOSPC);
+}
+
+#ifdef CONFIG_NVS_LOOKUP_CACHE
+/* a non-recursive mutex that gives up instead of deadlocking, a lock that
+ * times out is counted and its unlock skipped
+ */
+static std::timed_mutex g_fs_mutex;
+static thread_local int g_fs_mutex_timeouts, g_fs_mutex_skipped;
+
+static int timed_mutex_lock() {
+    if (!g_fs_mutex.try_lock_for(std::chrono::seconds(1))) {
+        g_fs_mutex_timeouts++;
+        g_fs_mutex_skipped++;
+    }
+    return 0;
+}
+
+static int timed_mutex_unlock() {
+    if (g_fs_mutex_skipped)
+        g_fs_mutex_skipped--;
+    else
+        g_fs_mutex.unlock();
+    return 0;
+}
+
+TEST(NVSTest, nvsExportLazyMount) {
+    std::vector<uint8_t> image;
+    static uint8_t value_buf[64];
+    struct nvs_image_sink sink = { vector_sink_write, &image, value_buf, sizeof(value_buf) };
+    struct nvs_fs fs;
+    uint8_t val[32];
+    int timeouts;
+
+    init_small_fs(&fs);
+    fs.impl_mutex_lock_forever = timed_mutex_lock;
+    fs.impl_mutex_unlock = timed_mutex_unlock;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    for (uint32_t i = 0; i < 200; i++) {
+        memset(val, i, sizeof(val));
+        ASSERT_EQ(nvs_write(&fs, i % 40, val, sizeof(val)), (ssize_t)sizeof(val));
+    }
+
+    /* export reads ids the cache does not hold yet with the mutex held */
+    fs.lookup_cache_lazy = true;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    ASSERT_EQ(nvs_export(&fs, &sink), 0);
+    timeouts = g_fs_mutex_timeouts;
+    g_fs_mutex_timeouts = 0;
+    EXPECT_EQ(timeouts, 0);
+    EXPECT_EQ(image.size(), 40 * (sizeof(struct nvs_image_rec) + sizeof(val)));
+}
+#endif
+
+TEST(NVSTest, nvsImageBuild) {
+    struct nvs_image_geometry geo = { 4096, 8, 4, 0xff };
+    static uint8_t image[4096 * 8];
+    uint8_t big[600], rd[600];
+    uint32_t v1 = 1, v2 = 2;
+    struct nvs_image_entry entries[] = {
+        { 1, &v1, sizeof(v1) },
+        { 2, big, sizeof(big) },
+        { 1, &v2, sizeof(v2) },
+        { 3, "abc", 3 },
+    };
+    struct nvs_fs fs;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.sector_size = geo.sector_size;
+    fs.sector_count = geo.sector_count;
+    SKIP_UNLESS_GEOMETRY(fs);
+
+    for (size_t i = 0; i < sizeof(big); i++)
+        big[i] = i * 7;
+
+    init_before_test();
+    /* geometry and image size must agree */
+    EXPECT_EQ(nvs_image_build(&geo, entries, 4, image, sizeof(image) - 1), -EINVAL);
+    ASSERT_EQ(nvs_image_build(&geo, entries, 4, image, sizeof(image)), 0);
+
+    /* the flash interface in use before is restored */
+    memcpy(flash_sim, image, sizeof(image));
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_read(&fs, 1, &v1, sizeof(v1)), (ssize_t)sizeof(v1));
+    EXPECT_EQ(v1, 2U);
+    ASSERT_EQ(nvs_read(&fs, 2, rd, sizeof(rd)), (ssize_t)sizeof(big));
+    EXPECT_EQ(memcmp(rd, big, sizeof(big)), 0);
+    ASSERT_EQ(nvs_read(&fs, 3, rd, sizeof(rd)), 3);
+    EXPECT_EQ(memcmp(rd, "abc", 3), 0);
+    EXPECT_EQ(nvs_read(&fs, 4, rd, sizeof(rd)), -ENOENT);
+    EXPECT_EQ(nvs_write(&fs, 4, big, 10), 10);
+
+    /* values that go past the stage of the builder */
+    struct nvs_image_entry staged[10];
+    for (int i = 0; i < 10; i++)
+        staged[i] = { (nvs_id_t)i, &big[i], 200 };
+    ASSERT_EQ(nvs_image_build(&geo, staged, 10, image, sizeof(image)), 0);
+    memcpy(flash_sim, image, sizeof(image));
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    for (int i = 0; i < 10; i++) {
+        ASSERT_EQ(nvs_read(&fs, i, rd, sizeof(rd)), 200) << i;
+        EXPECT_EQ(memcmp(rd, &big[i], 200), 0) << i;
+    }
+
+    /* more than the partition holds */
+    struct nvs_image_entry many[60];
+    for (int i = 0; i < 60; i++)
+        many[i] = { (nvs_id_t)i, big, sizeof(big) };
+    EXPECT_EQ(nvs_image_build(&geo, many, 60, image, sizeof(image)), -ENOSPC);
+}
+
+static std::vector<std::pair<nvs_id_t, int>> g_scrub_reports;
+
+static void record_scrub_report(nvs_id_t id, int err) {
+    g_scrub_reports.push_back({ id, err });
+}
+
+static uint8_t *find_in_flash(const uint8_t *data, size_t len) {
+    uint8_t *end = flash_sim + sizeof(flash_sim);
+    uint8_t *pos = std::search(flash_sim, end, data, data + len);
+    return pos == end ? NULL : pos;
+}
+
+TEST(NVSTest, nvsScrub) {
+    struct nvs_fs fs;
+    uint8_t val[3][64], rd[64];
+    int calls, rc;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.sector_size = FIXTURE_SECTOR_SIZE(4096);
+    fs.sector_count = FIXTURE_SECTOR_COUNT(4);
+    fs.lookup_cache = g_lookup_cache;
+    fs.lookup_cache_size = 256;
+    fs.impl_scrub_report = record_scrub_report;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+
+    /* ids 1 to 3 in the first sector, followed by enough updates of other
+     * ids to close it
+     */
+    srand(7);
+    for (int i = 0; i < 3; i++) {
+        for (size_t j = 0; j < sizeof(val[i]); j++)
+            val[i][j] = rand();
+        ASSERT_EQ(nvs_write(&fs, i + 1, val[i], sizeof(val[i])), (ssize_t)sizeof(val[i]));
+    }
+    for (int i = 0; i < 60; i++) {
+        for (size_t j = 0; j < sizeof(rd); j++)
+            rd[j] = rand();
+        ASSERT_EQ(nvs_write(&fs, 100 + i % 5, rd, sizeof(rd)), (ssize_t)sizeof(rd));
+    }
+
+    /* an intact file system, verified in small steps */
+    g_scrub_reports.clear();
+    calls = 0;
+    do {
+        rc = nvs_scrub(&fs, 64);
+        ASSERT_GE(rc, 0);
+        calls++;
+    } while (!rc);
+    EXPECT_GT(calls, 10);
+    EXPECT_TRUE(g_scrub_reports.empty());
+
+#ifdef CONFIG_NVS_DATA_CRC
+    /* bit rot in a value that is never read */
+    uint8_t *rot = find_in_flash(val[0], sizeof(val[0]));
+    ASSERT_NE(rot, nullptr);
+    rot[10] ^= 0x04;
+    while (!(rc = nvs_scrub(&fs, 256)))
+        ;
+    ASSERT_EQ(rc, 1);
+    ASSERT_EQ(g_scrub_reports.size(), 1U);
+    EXPECT_EQ(g_scrub_reports[0].first, 1U);
+    EXPECT_EQ(g_scrub_reports[0].second, -EIO);
+
+    /* the intact values of the sector are moved away from it */
+    fs.scrub_relocate = true;
+    uint8_t *weak = find_in_flash(val[1], sizeof(val[1]));
+    ASSERT_NE(weak, nullptr);
+    g_scrub_reports.clear();
+    while (!(rc = nvs_scrub(&fs, 256)))
+        ;
+    ASSERT_EQ(g_scrub_reports.size(), 1U);
+    weak[0] ^= 0x01;
+    EXPECT_EQ(nvs_read(&fs, 2, rd, sizeof(rd)), (ssize_t)sizeof(rd));
+    EXPECT_EQ(memcmp(rd, val[1], sizeof(rd)), 0);
+    EXPECT_EQ(nvs_read(&fs, 3, rd, sizeof(rd)), (ssize_t)sizeof(rd));
+    EXPECT_EQ(memcmp(rd, val[2], sizeof(rd)), 0);
+    EXPECT_EQ(nvs_read(&fs, 1, rd, sizeof(rd)), -EIO);
+#endif
+
+    /* a damaged allocation table entry, its crc8 is the last byte written */
+    std::vector<uint8_t> before(flash_sim, flash_sim + fs.sector_size * fs.sector_count);
+    ASSERT_EQ(nvs_write(&fs, 200, val[0], sizeof(val[0])), (ssize_t)sizeof(val[0]));
+    size_t last = before.size();
+    while (last && (flash_sim[last - 1] == before[last - 1]))
+        last--;
+    ASSERT_GT(last, 0U);
+    flash_sim[last - 1] ^= 0x10;
+    g_scrub_reports.clear();
+    while (!(rc = nvs_scrub(&fs, 256)))
+        ;
+    ASSERT_EQ(rc, 1);
+    EXPECT_TRUE(std::count(g_scrub_reports.begin(), g_scrub_reports.end(),
+                           std::make_pair((nvs_id_t)200, -EBADMSG)) == 1);
+
+    /* without a lookup cache, the walks that tell whether a value is live
+     * are bounded by the budget too
+     */
+    memset(&fs, 0, sizeof(fs));
+    fs.sector_size = FIXTURE_SECTOR_SIZE(4096);
+    fs.sector_count = FIXTURE_SECTOR_COUNT(4);
+    fs.impl_scrub_report = record_scrub_report;
+    init_before_test();
+    fs.impl_init = init_counting;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    for (int i = 0; i < 3; i++)
+        ASSERT_EQ(nvs_write(&fs, i + 1, val[i], sizeof(val[i])), (ssize_t)sizeof(val[i]));
+    for (uint32_t i = 0; i < 400; i++)
+        ASSERT_EQ(nvs_write(&fs, 100 + i % 5, &i, sizeof(i)), (ssize_t)sizeof(i));
+    g_scrub_reports.clear();
+    int max_reads = 0;
+    calls = 0;
+    do {
+        g_read_calls = 0;
+        rc = nvs_scrub(&fs, 64);
+        ASSERT_GE(rc, 0);
+        max_reads = std::max(max_reads, g_read_calls);
+        calls++;
+    } while (!rc);
+    EXPECT_LT(max_reads, 20);
+    EXPECT_TRUE(g_scrub_reports.empty());
+}
+
+/* random writes and deletes, st gets the counters kept up to date and
+ * remount the ones computed at the next mount
+ */
+static void stats_workload(struct nvs_fs *fs, struct nvs_stats *st, struct nvs_stats *remount) {
+    uint8_t val[200];
+
+    memset(val, 0x3c, sizeof(val));
+    for (int i = 0; i < 2000; i++) {
+        nvs_id_t id = rand() % 60;
+        if (rand() % 6 == 0) {
+            ASSERT_EQ(nvs_delete(fs, id), 0);
+            continue;
+        }
+        val[0] = i;
+        val[1] = i >> 8;
+        size_t len = 2 + rand() % (sizeof(val) - 1);
+        ASSERT_EQ(nvs_write(fs, id, val, len), (ssize_t)len);
+    }
+
+    ASSERT_EQ(nvs_stats_get(fs, st), 0);
+    ASSERT_EQ(nvs_mount(fs), 0);
+    ASSERT_EQ(nvs_stats_get(fs, remount), 0);
+    EXPECT_EQ(remount->live_bytes, st->live_bytes);
+    EXPECT_EQ(remount->dead_bytes, st->dead_bytes);
+    EXPECT_EQ(remount->tombstones, st->tombstones);
+    EXPECT_EQ(remount->closed_sectors, st->closed_sectors);
+    EXPECT_EQ(remount->gc_count, 0U);
+}
+
+TEST(NVSTest, nvsStats) {
+    struct nvs_fs fs;
+    struct nvs_stats stats, st, remount;
+    uint32_t erase_count[8] = { 0 };
+
+    memset(&fs, 0, sizeof(fs));
+    memset(&stats, 0, sizeof(stats));
+    stats.erase_count = erase_count;
+    fs.sector_size = 4096;
+    fs.sector_count = 8;
+    SKIP_UNLESS_GEOMETRY(fs);
+    fs.lookup_cache = g_lookup_cache;
+    fs.lookup_cache_size = 256;
+    init_before_test();
+    EXPECT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_stats_get(&fs, &st), -ENOTSUP);
+
+    fs.stats = &stats;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    ASSERT_EQ(nvs_stats_get(&fs, &st), 0);
+    EXPECT_EQ(st.live_bytes, 0U);
+    EXPECT_EQ(st.tombstones, 0U);
+
+    srand(11);
+    uint32_t erases = 0;
+    for (uint32_t n : erase_count)
+        erases += n;
+    stats_workload(&fs, &st, &remount);
+    EXPECT_GT(st.live_bytes, 0U);
+    EXPECT_GT(st.dead_bytes, 0U);
+    EXPECT_GT(st.tombstones, 0U);
+    EXPECT_GT(st.gc_count, 0U);
+    EXPECT_GT(st.gc_bytes, 0U);
+    EXPECT_LE(st.live_bytes + st.dead_bytes, 4096U * 8);
+
+    /* erase counters are kept across mounts */
+    uint32_t remount_erases = 0;
+    for (uint32_t n : erase_count)
+        remount_erases += n;
+    EXPECT_GE(remount_erases, erases + st.gc_count);
+
+#if CONFIG_NVS_ATE_READ_AHEAD >= 64
+    /* the liveness of entries comes from the lookup cache, computing the
+     * statistics keeps a mount linear in the number of entries
+     */
+    fs.impl_init = init_counting;
+    fs.stats = NULL;
+    g_read_calls = 0;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    int plain_reads = g_read_calls;
+    fs.stats = &stats;
+    g_read_calls = 0;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_LT(g_read_calls, 3 * plain_reads);
+    fs.impl_init = NULL;
+#endif
+
+#ifdef CONFIG_NVS_GC_POLICY
+    /* delete entries kept by the gc policy */
+    static struct nvs_sector_info info[8];
+    fs.sector_info = info;
+    ASSERT_EQ(nvs_clear(&fs), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    stats_workload(&fs, &st, &remount);
+    EXPECT_GT(st.gc_count, 0U);
+#endif
+}
+
+static int range_workload(struct nvs_fs *fs, std::map<nvs_id_t, std::vector<uint8_t>> &model,
+                          nvs_id_t id_count, int count) {
+    uint8_t val[32];
+
+    memset(val, 0x5a, sizeof(val));
+    for (int i = 0; i < count; i++) {
+        nvs_id_t id = rand() % id_count;
+        int op = rand() % 50;
+        if (op == 0) {
+            nvs_id_t last = std::min<nvs_id_t>(id + rand() % 200, id_count - 1);
+            if (nvs_delete_range(fs, id, last))
+                return -1;
+            model.erase(model.lower_bound(id), model.upper_bound(last));
+        } else if (op < 5) {
+            if (nvs_delete(fs, id))
+                return -1;
+            model.erase(id);
+        } else {
+            val[0] = i;
+            val[1] = i >> 8;
+            size_t len = 2 + rand() % (sizeof(val) - 1);
+            if (nvs_write(fs, id, val, len) != (ssize_t)len)
+                return -1;
+            model[id].assign(val, val + len);
+        }
+    }
+
+    return 0;
+}
+
+static void expect_model(struct nvs_fs *fs, const std::map<nvs_id_t, std::vector<uint8_t>> &model,
+                         nvs_id_t id_count) {
+    uint8_t buf[32];
+
+    for (nvs_id_t id = 0; id < id_count; id++) {
+        auto it = model.find(id);
+        ssize_t rc = nvs_read(fs, id, buf, sizeof(buf));
+        if (it == model.end()) {
+            ASSERT_EQ(rc, -ENOENT) << id;
+        } else {
+            ASSERT_EQ(rc, (ssize_t)it->second.size()) << id;
+            ASSERT_EQ(memcmp(buf, it->second.data(), rc), 0) << id;
+        }
+    }
+}
+
+TEST(NVSTest, nvsDeleteRange) {
+    struct nvs_fs fs;
+    struct nvs_stats stats, st, remount;
+    std::map<nvs_id_t, std::vector<uint8_t>> model;
+    const nvs_id_t id_count = 600;
+    uint8_t val[16];
+
+    memset(&fs, 0, sizeof(fs));
+    memset(&stats, 0, sizeof(stats));
+    fs.sector_size = FIXTURE_SECTOR_SIZE(4096);
+    fs.sector_count = FIXTURE_SECTOR_COUNT(16);
+    fs.impl_init = init_write_counting;
+    fs.lookup_cache = g_lookup_cache;
+    fs.lookup_cache_size = 256;
+    fs.stats = &stats;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_delete_range(&fs, 5, 4), -EINVAL);
+
+    for (nvs_id_t id = 0; id < id_count; id++) {
+        memset(val, id, sizeof(val));
+        ASSERT_EQ(nvs_write(&fs, id, val, sizeof(val)), (ssize_t)sizeof(val));
+        model[id].assign(val, val + sizeof(val));
+    }
+
+    /* wiping most ids costs the same as a single delete */
+    ASSERT_EQ(nvs_stats_get(&fs, &st), 0);
+    g_write_calls = 0;
+    ASSERT_EQ(nvs_delete_range(&fs, 100, 499), 0);
+    EXPECT_LE(g_write_calls, 2);
+    model.erase(model.lower_bound(100), model.upper_bound(499));
+    expect_model(&fs, model, id_count);
+    ASSERT_EQ(nvs_stats_get(&fs, &remount), 0);
+    EXPECT_EQ(remount.live_bytes, st.live_bytes / 3);
+    EXPECT_EQ(remount.tombstones, 1U);
+
+    /* ids of the range can be written again */
+    memset(val, 0xa5, sizeof(val));
+    ASSERT_EQ(nvs_write(&fs, 250, val, sizeof(val)), (ssize_t)sizeof(val));
+    model[250].assign(val, val + sizeof(val));
+    expect_model(&fs, model, id_count);
+
+    /* the range delete is found again when the lookup cache is rebuilt */
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    expect_model(&fs, model, id_count);
+    fs.lookup_cache_lazy = true;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    expect_model(&fs, model, id_count);
+    fs.lookup_cache_lazy = false;
+    fs.impl_parallel = thread_parallel;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    expect_model(&fs, model, id_count);
+    fs.impl_parallel = NULL;
+
+    /* gc drops range deletes once the entries they hide are erased */
+    srand(47);
+    ASSERT_EQ(range_workload(&fs, model, id_count, 4000), 0);
+    expect_model(&fs, model, id_count);
+    ASSERT_EQ(nvs_stats_get(&fs, &st), 0);
+    EXPECT_GT(st.gc_count, 0U);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    expect_model(&fs, model, id_count);
+    ASSERT_EQ(nvs_stats_get(&fs, &remount), 0);
+    EXPECT_EQ(remount.live_bytes, st.live_bytes);
+    EXPECT_EQ(remount.tombstones, st.tombstones);
+
+#ifdef CONFIG_NVS_GC_POLICY
+    /* range deletes kept by the gc policy */
+    static struct nvs_sector_info info[FIXTURE_SECTOR_COUNT(16)];
+    fs.sector_info = info;
+    ASSERT_EQ(nvs_clear(&fs), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    model.clear();
+    ASSERT_EQ(range_workload(&fs, model, id_count, 4000), 0);
+    expect_model(&fs, model, id_count);
+    ASSERT_EQ(nvs_stats_get(&fs, &st), 0);
+    uint32_t live[FIXTURE_SECTOR_COUNT(16)];
+    for (uint32_t i = 0; i < fs.sector_count; i++)
+        live[i] = info[i].live;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    expect_model(&fs, model, id_count);
+    ASSERT_EQ(nvs_stats_get(&fs, &remount), 0);
+    EXPECT_EQ(remount.live_bytes, st.live_bytes);
+    EXPECT_EQ(remount.tombstones, st.tombstones);
+    /* the live data of each sector is kept up to date as ranges hide it */
+    for (uint32_t i = 0; i < fs.sector_count; i++)
+        EXPECT_EQ(info[i].live, live[i]) << i;
+
+    /* the range is collected before the cold sector holding what it hides */
+    ASSERT_EQ(nvs_clear(&fs), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    model.clear();
+    for (nvs_id_t id = 0; id < 50; id++) {
+        for (nvs_id_t cold : { id, (nvs_id_t)(id + 200) }) {
+            memset(val, cold, sizeof(val));
+            ASSERT_EQ(nvs_write(&fs, cold, val, sizeof(val)), (ssize_t)sizeof(val));
+            model[cold].assign(val, val + sizeof(val));
+        }
+    }
+    ASSERT_EQ(nvs_sector_use_next(&fs), 0);
+    ASSERT_EQ(nvs_delete_range(&fs, 0, 49), 0);
+    model.erase(model.lower_bound(0), model.upper_bound(49));
+    for (int i = 0; i < 3000; i++) {
+        nvs_id_t id = 300 + i % 10;
+        val[0] = i;
+        val[1] = i >> 8;
+        ASSERT_EQ(nvs_write(&fs, id, val, sizeof(val)), (ssize_t)sizeof(val));
+        model[id].assign(val, val + sizeof(val));
+    }
+    expect_model(&fs, model, id_count);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    expect_model(&fs, model, id_count);
+
+    /* a kept range is not moved over ids of it written afterwards */
+    ASSERT_EQ(nvs_clear(&fs), 0);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    model.clear();
+    memset(val, 1, sizeof(val));
+    ASSERT_EQ(nvs_write(&fs, 1, val, sizeof(val)), (ssize_t)sizeof(val));
+    for (nvs_id_t cold = 100; cold < 200; cold++) {
+        memset(val, cold, sizeof(val));
+        ASSERT_EQ(nvs_write(&fs, cold, val, sizeof(val)), (ssize_t)sizeof(val));
+        model[cold].assign(val, val + sizeof(val));
+    }
+    ASSERT_EQ(nvs_sector_use_next(&fs), 0);
+    ASSERT_EQ(nvs_delete_range(&fs, 1, 10), 0);
+    for (uint32_t sector = fs.ate_wra >> 16, i = 0; (fs.ate_wra >> 16) == sector; i++) {
+        memset(val, 50, sizeof(val));
+        val[1] = i;
+        ASSERT_EQ(nvs_write(&fs, 50, val, sizeof(val)), (ssize_t)sizeof(val));
+    }
+    model[50].assign(val, val + sizeof(val));
+    memset(val, 2, sizeof(val));
+    ASSERT_EQ(nvs_write(&fs, 2, val, sizeof(val)), (ssize_t)sizeof(val));
+    model[2].assign(val, val + sizeof(val));
+    for (int i = 0; i < 3000; i++) {
+        val[0] = i;
+        val[1] = i >> 8;
+        ASSERT_EQ(nvs_write(&fs, 60, val, sizeof(val)), (ssize_t)sizeof(val));
+        model[60].assign(val, val + sizeof(val));
+    }
+    expect_model(&fs, model, id_count);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    expect_model(&fs, model, id_count);
+#endif
+}
+
+/* flash operations left before a simulated power cut, -1 for none */
+static int g_power_cut = -1;
+
+static int power_cut_step() {
+    if (g_power_cut == 0)
+        return -EIO;
+    if (g_power_cut > 0)
+        g_power_cut--;
+    return 0;
+}
+
+int cut_write(off_t offset, const void *data, size_t len) {
+    return power_cut_step() ? -EIO : impl_write(offset, data, len);
+}
+
+int cut_erase(off_t offset, size_t len) {
+    return power_cut_step() ? -EIO : impl_erase(offset, len);
+}
+
+struct fil g_cut_fil = {
+    .read = impl_read,
+    .write = cut_write,
+    .erase = cut_erase,
+};
+
+int init_cut() {
+    fil_init(&g_cut_fil, &g_fp);
+    return 0;
+}
+
+/* interrupt the write that triggers gc at every flash operation, a read-only
+ * mount leaves the image untouched and reads the same values as a mount that
+ * recovers
+ */
+static void read_only_gc_cuts(struct nvs_fs *fs) {
+    const size_t image_size = (size_t)fs->sector_size * fs->sector_count;
+    std::vector<uint8_t> base, cut;
+    std::map<nvs_id_t, std::vector<uint8_t>> model;
+    uint8_t val[64], buf[64];
+
+    init_before_test();
+    fs->read_only = false;
+    ASSERT_EQ(nvs_mount(fs), 0);
+    /* every sector holds cold values that gc has to move. Stop right before
+     * the write that closes the sector before the last, the offset of
+     * ate_wra in a 4096 byte sector fits the low 16 bits.
+     */
+    uint32_t sector = fs->ate_wra >> 16, closed = 0;
+    for (int i = 0; (closed < fs->sector_count - 2U) ||
+                    ((ssize_t)nvs_sector_max_data_size(fs) >= (ssize_t)sizeof(val)); i++) {
+        nvs_id_t id = (i % 3) ? i % 20 : 100 + i / 3;
+        memset(val, i, sizeof(val));
+        ASSERT_EQ(nvs_write(fs, id, val, sizeof(val)), (ssize_t)sizeof(val));
+        model[id].assign(val, val + sizeof(val));
+        if ((fs->ate_wra >> 16) != sector) {
+            sector = fs->ate_wra >> 16;
+            closed++;
+        }
+    }
+    base.assign(flash_sim, flash_sim + image_size);
+
+    auto check = [&](std::vector<uint8_t> &update) {
+        for (auto &kv : model) {
+            ASSERT_EQ(nvs_read(fs, kv.first, buf, sizeof(buf)), (ssize_t)sizeof(buf));
+            if (memcmp(buf, kv.second.data(), sizeof(buf))) {
+                ASSERT_TRUE((kv.first == 5) && !memcmp(buf, update.data(), sizeof(buf)));
+            }
+        }
+    };
+
+    std::vector<uint8_t> update(sizeof(val), 0xee);
+    for (int ops = 0; ops < 120; ops++) {
+        memcpy(flash_sim, base.data(), image_size);
+        fs->read_only = false;
+        ASSERT_EQ(nvs_mount(fs), 0);
+        g_power_cut = ops;
+        (void)nvs_write(fs, 5, update.data(), update.size());
+        g_power_cut = -1;
+        cut.assign(flash_sim, flash_sim + image_size);
+
+        fs->read_only = true;
+        ASSERT_EQ(nvs_mount(fs), 0) << ops;
+        check(update);
+        EXPECT_EQ(nvs_write(fs, 6, val, sizeof(val)), -EROFS);
+        EXPECT_EQ(nvs_delete(fs, 6), -EROFS);
+        EXPECT_EQ(nvs_sector_use_next(fs), -EROFS);
+        EXPECT_EQ(nvs_clear(fs), -EROFS);
+        ASSERT_EQ(memcmp(flash_sim, cut.data(), image_size), 0) << ops;
+
+        fs->read_only = false;
+        ASSERT_EQ(nvs_mount(fs), 0) << ops;
+        check(update);
+    }
+}
+
+TEST(NVSTest, nvsReadOnlyMount) {
+    struct nvs_fs fs;
+    uint8_t buf[16];
+
+    memset(&fs, 0, sizeof(fs));
+    fs.sector_size = FIXTURE_SECTOR_SIZE(4096);
+    fs.sector_count = FIXTURE_SECTOR_COUNT(4);
+    fs.impl_init = init_cut;
+    fs.lookup_cache = g_lookup_cache;
+    fs.lookup_cache_size = 256;
+
+    /* an empty partition stays empty */
+    init_before_test();
+    fs.read_only = true;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_read(&fs, 1, buf, sizeof(buf)), -ENOENT);
+    for (size_t i = 0; i < fs.sector_size * fs.sector_count; i++)
+        ASSERT_EQ(flash_sim[i], 0xff);
+
+    read_only_gc_cuts(&fs);
+    fs.lookup_cache = NULL;
+    read_only_gc_cuts(&fs);
+
+#ifdef CONFIG_NVS_GC_POLICY
+    static struct nvs_sector_info info[FIXTURE_SECTOR_COUNT(4)];
+    fs.lookup_cache = g_lookup_cache;
+    fs.sector_info = info;
+    read_only_gc_cuts(&fs);
+#endif
+}
+
+static size_t g_crc32_bytes;
+
+static uint32_t counting_crc32(uint32_t seed, const uint8_t *data, size_t len) {
+    g_crc32_bytes += len;
+    return crc32_c_update(seed, data, len);
+}
+
+static const struct crc_provider counting_crc = {
+    .crc8 = crc8_ccitt,
+    .crc32 = counting_crc32,
+};
+
+TEST(NVSTest, nvsCrcProvider) {
+    struct nvs_fs fs;
+    uint8_t val[100], rd[100];
+
+    /* the byte wise CRC32C matches the nibble one */
+    EXPECT_EQ(crc32_c_update(0, (const uint8_t *)"123456789", 9), 0xE3069283U);
+    EXPECT_EQ(crc32_c_update(crc32_c_update(0, (const uint8_t *)"1234", 4),
+                             (const uint8_t *)"56789", 5), 0xE3069283U);
+    EXPECT_EQ(crc32_c(0, (const uint8_t *)"123456789", 9, true, true), 0xE3069283U);
+
+    init_small_fs(&fs);
+    fs.crc = &counting_crc;
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    for (size_t i = 0; i < sizeof(val); i++)
+        val[i] = i;
+    g_crc32_bytes = 0;
+    ASSERT_EQ(nvs_write(&fs, 1, val, sizeof(val)), (ssize_t)sizeof(val));
+    EXPECT_EQ(nvs_read(&fs, 1, rd, sizeof(rd)), (ssize_t)sizeof(val));
+    EXPECT_EQ(memcmp(val, rd, sizeof(val)), 0);
+#ifdef CONFIG_NVS_DATA_CRC
+    EXPECT_GE(g_crc32_bytes, 2 * sizeof(val));
+
+    /* data written with one provider does not verify with another */
+    fs.crc = NULL;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_read(&fs, 1, rd, sizeof(rd)), -EIO);
+    fs.crc = &crc_provider_crc32c;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_read(&fs, 1, rd, sizeof(rd)), (ssize_t)sizeof(val));
+#endif
+
+    EXPECT_EQ(random_model(&fs, 10, 1000), 0);
+}
+
+#ifdef CONFIG_NVS_GC_POLICY
+TEST(NVSTest, nvsGcPolicy) {
+    static struct nvs_sector_info info[8];
+    struct nvs_fs fs;
+    uint32_t ring_wa;
+
+    /* ring order baseline */
+    init_small_fs(&fs);
+    fs.sector_count = 6;
+    SKIP_UNLESS_GEOMETRY(fs);
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    ASSERT_EQ(hot_cold_workload(NULL, &fs), 0);
+    ring_wa = nvs_write_amp(&fs);
+
+    /* a ring formatted partition is left alone */
+    fs.sector_info = info;
+    EXPECT_EQ(nvs_mount(&fs), -EDEADLK);
+
+    for (uint8_t policy : { NVS_GC_COST_BENEFIT, NVS_GC_GREEDY }) {
+        /* the static ids are no longer copied each time the ring wraps */
+        init_small_fs(&fs);
+        fs.sector_count = 6;
+        fs.sector_info = info;
+        fs.gc_policy = policy;
+        init_before_test();
+        ASSERT_EQ(nvs_mount(&fs), 0);
+        ASSERT_EQ(hot_cold_workload(NULL, &fs), 0);
+        EXPECT_LT(nvs_write_amp(&fs), ring_wa);
+        ASSERT_EQ(nvs_mount(&fs), 0);
+        EXPECT_EQ(hot_cold_workload(NULL, &fs), 0);
+
+        /* a delete is collected before the older sector holding the
+         * deleted value, it must be kept
+         */
+        EXPECT_EQ(nvs_delete(&fs, 5), 0);
+        for (uint32_t i = 0; i < 500; i++)
+            ASSERT_GE(nvs_write(&fs, 100 + i % 3, &i, sizeof(i)), 0);
+        ASSERT_EQ(nvs_mount(&fs), 0);
+        uint8_t buf[40];
+        EXPECT_EQ(nvs_read(&fs, 5, buf, sizeof(buf)), -ENOENT);
+        EXPECT_EQ(nvs_read(&fs, 6, buf, sizeof(buf)), sizeof(buf));
+
+        /* random workload with remounts */
+        init_small_fs(&fs);
+        fs.sector_info = info;
+        fs.gc_policy = policy;
+        init_before_test();
+        ASSERT_EQ(nvs_mount(&fs), 0);
+        EXPECT_EQ(random_model(&fs, 0, 3000), 0);
+    }
+
+    /* a delete dropped with its sector empties a cache position that is
+     * shared with an id whose value is in a sector that is kept. Some of
+     * the ids 1 to 5 share a position while the hot id is in the other.
+     */
+    for (nvs_id_t a = 1; a <= 5; a++) {
+        for (nvs_id_t b = 1; b <= 5; b++) {
+            for (nvs_id_t hot = 1; hot <= 5; hot++) {
+                uint32_t val = 0x1234, rd, wra;
+                uint8_t fill[32] = { 0 };
+
+                if (a == b || a == hot || b == hot)
+                    continue;
+                init_small_fs(&fs);
+                fs.sector_size = 512;
+                fs.sector_count = 3;
+                fs.lookup_cache_size = 2;
+                fs.sector_info = info;
+                fs.gc_policy = NVS_GC_GREEDY;
+                init_before_test();
+                ASSERT_EQ(nvs_mount(&fs), 0);
+                ASSERT_GE(nvs_write(&fs, a, &val, sizeof(val)), 0);
+                /* static ids fill most of sector 0, the hot id the rest
+                 * up to the next sector, where the ATEs are written at a
+                 * higher address
+                 */
+                for (nvs_id_t id = 10; fs.ate_wra - fs.data_wra > 128; id++)
+                    ASSERT_GE(nvs_write(&fs, id, fill, sizeof(fill)), 0);
+                wra = fs.ate_wra;
+                for (uint32_t i = 0; fs.ate_wra <= wra; i++)
+                    ASSERT_GE(nvs_write(&fs, hot, &i, sizeof(i)), 0);
+                ASSERT_GE(nvs_write(&fs, b, &val, sizeof(val)), 0);
+                ASSERT_EQ(nvs_delete(&fs, b), 0);
+                for (uint32_t i = 0; i < 200; i++) {
+                    ASSERT_GE(nvs_write(&fs, hot, &i, sizeof(i)), 0);
+                    ASSERT_EQ(nvs_read(&fs, a, &rd, sizeof(rd)), sizeof(rd));
+                    ASSERT_EQ(nvs_read(&fs, b, &rd, sizeof(rd)), -ENOENT);
+                }
+                EXPECT_EQ(rd, val);
+            }
+        }
+    }
+
+    /* the sector order needs the lookup cache */
+    init_small_fs(&fs);
+    fs.sector_info = info;
+    fs.lookup_cache = NULL;
+    EXPECT_EQ(nvs_mount(&fs), -EINVAL);
+}
+#endif
+
+#ifdef CONFIG_NVS_PACKED_ATE
+/* flash with 32 byte program units that can only be programmed once */
+static int g_program_errors, g_programs;
+
+int impl_write_once(off_t offset, const void *data, size_t len) {
+    g_programs++;
+    if (offset % 32 || len % 32)
+        g_program_errors++;
+    for (size_t i = 0; i < len; i++)
+        if (flash_sim[offset + i] != 0xff)
+            g_program_errors++;
+    return impl_write(offset, data, len);
+}
+
+struct fil g_fil_once = {
+    .read = impl_read,
+    .write = impl_write_once,
+    .erase = impl_erase,
+};
+
+struct flash_parameters g_fp32 = {
+    .write_block_size = 32,
+    .erase_value = 0xff,
+};
+
+int init_write_once() {
+    fil_init(&g_fil_once, &g_fp32);
+    return 0;
+}
+
+TEST(NVSTest, nvsPackedAte) {
+    struct nvs_fs fs;
+    uint32_t v;
+    off_t blk;
+
+    init_before_test();
+    init_small_fs(&fs);
+    fs.sector_size = 2048;
+    SKIP_UNLESS_GEOMETRY(fs, g_fp32);
+    fs.impl_init = init_write_once;
+    g_program_errors = 0;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    for (v = 0; v < 20; v++)
+        ASSERT_EQ(nvs_write(&fs, v, &v, sizeof(v)), sizeof(v));
+
+    /* the gc of the first sector moves all entries, their ates are
+     * programmed four at a time
+     */
+    for (int i = 0; i < 6; i++)
+        ASSERT_EQ(nvs_sector_use_next(&fs), 0);
+    g_programs = 0;
+    ASSERT_EQ(nvs_sector_use_next(&fs), 0);
+    EXPECT_LT(g_programs, 2 * 20);
+    EXPECT_EQ(g_program_errors, 0);
+
+    /* a torn program of the next ate block: either slot may have been
+     * programmed, the block is skipped after a remount
+     */
+    for (off_t slot : { (off_t)24, (off_t)0 }) {
+        blk = 7 * 2048 + (fs.ate_wra & 2047) - 24;
+        memset(&flash_sim[blk + slot], 0, 8);
+        ASSERT_EQ(nvs_mount(&fs), 0);
+        v = 1234 + slot;
+        ASSERT_EQ(nvs_write(&fs, 100, &v, sizeof(v)), sizeof(v));
+        EXPECT_EQ(g_program_errors, 0);
+    }
+
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    for (v = 0; v < 20; v++) {
+        uint32_t rd;
+        ASSERT_EQ(nvs_read(&fs, v, &rd, sizeof(rd)), sizeof(rd));
+        EXPECT_EQ(rd, v);
+    }
+    EXPECT_EQ(nvs_read(&fs, 100, &v, sizeof(v)), sizeof(v));
+    EXPECT_EQ(v, 1234U);
+
+    /* random workload on the write once flash */
+    init_before_test();
+    init_small_fs(&fs);
+    fs.impl_init = init_write_once;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(random_model(&fs, 0, 3000), 0);
+    EXPECT_EQ(g_program_errors, 0);
+}
+#endif
+
+#ifdef CONFIG_NVS_INLINE_VALUE
+TEST(NVSTest, nvsInlineValue) {
+    struct nvs_fs fs;
+    uint8_t big[40], rd[40];
+    uint16_t val;
+    uint32_t data_wra;
+
+    init_small_fs(&fs);
+    init_before_test();
+    ASSERT_EQ(nvs_mount(&fs), 0);
+
+    /* tiny values do not use the data area */
+    data_wra = fs.data_wra;
+    val = 0x1234;
+    ASSERT_EQ(nvs_write(&fs, 1, &val, sizeof(val)), (ssize_t)sizeof(val));
+    ASSERT_EQ(nvs_write(&fs, 2, "x", 1), 1);
+    EXPECT_EQ(fs.data_wra, data_wra);
+    val = 0;
+    EXPECT_EQ(nvs_read(&fs, 1, &val, sizeof(val)), (ssize_t)sizeof(val));
+    EXPECT_EQ(val, 0x1234);
+    EXPECT_EQ(nvs_read(&fs, 2, rd, sizeof(rd)), 1);
+    EXPECT_EQ(rd[0], 'x');
+
+    /* partial reads and unchanged rewrites */
+    rd[1] = 0xaa;
+    EXPECT_EQ(nvs_read(&fs, 1, rd, 1), (ssize_t)sizeof(val));
+    EXPECT_EQ(rd[0], 0x34);
+    EXPECT_EQ(rd[1], 0xaa);
+    val = 0x1234;
+    EXPECT_EQ(nvs_write(&fs, 1, &val, sizeof(val)), 0);
+
+    /* data written after an inline entry does not overlap older data */
+    memset(big, 0x5a, sizeof(big));
+    ASSERT_EQ(nvs_write(&fs, 3, big, sizeof(big)), (ssize_t)sizeof(big));
+    val = 0x4321;
+    ASSERT_EQ(nvs_write(&fs, 1, &val, sizeof(val)), (ssize_t)sizeof(val));
+    data_wra = fs.data_wra;
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(fs.data_wra, data_wra);
+    memset(rd, 0xa5, sizeof(rd));
+    ASSERT_EQ(nvs_write(&fs, 4, rd, sizeof(rd)), (ssize_t)sizeof(rd));
+    EXPECT_EQ(nvs_read(&fs, 3, rd, sizeof(rd)), (ssize_t)sizeof(big));
+    EXPECT_EQ(memcmp(big, rd, sizeof(big)), 0);
+
+    /* counters survive gc and remounts */
+    for (uint16_t i = 0; i < 2000; i++) {
+        ASSERT_EQ(nvs_write(&fs, 10 + i % 8, &i, sizeof(i)), (ssize_t)sizeof(i));
+    }
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    for (uint16_t i = 2000 - 8; i < 2000; i++) {
+        EXPECT_EQ(nvs_read(&fs, 10 + i % 8, &val, sizeof(val)), (ssize_t)sizeof(val));
+        EXPECT_EQ(val, i);
+    }
+    EXPECT_EQ(nvs_read(&fs, 2, rd, sizeof(rd)), 1);
+    EXPECT_EQ(nvs_read(&fs, 3, rd, sizeof(rd)), (ssize_t)sizeof(big));
+    EXPECT_EQ(memcmp(big, rd, sizeof(big)), 0);
+
+    EXPECT_EQ(random_model(&fs, 30, 2000), 0);
+}
+#endif
+
+#ifdef CONFIG_NVS_ID_32BIT
+static void check_wide_ids(struct nvs_fs *fs) {
+    char buf[2];
+
+    EXPECT_EQ(nvs_read(fs, 0x00010001, buf, sizeof(buf)), 2);
+    EXPECT_STREQ(buf, "a");
+    EXPECT_EQ(nvs_read(fs, 0x00020001, buf, sizeof(buf)), 2);
+    EXPECT_STREQ(buf, "b");
+    EXPECT_EQ(nvs_read(fs, 1, buf, sizeof(buf)), 2);
+    EXPECT_STREQ(buf, "z");
+    EXPECT_EQ(nvs_read(fs, 0x00030001, buf, sizeof(buf)), -ENOENT);
+}
+
+TEST(NVSTest, nvsWideIds) {
+    struct nvs_fs fs;
+
+    init_small_fs(&fs);
+    init_before_test();
+    EXPECT_EQ(nvs_mount(&fs), 0);
+    /* ids that would alias in a 16-bit id space */
+    EXPECT_EQ(nvs_write(&fs, 0x00010001, "a", 2), 2);
+    EXPECT_EQ(nvs_write(&fs, 0x00020001, "b", 2), 2);
+    EXPECT_EQ(nvs_write(&fs, 1, "z", 2), 2);
+    EXPECT_EQ(nvs_write(&fs, NVS_ID_MAX + 1, "c", 2), -EINVAL);
+    check_wide_ids(&fs);
+
+    EXPECT_EQ(random_model(&fs, 0xABCD0000, 1000), 0);
+    check_wide_ids(&fs);
+    ASSERT_EQ(nvs_mount(&fs), 0);
+    check_wide_ids(&fs);
+}
+#endif
+
+#ifdef CONFIG_NVS_WIDE_ADDR
+TEST(NVSTest, nvsLargeSectors) {
+    static uint8_t big[100000], rd[sizeof(big)];
+    struct nvs_fs fs;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.sector_size = 256 * 1024;
+    fs.sector_count = sizeof(flash_sim) / fs.sector_size;
+    SKIP_UNLESS_GEOMETRY(fs);
+    fs.impl_init = init_keep_flash;
+    init_before_test();
+    EXPECT_EQ(nvs_mount(&fs), 0);
+
+    for (size_t i = 0; i < sizeof(big); i++)
+        big[i] = i * 7;
+    /* a value larger than what a 16-bit ATE length can describe */
+    EXPECT_EQ(nvs_write(&fs, 1, big, sizeof(big)), (ssize_t)sizeof(big));
+    EXPECT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(nvs_read(&fs, 1, rd, sizeof(rd)), (ssize_t)sizeof(big));
+    EXPECT_EQ(memcmp(big, rd, sizeof(big)), 0);
+    EXPECT_EQ(random_model(&fs, 100, 1000), 0);
+}
+#endif
+
+#ifdef CONFIG_NVS_CHECKPOINT
+TEST(NVSTest, nvsCheckpoint) {
+    static uint32_t cache[64];
+    struct nvs_fs fs;
+    char buf[32];
+
+    memset(&fs, 0, sizeof(fs));
+    fs.sector_size = 4096;
+    fs.sector_count = 8;
+    SKIP_UNLESS_GEOMETRY(fs);
+    fs.impl_init = init_keep_flash;
+    fs.lookup_cache = cache;
+    fs.lookup_cache_size = 64;
+    init_before_test();
+    EXPECT_EQ(nvs_mount(&fs), 0);
+
+    for (int i = 0; i < 100; i++) {
+        int len = sprintf(buf, "before %d", i);
+        EXPECT_EQ(nvs_write(&fs, i, buf, len + 1), len + 1);
+    }
+    EXPECT_EQ(nvs_checkpoint(&fs), 0);
+    for (int i = 50; i < 150; i++) {
+        int len = sprintf(buf, "after %d", i);
+        EXPECT_EQ(nvs_write(&fs, i, buf, len + 1), len + 1);
+    }
+    EXPECT_EQ(nvs_delete(&fs, 7), 0);
+
+    /* the remount loads the checkpoint and replays the newer entries */
+    EXPECT_EQ(nvs_mount(&fs), 0);
+    for (int i = 0; i < 150; i++) {
+        char expected[32];
+        int len = sprintf(expected, i < 50 ? "before %d" : "after %d", i);
+        if (i == 7) {
+            EXPECT_EQ(nvs_read(&fs, i, buf, sizeof(buf)), -ENOENT);
+            continue;
+        }
+        EXPECT_EQ(nvs_read(&fs, i, buf, sizeof(buf)), len + 1);
+        EXPECT_STREQ(buf, expected);
+    }
+
+    EXPECT_EQ(random_model(&fs, 200, 2000), 0);
+}
+#endif
+
+struct typed_sample {
+    uint32_t a;
+    uint16_t b;
+    uint8_t c[6];
+};
+
+TEST(NVSTest, nvsTypedApi) {
+    struct nvs_fs fs;
+    struct typed_sample in = {0x12345678, 0xabcd, {1, 2, 3, 4, 5, 6}}, out = {};
+    uint16_t arr[16], rd[16] = {}, part[8] = {};
+    uint32_t small = 42;
+
+    init_small_fs(&fs);
+    init_before_test();
+    fs.sector_count = 1;
+    {
+        nvs::handle h(fs);
+        EXPECT_FALSE(h);
+        EXPECT_EQ(h.error(), -EINVAL);
+    }
+    init_small_fs(&fs);
+
+    {
+        nvs::handle h(fs);
+        ASSERT_TRUE(h);
+
+        /* single objects */
+        EXPECT_EQ(h.put(1, in), (ssize_t)sizeof(in));
+        EXPECT_EQ(h.get(1, out), 0);
+        EXPECT_EQ(memcmp(&in, &out, sizeof(in)), 0);
+        auto value = h.get<typed_sample>(1);
+        ASSERT_TRUE(value.has_value());
+        EXPECT_EQ(value->a, in.a);
+        EXPECT_EQ(h.get(2, out), -ENOENT);
+        EXPECT_FALSE(h.get<typed_sample>(2).has_value());
+
+        /* an entry of another size is not taken for a typed_sample */
+        EXPECT_EQ(nvs::put(fs, 2, small), (ssize_t)sizeof(small));
+        EXPECT_EQ(nvs::get(fs, 2, out), -EBADMSG);
+        EXPECT_EQ(nvs::get<uint32_t>(fs, 2).value_or(0), 42U);
+
+        /* arrays */
+        for (int i = 0; i < 16; i++)
+            arr[i] = i * 3;
+        EXPECT_EQ(h.write(3, nvs::span<const uint16_t>(arr)), (ssize_t)sizeof(arr));
+        EXPECT_EQ(h.read(3, nvs::span<uint16_t>(rd)), (ssize_t)sizeof(rd));
+        EXPECT_EQ(memcmp(arr, rd, sizeof(arr)), 0);
+        EXPECT_EQ(h.read(3, nvs::span<uint16_t>(part)), (ssize_t)sizeof(arr));
+        EXPECT_EQ(memcmp(arr, part, sizeof(part)), 0);
+
+        /* spans over containers, a mutable span is also a const one */
+        std::vector<uint16_t> vec(arr, arr + 16);
+        vec[0] = 0x5a5a;
+        nvs::span<uint16_t> vspan(vec);
+        nvs::span<const uint16_t> cspan = vspan;
+        EXPECT_EQ(h.write(5, cspan), (ssize_t)sizeof(arr));
+        std::vector<uint16_t> vrd(16);
+        EXPECT_EQ(h.read(5, nvs::span(vrd)), (ssize_t)sizeof(arr));
+        EXPECT_EQ(vrd, vec);
+
+        EXPECT_EQ(h.remove(1), 0);
+        EXPECT_EQ(h.get(1, out), -ENOENT);
+        EXPECT_EQ(h.put(1, in), (ssize_t)sizeof(in));
+
+        /* the moved from handle no longer syncs */
+        nvs::handle moved(std::move(h));
+        EXPECT_TRUE(moved);
+        EXPECT_FALSE(h);
+    }
+
+#ifdef CONFIG_NVS_WRITE_BACK
+    /* the handle writes pending values when it goes out of scope */
+    static uint8_t slot_buf[sizeof(typed_sample)];
+    struct nvs_wb_slot slot = {};
+
+    slot.id = 4;
+    slot.data = slot_buf;
+    slot.size = sizeof(slot_buf);
+    fs.wb_slots = &slot;
+    fs.wb_slot_count = 1;
+    {
+        nvs::handle h(fs);
+        ASSERT_TRUE(h);
+        EXPECT_EQ(h.put(4, in), (ssize_t)sizeof(in));
+        EXPECT_TRUE(slot.dirty);
+    }
+    EXPECT_FALSE(slot.dirty);
+    fs.wb_slots = NULL;
+    fs.wb_slot_count = 0;
+#endif
+
+    nvs::handle h(fs);
+    ASSERT_TRUE(h);
+    EXPECT_EQ(h.get(1, out), 0);
+    EXPECT_EQ(memcmp(&in, &out, sizeof(in)), 0);
+#ifdef CONFIG_NVS_WRITE_BACK
+    EXPECT_EQ(h.get(4, out), 0);
+    EXPECT_EQ(memcmp(&in, &out, sizeof(in)), 0);
+#endif
+    EXPECT_EQ(h.read(3, nvs::span<uint16_t>(rd)), (ssize_t)sizeof(rd));
+    EXPECT_EQ(memcmp(arr, rd, sizeof(arr)), 0);
+}
+
+#if defined(CONFIG_NVS_FIXED_WRITE_BLOCK_SIZE) && defined(CONFIG_NVS_FIXED_SECTOR_SIZE) && \
+    defined(CONFIG_NVS_FIXED_SECTOR_COUNT)
+TEST(NVSTest, nvsFixedGeometry) {
+    struct nvs_fs fs;
+    struct flash_parameters fp = {
+        .write_block_size = CONFIG_NVS_FIXED_WRITE_BLOCK_SIZE,
+        .erase_value = 0xff,
+    };
+    struct flash_parameters wide_fp = {
+        .write_block_size = 2 * CONFIG_NVS_FIXED_WRITE_BLOCK_SIZE,
+        .erase_value = 0xff,
+    };
+
+    init_small_fs(&fs);
+    fs.sector_size = CONFIG_NVS_FIXED_SECTOR_SIZE;
+    fs.sector_count = CONFIG_NVS_FIXED_SECTOR_COUNT;
+    fs.impl_init = NULL;
+    fil_init(&g_fil, &fp);
+    memset(flash_sim, 0xff, sizeof(flash_sim));
+    EXPECT_EQ(nvs_mount(&fs), 0);
+    EXPECT_EQ(random_model(&fs, 0, 3000), 0);
+
+    /* any other geometry is refused */
+    fs.sector_size = 2 * CONFIG_NVS_FIXED_SECTOR_SIZE;
+    EXPECT_EQ(nvs_mount(&fs), -EINVAL);
+    fs.sector_size = CONFIG_NVS_FIXED_SECTOR_SIZE;
+    fs.sector_count = CONFIG_NVS_FIXED_SECTOR_COUNT + 1;
+    EXPECT_EQ(nvs_mount(&fs), -EINVAL);
+    fs.sector_count = CONFIG_NVS_FIXED_SECTOR_COUNT;
+    fil_init(&g_fil, &wide_fp);
+    EXPECT_EQ(nvs_mount(&fs), -EINVAL);
+    fil_init(&g_fil, &fp);
+    EXPECT_EQ(nvs_mount(&fs), 0);
+
+    fil_init(&g_fil, &g_fp);
+}
+#endif
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
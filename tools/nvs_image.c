@@ -0,0 +1,221 @@
+/*  nvs_image: build a mount-ready NVS partition image on the host
+ *
+ * Copyright (c) 2024 imwoo90
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * usage: nvs_image --sector-size N --sector-count N [--write-block-size N]
+ *                  [--erase-value N] -o image.bin id=hexbytes|id=@file ...
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nvs_image.h>
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s --sector-size N --sector-count N [--write-block-size N]\n"
+		"       [--erase-value N] -o image.bin id=hexbytes|id=@file ...\n",
+		prog);
+}
+
+static int parse_num(const char *s, unsigned long max, unsigned long *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoul(s, &end, 0);
+	if (errno || (end == s) || *end || (*val > max)) {
+		fprintf(stderr, "invalid number: %s\n", s);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int parse_hex(const char *s, struct nvs_image_entry *entry)
+{
+	size_t n = strlen(s);
+	uint8_t *data;
+	unsigned int byte;
+
+	if (n % 2U) {
+		fprintf(stderr, "odd number of hex digits: %s\n", s);
+		return -EINVAL;
+	}
+
+	data = malloc(n / 2U + 1U);
+	if (!data) {
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < n / 2U; i++) {
+		if (sscanf(&s[2U * i], "%2x", &byte) != 1) {
+			fprintf(stderr, "invalid hex value: %s\n", s);
+			free(data);
+			return -EINVAL;
+		}
+		data[i] = (uint8_t)byte;
+	}
+
+	entry->data = data;
+	entry->len = n / 2U;
+	return 0;
+}
+
+static int parse_file(const char *path, struct nvs_image_entry *entry)
+{
+	FILE *f = fopen(path, "rb");
+	uint8_t *data;
+	long size;
+
+	if (!f) {
+		perror(path);
+		return -ENOENT;
+	}
+
+	if (fseek(f, 0, SEEK_END) || ((size = ftell(f)) < 0) || fseek(f, 0, SEEK_SET)) {
+		perror(path);
+		fclose(f);
+		return -EIO;
+	}
+
+	data = malloc((size_t)size + 1U);
+	if (!data) {
+		fclose(f);
+		return -ENOMEM;
+	}
+
+	if (fread(data, 1, (size_t)size, f) != (size_t)size) {
+		perror(path);
+		free(data);
+		fclose(f);
+		return -EIO;
+	}
+
+	fclose(f);
+	entry->data = data;
+	entry->len = (size_t)size;
+	return 0;
+}
+
+static int parse_entry(char *arg, struct nvs_image_entry *entry)
+{
+	char *value = strchr(arg, '=');
+	unsigned long id;
+
+	if (!value) {
+		fprintf(stderr, "expected id=value: %s\n", arg);
+		return -EINVAL;
+	}
+
+	*value++ = '\0';
+	if (parse_num(arg, NVS_ID_MAX, &id)) {
+		return -EINVAL;
+	}
+	entry->id = (nvs_id_t)id;
+
+	if (*value == '@') {
+		return parse_file(value + 1, entry);
+	}
+
+	return parse_hex(value, entry);
+}
+
+int main(int argc, char **argv)
+{
+	struct nvs_image_geometry geo = {
+		.write_block_size = 1U,
+		.erase_value = 0xff,
+	};
+	struct nvs_image_entry *entries;
+	const char *out = NULL;
+	size_t count = 0U, image_size;
+	unsigned long val;
+	uint8_t *image;
+	FILE *f;
+	int err, rc = 1;
+
+	entries = calloc(argc, sizeof(*entries));
+	if (!entries) {
+		return 1;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		const char *opt = argv[i];
+
+		if ((opt[0] == '-') && (i + 1 == argc)) {
+			usage(argv[0]);
+			goto out;
+		}
+
+		if (!strcmp(opt, "--sector-size")) {
+			if (parse_num(argv[++i], UINT32_MAX, &val)) {
+				goto out;
+			}
+			geo.sector_size = (uint32_t)val;
+		} else if (!strcmp(opt, "--sector-count")) {
+			if (parse_num(argv[++i], UINT16_MAX, &val)) {
+				goto out;
+			}
+			geo.sector_count = (uint16_t)val;
+		} else if (!strcmp(opt, "--write-block-size")) {
+			if (parse_num(argv[++i], 32U, &val)) {
+				goto out;
+			}
+			geo.write_block_size = (size_t)val;
+		} else if (!strcmp(opt, "--erase-value")) {
+			if (parse_num(argv[++i], UINT8_MAX, &val)) {
+				goto out;
+			}
+			geo.erase_value = (uint8_t)val;
+		} else if (!strcmp(opt, "-o")) {
+			out = argv[++i];
+		} else if (opt[0] == '-') {
+			usage(argv[0]);
+			goto out;
+		} else if (parse_entry(argv[i], &entries[count++])) {
+			goto out;
+		}
+	}
+
+	if (!out || !geo.sector_size || !geo.sector_count) {
+		usage(argv[0]);
+		goto out;
+	}
+
+	image_size = (size_t)geo.sector_size * geo.sector_count;
+	image = malloc(image_size);
+	if (!image) {
+		goto out;
+	}
+
+	err = nvs_image_build(&geo, entries, count, image, image_size);
+	if (err) {
+		fprintf(stderr, "building the image failed: %d\n", err);
+		free(image);
+		goto out;
+	}
+
+	f = fopen(out, "wb");
+	if (!f || (fwrite(image, 1, image_size, f) != image_size)) {
+		perror(out);
+	} else {
+		rc = 0;
+	}
+	if (f && fclose(f)) {
+		perror(out);
+		rc = 1;
+	}
+	free(image);
+
+out:
+	for (size_t i = 0; i < count; i++) {
+		free((void *)entries[i].data);
+	}
+	free(entries);
+	return rc;
+}